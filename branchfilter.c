@@ -0,0 +1,223 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "branchfilter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BRANCHFILTER_BUFFER_SIZE (1 << 20)
+
+#define x86_ms_byte(b) ((b) == 0 || (b) == 0xFF)
+
+/* The x86 filter from XZ Utils: E8/E9 operands that look like near targets are made absolute */
+static size_t x86_code(branchfilter_t *filter, uint8_t *buf, size_t size) {
+	static const bool mask_to_allowed_status[8] = {true, true, true, false, true, false, false, false};
+	static const uint32_t mask_to_bit_number[8] = {0, 1, 2, 2, 3, 3, 3, 3};
+	
+	uint32_t now_pos = filter->pos;
+	uint32_t prev_mask = filter->prev_mask;
+	uint32_t prev_pos = filter->prev_pos;
+	if (size < 5) return 0;
+	if (now_pos - prev_pos > 5) prev_pos = now_pos - 5;
+	
+	size_t limit = size - 5;
+	size_t i = 0;
+	while (i <= limit) {
+		uint8_t b = buf[i];
+		if (b != 0xE8 && b != 0xE9) {
+			i++;
+			continue;
+		}
+		
+		uint32_t offset = now_pos + (uint32_t)i - prev_pos;
+		prev_pos = now_pos + (uint32_t)i;
+		if (offset > 5) {
+			prev_mask = 0;
+		} else {
+			for (uint32_t j = 0; j < offset; j++) {
+				prev_mask &= 0x77;
+				prev_mask <<= 1;
+			}
+		}
+		
+		b = buf[i + 4];
+		if (x86_ms_byte(b) && mask_to_allowed_status[(prev_mask >> 1) & 7] && (prev_mask >> 1) < 0x10) {
+			uint32_t src = ((uint32_t)b << 24) | ((uint32_t)buf[i + 3] << 16) | ((uint32_t)buf[i + 2] << 8) | buf[i + 1];
+			uint32_t dest;
+			while (true) {
+				if (filter->encode)
+					dest = src + (now_pos + (uint32_t)i + 5);
+				else
+					dest = src - (now_pos + (uint32_t)i + 5);
+				if (!prev_mask)
+					break;
+				uint32_t bit = mask_to_bit_number[prev_mask >> 1];
+				b = (uint8_t)(dest >> (24 - bit * 8));
+				if (!x86_ms_byte(b))
+					break;
+				src = dest ^ ((1U << (32 - bit * 8)) - 1);
+			}
+			buf[i + 4] = ~(((dest >> 24) & 1) - 1);
+			buf[i + 3] = (uint8_t)(dest >> 16);
+			buf[i + 2] = (uint8_t)(dest >> 8);
+			buf[i + 1] = (uint8_t)dest;
+			i += 5;
+			prev_mask = 0;
+		} else {
+			i++;
+			prev_mask |= 1;
+			if (x86_ms_byte(b)) prev_mask |= 0x10;
+		}
+	}
+	
+	filter->prev_mask = prev_mask;
+	filter->prev_pos = prev_pos;
+	return i;
+}
+
+/* The ARM64 filter from XZ Utils: BL and ADRP immediates are made absolute */
+static size_t arm64_code(branchfilter_t *filter, uint8_t *buf, size_t size) {
+	size_t i;
+	for (i = 0; i + 4 <= size; i += 4) {
+		uint32_t pc = filter->pos + (uint32_t)i;
+		uint32_t instr = buf[i] | ((uint32_t)buf[i + 1] << 8) | ((uint32_t)buf[i + 2] << 16) | ((uint32_t)buf[i + 3] << 24);
+		
+		if ((instr >> 26) == 0x25) {
+			uint32_t src = instr;
+			pc >>= 2;
+			if (!filter->encode) pc = 0U - pc;
+			instr = 0x94000000 | ((src + pc) & 0x03FFFFFF);
+		} else if ((instr & 0x9F000000) == 0x90000000) {
+			uint32_t src = ((instr >> 29) & 3) | ((instr >> 3) & 0x001FFFFC);
+			
+			/* Only targets within +-512 MB, the rest are rarely real ADRPs */
+			if ((src + 0x00020000) & 0x001C0000)
+				continue;
+			
+			pc >>= 12;
+			if (!filter->encode) pc = 0U - pc;
+			uint32_t dest = src + pc;
+			instr &= 0x9000001F;
+			instr |= (dest & 3) << 29;
+			instr |= (dest & 0x0003FFFC) << 3;
+			instr |= (0U - (dest & 0x00020000)) & 0x00E00000;
+		} else {
+			continue;
+		}
+		
+		buf[i] = (uint8_t)instr;
+		buf[i + 1] = (uint8_t)(instr >> 8);
+		buf[i + 2] = (uint8_t)(instr >> 16);
+		buf[i + 3] = (uint8_t)(instr >> 24);
+	}
+	return i;
+}
+
+void branchfilter_init(branchfilter_t *filter, branchfilter_type_t type, bool encode) {
+	filter->type = type;
+	filter->encode = encode;
+	filter->pos = 0;
+	filter->prev_mask = 0;
+	filter->prev_pos = (uint32_t)-5;
+}
+
+/*
+ * Filters buf in place and returns how many bytes are done. The rest has
+ * to be passed again together with the data that follows it; whatever is
+ * left at the end of the stream stays unfiltered.
+ */
+size_t branchfilter_code(branchfilter_t *filter, uint8_t *buf, size_t size) {
+	size_t done;
+	switch (filter->type) {
+		case BRANCHFILTER_X86:
+			done = x86_code(filter, buf, size);
+			break;
+		case BRANCHFILTER_ARM64:
+			done = arm64_code(filter, buf, size);
+			break;
+		default:
+			done = size;
+			break;
+	}
+	filter->pos += (uint32_t)done;
+	return done;
+}
+
+/*
+ * Filters a whole file into out_fd at the same offsets; in_fd and out_fd
+ * may be the same descriptor to filter in place. If hash is given it is
+ * updated with the bytes written.
+ */
+bool branchfilter_fd(branchfilter_type_t type, bool encode, int in_fd, int out_fd, EVP_MD_CTX *hash) {
+	uint8_t *buf = malloc(BRANCHFILTER_BUFFER_SIZE);
+	if (!buf) return false;
+	
+	branchfilter_t filter;
+	branchfilter_init(&filter, type, encode);
+	
+	bool ok = true;
+	off_t offset = 0;
+	while (true) {
+		ssize_t length = pread(in_fd, buf, BRANCHFILTER_BUFFER_SIZE, offset);
+		if (length < 0) {
+			ok = false;
+			break;
+		}
+		if (!length) break;
+		
+		/* A short read means the end, the unfiltered tail is written as is */
+		size_t done = branchfilter_code(&filter, buf, length);
+		if (length < BRANCHFILTER_BUFFER_SIZE) done = length;
+		if (pwrite(out_fd, buf, done, offset) != (ssize_t)done) {
+			ok = false;
+			break;
+		}
+		if (hash && !EVP_DigestUpdate(hash, buf, done)) {
+			ok = false;
+			break;
+		}
+		offset += done;
+	}
+	
+	free(buf);
+	return ok;
+}
+
+bool branchfilter_parse(const char *name, branchfilter_type_t *type) {
+	if (!strcmp(name, "x86")) *type = BRANCHFILTER_X86;
+	else if (!strcmp(name, "arm64")) *type = BRANCHFILTER_ARM64;
+	else return false;
+	return true;
+}
+
+const char *branchfilter_name(branchfilter_type_t type) {
+	switch (type) {
+		case BRANCHFILTER_X86: return "x86";
+		case BRANCHFILTER_ARM64: return "arm64";
+		default: return "none";
+	}
+}
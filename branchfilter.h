@@ -0,0 +1,63 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef branchfilter_h
+#define branchfilter_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <openssl/evp.h>
+
+/*
+ * Branch address normalisation for executables, as in XZ's BCJ filters.
+ * Relative call/jump targets (x86 E8/E9, ARM64 BL and ADRP) are turned
+ * into absolute ones, so code that merely moved keeps identical bytes and
+ * diffs well. Decoding restores the original bytes exactly.
+ */
+
+typedef enum {
+	BRANCHFILTER_NONE = 0,
+	BRANCHFILTER_X86 = 1,
+	BRANCHFILTER_ARM64 = 2,
+} branchfilter_type_t;
+
+typedef struct {
+	branchfilter_type_t type;
+	bool encode;
+	uint32_t pos;
+	uint32_t prev_mask;
+	uint32_t prev_pos;
+} branchfilter_t;
+
+void branchfilter_init(branchfilter_t *filter, branchfilter_type_t type, bool encode);
+size_t branchfilter_code(branchfilter_t *filter, uint8_t *buf, size_t size);
+bool branchfilter_fd(branchfilter_type_t type, bool encode, int in_fd, int out_fd, EVP_MD_CTX *hash);
+bool branchfilter_parse(const char *name, branchfilter_type_t *type);
+const char *branchfilter_name(branchfilter_type_t type);
+
+#endif /* branchfilter_h */
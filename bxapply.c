@@ -0,0 +1,194 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxapply.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "hashio.h"
+
+#define OUTPUT_BUFFER (1 << 20)
+
+const char *bxapply_run(const bxdiff_patch_t *patch, bxapply_state_t *state, uint64_t stop, const bxapply_ops_t *ops, void *ctx) {
+	uint64_t count = patch->control_length / sizeof(bxdiff_control_t);
+	const char *error = NULL;
+	
+	while (state->control_index < count && state->out_offset < stop) {
+		const bxdiff_control_t *c = (const bxdiff_control_t *)patch->control + state->control_index;
+		uint64_t mixlen = parse_integer(c->mixlen);
+		uint64_t copylen = parse_integer(c->copylen);
+		int64_t seeklen = parse_integer(c->seeklen);
+		
+		/* The state may be inside this op */
+		uint64_t done = state->op_offset;
+		if (done > mixlen && done - mixlen > copylen)
+			return "Patch is corrupt.";
+		uint64_t mix_left = done < mixlen ? mixlen - done : 0;
+		uint64_t copy_left = done < mixlen ? copylen : copylen - (done - mixlen);
+		if (state->diff_offset > patch->diff_length || mix_left > patch->diff_length - state->diff_offset ||
+		    state->extra_offset > patch->extra_length || copy_left > patch->extra_length - state->extra_offset)
+			return "Patch is corrupt.";
+		
+		if (!done && ops->begin && (error = ops->begin(ctx, state, c)))
+			return error;
+		
+		/* Add mixlen bytes of the old file to the diff block modulo 256 */
+		while (mix_left) {
+			uint64_t length = mix_left < BXAPPLY_STEP ? mix_left : BXAPPLY_STEP;
+			if ((error = ops->mix(ctx, state, (const uint8_t *)patch->diff + state->diff_offset, length)))
+				return error;
+			state->diff_offset += length;
+			state->in_offset += length;
+			state->out_offset += length;
+			state->op_offset += length;
+			mix_left -= length;
+			if ((mix_left || copy_left) && ops->step && (error = ops->step(ctx, state)))
+				return error;
+		}
+		
+		/* Copy copylen bytes of the extra block */
+		while (copy_left) {
+			uint64_t length = copy_left < BXAPPLY_STEP ? copy_left : BXAPPLY_STEP;
+			if ((error = ops->copy(ctx, state, (const uint8_t *)patch->extra + state->extra_offset, length)))
+				return error;
+			state->extra_offset += length;
+			state->out_offset += length;
+			state->op_offset += length;
+			copy_left -= length;
+			if (copy_left && ops->step && (error = ops->step(ctx, state)))
+				return error;
+		}
+		
+		/* Move the old file position by seeklen bytes */
+		state->in_offset += seeklen;
+		state->op_offset = 0;
+		state->control_index++;
+		
+		if (ops->end && (error = ops->end(ctx, state, c)))
+			return error;
+	}
+	return NULL;
+}
+
+static bool write_all(int fd, const uint8_t *buf, size_t length) {
+	while (length) {
+		ssize_t n = write(fd, buf, length);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf += n;
+		length -= n;
+	}
+	return true;
+}
+
+/* Mixed and copied bytes are gathered here, hashed and written whenever it fills up */
+typedef struct {
+	const uint8_t *old;
+	size_t old_size;
+	int out_fd;
+	EVP_MD_CTX *hash;
+	uint8_t *buffer;
+	size_t buffered;
+	uint64_t written;
+} buffer_apply_t;
+
+static bool buffer_flush(buffer_apply_t *apply) {
+	if (!apply->buffered) return true;
+	if (!EVP_DigestUpdate(apply->hash, apply->buffer, apply->buffered) ||
+	    !write_all(apply->out_fd, apply->buffer, apply->buffered))
+		return false;
+	apply->written += apply->buffered;
+	apply->buffered = 0;
+	return true;
+}
+
+/* The patch was validated, so only the old file offsets need checking here */
+static const char *buffer_mix(void *ctx, const bxapply_state_t *state, const uint8_t *diff, uint64_t length) {
+	buffer_apply_t *apply = ctx;
+	if (state->in_offset > apply->old_size || length > apply->old_size - state->in_offset)
+		return "Input file is truncated.";
+	
+	const uint8_t *in = apply->old + state->in_offset;
+	while (length) {
+		if (apply->buffered == OUTPUT_BUFFER && !buffer_flush(apply))
+			return "Failed to write the new file.";
+		size_t take = OUTPUT_BUFFER - apply->buffered;
+		if (take > length) take = length;
+		uint8_t *p = apply->buffer + apply->buffered;
+		for (size_t i = 0; i < take; i++)
+			p[i] = in[i] + diff[i];
+		in += take;
+		diff += take;
+		length -= take;
+		apply->buffered += take;
+	}
+	return NULL;
+}
+
+static const char *buffer_copy(void *ctx, const bxapply_state_t *state, const uint8_t *extra, uint64_t length) {
+	buffer_apply_t *apply = ctx;
+	(void)state;
+	while (length) {
+		if (apply->buffered == OUTPUT_BUFFER && !buffer_flush(apply))
+			return "Failed to write the new file.";
+		size_t take = OUTPUT_BUFFER - apply->buffered;
+		if (take > length) take = length;
+		memcpy(apply->buffer + apply->buffered, extra, take);
+		extra += take;
+		length -= take;
+		apply->buffered += take;
+	}
+	return NULL;
+}
+
+bool bxapply_buffer(const uint8_t *old, size_t old_size, const bxdiff_patch_t *patch, int out_fd, uint64_t *length, uint8_t *sha1, const char **error) {
+	static const bxapply_ops_t ops = {NULL, buffer_mix, buffer_copy, NULL, NULL};
+	buffer_apply_t apply = {old, old_size, out_fd, NULL, NULL, 0, 0};
+	bxapply_state_t state;
+	
+	*length = 0;
+	apply.buffer = malloc(OUTPUT_BUFFER);
+	apply.hash = hash_new(NULL);
+	if (!apply.buffer || !apply.hash) {
+		*error = "Memory allocation error.";
+		free(apply.buffer);
+		if (apply.hash) EVP_MD_CTX_free(apply.hash);
+		return false;
+	}
+	
+	memset(&state, 0, sizeof(state));
+	*error = bxapply_run(patch, &state, UINT64_MAX, &ops, &apply);
+	if (!*error && !buffer_flush(&apply))
+		*error = "Failed to write the new file.";
+	unsigned sha1_length;
+	if (!hash_final(apply.hash, sha1, &sha1_length) && !*error)
+		*error = "Failed to calculate SHA1 hash of the new file.";
+	*length = apply.written;
+	free(apply.buffer);
+	return !*error;
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxapply_h
+#define bxapply_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "bxformat.h"
+
+/*
+ * Where an apply is in the patch blocks and in the old and new file.
+ * op_offset is how many bytes of the op at control_index were produced
+ * already, mix bytes first; the other offsets include them.
+ */
+typedef struct {
+	uint64_t control_index;
+	uint64_t diff_offset;
+	uint64_t extra_offset;
+	uint64_t in_offset;
+	uint64_t out_offset;
+	uint64_t op_offset;
+} bxapply_state_t;
+
+/* mix and copy get at most this many bytes per call */
+#define BXAPPLY_STEP (1 << 20)
+
+/*
+ * How an apply backend produces the new file. For every control op mix
+ * adds length diff bytes to the old file at state->in_offset, then copy
+ * appends length extra bytes; both see the state before their bytes and
+ * are called in steps of up to BXAPPLY_STEP bytes. begin and end may be
+ * NULL and see the state before and after the op; begin is skipped for an
+ * op that is continued from a state inside it. step may be NULL and sees
+ * the state between two steps of the same op, e.g. to checkpoint there.
+ * Callbacks return NULL or an error message, which stops the apply.
+ */
+typedef struct {
+	const char *(*begin)(void *ctx, const bxapply_state_t *state, const bxdiff_control_t *c);
+	const char *(*mix)(void *ctx, const bxapply_state_t *state, const uint8_t *diff, uint64_t length);
+	const char *(*copy)(void *ctx, const bxapply_state_t *state, const uint8_t *extra, uint64_t length);
+	const char *(*end)(void *ctx, const bxapply_state_t *state, const bxdiff_control_t *c);
+	const char *(*step)(void *ctx, const bxapply_state_t *state);
+} bxapply_ops_t;
+
+/*
+ * The patch semantics, shared by every backend: runs the control block
+ * from *state until the output reaches stop (UINT64_MAX for all of it) and
+ * leaves *state where it stopped. Returns NULL or an error message.
+ */
+const char *bxapply_run(const bxdiff_patch_t *patch, bxapply_state_t *state, uint64_t stop, const bxapply_ops_t *ops, void *ctx);
+
+/*
+ * Applies a decoded and validated patch to an old file that is entirely in
+ * memory, usually mapped, and writes the new file to out_fd in order, so
+ * it may be a pipe. length and sha1 receive the size and SHA1 of what was
+ * written. On failure *error says why. Only reads the old file and the
+ * patch, so any number of threads can share them.
+ */
+bool bxapply_buffer(const uint8_t *old, size_t old_size, const bxdiff_patch_t *patch, int out_fd, uint64_t *length, uint8_t *sha1, const char **error);
+
+#endif /* bxapply_h */
@@ -0,0 +1,152 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxarena.h"
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define ARENA_ALIGN 64
+#define ARENA_HUGE_PAGE (2 << 20)
+#define ARENA_ROUND_UP(x, a) (((x) + (a) - 1) / (a) * (a))
+
+struct bxarena {
+	uint8_t *base;
+	size_t capacity;
+	size_t page;		/* granularity scratch is returned in */
+	size_t bottom;		/* end of the long-lived buffers */
+	size_t top;			/* start of the scratch buffers */
+	size_t peak;
+	uint64_t allocations;
+	uint64_t fallbacks;
+	bool huge_pages;
+};
+
+bxarena_t *bxarena_new(size_t capacity, bool huge_pages) {
+	bxarena_t *arena = calloc(1, sizeof(bxarena_t));
+	if (!arena) return NULL;
+	
+	/* Rounding up to whole pages must not wrap */
+	arena->page = (size_t)sysconf(_SC_PAGESIZE);
+	size_t page = huge_pages ? ARENA_HUGE_PAGE : arena->page;
+	if (capacity > SIZE_MAX - page + 1) {
+		free(arena);
+		return NULL;
+	}
+	capacity = ARENA_ROUND_UP(capacity ? capacity : 1, page);
+	int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_NORESERVE
+	flags |= MAP_NORESERVE;
+#endif
+	
+	void *base = MAP_FAILED;
+#if defined(__linux__) && defined(MAP_HUGETLB)
+	/* Without MAP_NORESERVE this fails unless enough huge pages are reserved */
+	if (huge_pages) {
+		base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_HUGETLB, -1, 0);
+		if (base != MAP_FAILED) {
+			arena->huge_pages = true;
+			arena->page = ARENA_HUGE_PAGE;
+		}
+	}
+#endif
+	if (base == MAP_FAILED)
+		base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (base == MAP_FAILED) {
+		free(arena);
+		return NULL;
+	}
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (huge_pages && !arena->huge_pages)
+		arena->huge_pages = !madvise(base, capacity, MADV_HUGEPAGE);
+#endif
+	
+	arena->base = base;
+	arena->capacity = capacity;
+	arena->top = capacity;
+	return arena;
+}
+
+static void arena_used(bxarena_t *arena) {
+	size_t used = arena->bottom + (arena->capacity - arena->top);
+	if (used > arena->peak) arena->peak = used;
+	arena->allocations++;
+}
+
+void *bxarena_alloc(bxarena_t *arena, size_t size) {
+	size_t start = ARENA_ROUND_UP(arena->bottom, ARENA_ALIGN);
+	if (start > arena->top || size > arena->top - start) {
+		arena->fallbacks++;
+		return NULL;
+	}
+	arena->bottom = start + size;
+	arena_used(arena);
+	return arena->base + start;
+}
+
+void *bxarena_scratch(bxarena_t *arena, size_t size) {
+	if (size > arena->top - arena->bottom) {
+		arena->fallbacks++;
+		return NULL;
+	}
+	size_t start = (arena->top - size) / ARENA_ALIGN * ARENA_ALIGN;
+	if (start < arena->bottom) {
+		arena->fallbacks++;
+		return NULL;
+	}
+	arena->top = start;
+	arena_used(arena);
+	return arena->base + start;
+}
+
+/* Whole pages of the scratch area go back to the system right away */
+void bxarena_clear_scratch(bxarena_t *arena) {
+	size_t start = ARENA_ROUND_UP(arena->top, arena->page);
+	size_t end = arena->capacity / arena->page * arena->page;
+	if (end > start)
+		madvise(arena->base + start, end - start, MADV_DONTNEED);
+	arena->top = arena->capacity;
+}
+
+bool bxarena_owns(const bxarena_t *arena, const void *p) {
+	return arena && (const uint8_t *)p >= arena->base && (const uint8_t *)p < arena->base + arena->capacity;
+}
+
+void bxarena_stats(const bxarena_t *arena, bxarena_stats_t *stats) {
+	stats->capacity = arena->capacity;
+	stats->used = arena->bottom + (arena->capacity - arena->top);
+	stats->peak = arena->peak;
+	stats->allocations = arena->allocations;
+	stats->fallbacks = arena->fallbacks;
+	stats->huge_pages = arena->huge_pages;
+}
+
+void bxarena_free(bxarena_t *arena) {
+	if (arena) {
+		munmap(arena->base, arena->capacity);
+		free(arena);
+	}
+}
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxarena_h
+#define bxarena_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * One mapping for all buffers of an apply, released in one call.
+ * Long-lived buffers (decoded blocks) are taken from the bottom, scratch
+ * buffers (compressed blocks) from the top; bxarena_clear_scratch() hands
+ * the scratch pages back to the system. The mapping is only reserved,
+ * pages are committed as they are touched, so sizing it from the patch
+ * header is cheap. With huge_pages it is backed by explicit huge pages if
+ * the system has them reserved and by transparent huge pages otherwise
+ * (Linux only).
+ */
+
+typedef struct bxarena bxarena_t;
+
+typedef struct {
+	uint64_t capacity;
+	uint64_t used;
+	uint64_t peak;
+	uint64_t allocations;
+	uint64_t fallbacks;	/* requests that did not fit, the caller used malloc */
+	bool huge_pages;
+} bxarena_stats_t;
+
+bxarena_t *bxarena_new(size_t capacity, bool huge_pages);
+void *bxarena_alloc(bxarena_t *arena, size_t size);
+void *bxarena_scratch(bxarena_t *arena, size_t size);
+void bxarena_clear_scratch(bxarena_t *arena);
+bool bxarena_owns(const bxarena_t *arena, const void *p);
+void bxarena_stats(const bxarena_t *arena, bxarena_stats_t *stats);
+void bxarena_free(bxarena_t *arena);
+
+#endif /* bxarena_h */
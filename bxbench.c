@@ -0,0 +1,396 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+#include <lzma.h>
+#include <openssl/sha.h>
+
+#include "bxformat.h"
+#include "lzmaio.h"
+#include "bytematch.h"
+#include "hashio.h"
+
+static const char *usage = "usage: bxbench [-c <cpu>] [-r <repetitions>] [-s <MB>] [-l] [<benchmark prefix>...]\n"
+                           "       -c pins to <cpu> (Linux), -l lists the benchmarks";
+
+#define CONTROL_TRIPLES (1 << 20)
+#define PBZX_HEADER_SIZE 20
+#define PBZX_CHUNK_HEADER_SIZE 16
+
+/*
+ * Micro-benchmarks of the primitives on the apply path. Every benchmark
+ * runs once to warm up and then <repetitions> times on the same
+ * deterministic data; the mean and standard deviation of ns per op and
+ * GB/s are reported. An op is one control triple, one pbzx chunk or one
+ * byte, depending on the benchmark.
+ */
+
+typedef struct {
+	uint64_t ops;
+	uint64_t bytes;
+} bench_result_t;
+
+typedef struct {
+	const char *name;
+	size_t param;
+	bool (*run)(size_t param, bench_result_t *result);
+} benchmark_t;
+
+static size_t data_size;
+static bxdiff_control_t *controls;
+static uint8_t *old_data, *diff_data, *out_data;
+static uint8_t *pbzx_data[3];
+static size_t pbzx_size[3];
+static uint8_t *xz_data;
+static size_t xz_size, xz_plain_size;
+static char temp_path[] = "/tmp/bxbenchXXXXXX";
+static volatile uint64_t sink;
+
+static uint64_t random_state = 0x2545F4914F6CDD1DULL;
+
+static uint64_t random_next(void) {
+	random_state ^= random_state << 13;
+	random_state ^= random_state >> 7;
+	random_state ^= random_state << 17;
+	return random_state;
+}
+
+static uint64_t encode_integer(int64_t value) {
+	return value < 0 ? (uint64_t)-value | (1ULL << 63) : (uint64_t)value;
+}
+
+/* Text-like bytes, so compressors have something to do */
+static void fill_compressible(uint8_t *p, size_t length) {
+	static const char *words[] = {"patch ", "block ", "control ", "diff ", "extra ", "seek ", "mix ", "copy ", "\n", "0x7f ", "size "};
+	size_t i = 0;
+	while (i < length) {
+		const char *w = words[random_next() % (sizeof(words) / sizeof(words[0]))];
+		for (; *w && i < length; w++) p[i++] = *w;
+	}
+}
+
+/* pbzx framing with raw chunks, which bxformat copies through */
+static uint8_t *make_pbzx(size_t chunk, size_t *size) {
+	size_t chunks = (data_size + chunk - 1) / chunk;
+	*size = PBZX_HEADER_SIZE + chunks * PBZX_CHUNK_HEADER_SIZE - 8 + data_size;
+	uint8_t *p = malloc(*size), *q = p;
+	if (!p) return NULL;
+	memcpy(q, "pbzx", 4);
+	q += 4;
+	*(uint64_t *)q = bswapHostToBig64((uint64_t)chunk);
+	q += 8;
+	*(uint64_t *)q = bswapHostToBig64((uint64_t)data_size);
+	q += 8;
+	for (size_t i = 0; i < chunks; i++) {
+		size_t length = data_size - i * chunk < chunk ? data_size - i * chunk : chunk;
+		if (i) {
+			*(uint64_t *)q = bswapHostToBig64((uint64_t)chunk);
+			q += 8;
+		}
+		*(uint64_t *)q = bswapHostToBig64((uint64_t)length);
+		q += 8;
+		memcpy(q, old_data + i * chunk, length);
+		q += length;
+	}
+	return p;
+}
+
+static bool prepare_data(void) {
+	controls = malloc(CONTROL_TRIPLES * sizeof(bxdiff_control_t));
+	old_data = malloc(data_size);
+	diff_data = malloc(data_size);
+	out_data = malloc(data_size);
+	if (!controls || !old_data || !diff_data || !out_data) return false;
+	
+	for (size_t i = 0; i < CONTROL_TRIPLES; i++) {
+		controls[i].mixlen = encode_integer(random_next() % 65536);
+		controls[i].copylen = encode_integer(random_next() % 4096);
+		controls[i].seeklen = encode_integer((int64_t)(random_next() % (1 << 24)) - (1 << 23));
+	}
+	for (size_t i = 0; i < data_size; i += 8) {
+		uint64_t r = random_next();
+		memcpy(old_data + i, &r, data_size - i < 8 ? data_size - i : 8);
+	}
+	/* Diff bytes are mostly zero, like in real patches */
+	for (size_t i = 0; i < data_size; i++)
+		diff_data[i] = random_next() % 8 ? 0 : (uint8_t)random_next();
+	memcpy(out_data, old_data, data_size);
+	
+	static const size_t pbzx_chunks[] = {4096, 65536, 1 << 20};
+	for (unsigned i = 0; i < 3; i++) {
+		if (!(pbzx_data[i] = make_pbzx(pbzx_chunks[i], &pbzx_size[i])))
+			return false;
+	}
+	
+	xz_plain_size = data_size / 4;
+	uint8_t *plain = malloc(xz_plain_size);
+	size_t bound = lzma_stream_buffer_bound(xz_plain_size);
+	xz_data = malloc(bound);
+	if (!plain || !xz_data) return false;
+	fill_compressible(plain, xz_plain_size);
+	xz_size = 0;
+	bool ok = lzma_easy_buffer_encode(6, LZMA_CHECK_CRC64, NULL, plain, xz_plain_size, xz_data, &xz_size, bound) == LZMA_OK;
+	free(plain);
+	if (!ok) return false;
+	
+	int fd = mkstemp(temp_path);
+	if (fd < 0) return false;
+	ok = write(fd, old_data, data_size) == (ssize_t)data_size;
+	close(fd);
+	return ok;
+}
+
+static bool bench_parse_integer(size_t param, bench_result_t *result) {
+	uint64_t sum = 0;
+	(void)param;
+	for (size_t i = 0; i < CONTROL_TRIPLES; i++)
+		sum += parse_integer(controls[i].mixlen) + parse_integer(controls[i].copylen) + parse_integer(controls[i].seeklen);
+	sink = sum;
+	result->ops = CONTROL_TRIPLES;
+	result->bytes = CONTROL_TRIPLES * sizeof(bxdiff_control_t);
+	return true;
+}
+
+/* The loop bxpatch runs over every mixed extent */
+static bool bench_mix_add(size_t param, bench_result_t *result) {
+	(void)param;
+	uint8_t *p = out_data;
+	const uint8_t *d = diff_data;
+	for (size_t i = 0; i < data_size; i++)
+		p[i] += d[i];
+	sink = p[data_size - 1];
+	result->ops = result->bytes = data_size;
+	return true;
+}
+
+static bool bench_bytematch(size_t param, bench_result_t *result) {
+	static const char *kernels[] = {"generic", "sse4.2", "avx2", "avx512"};
+	if (!bytematch_use(kernels[param])) return false;
+	sink = bytematch_count(old_data, out_data, data_size) + bytematch_extent(old_data, out_data, data_size, 64);
+	bytematch_use(NULL);
+	result->ops = result->bytes = data_size * 2;
+	return true;
+}
+
+static bool bench_pbzx(size_t param, bench_result_t *result) {
+	size_t dsize;
+	bool empty;
+	void *buf = pbzx_buffer_decompress(pbzx_data[param], pbzx_size[param], &dsize, &empty);
+	if (!buf) return false;
+	free(buf);
+	static const size_t pbzx_chunks[] = {4096, 65536, 1 << 20};
+	result->ops = (data_size + pbzx_chunks[param] - 1) / pbzx_chunks[param];
+	result->bytes = data_size;
+	return true;
+}
+
+static bool bench_xz_decompress(size_t param, bench_result_t *result) {
+	size_t dsize;
+	(void)param;
+	void *buf = lzma_easy_buffer_decompress(xz_data, xz_size, &dsize);
+	if (!buf) return false;
+	free(buf);
+	result->ops = result->bytes = dsize;
+	return true;
+}
+
+static bool bench_xz_write(size_t param, bench_result_t *result) {
+	FILE *f = fopen("/dev/null", "wb");
+	if (!f) return false;
+	lzma_ret error = LZMA_OK;
+	size_t length = data_size / 16;
+	LZMA_FILE *xz = lzma_xzWriteOpen(&error, f, (int)param, 6);
+	if (xz) {
+		lzma_xzWrite(&error, xz, out_data, length);
+		lzma_xzClose(&error, xz);
+	}
+	fclose(f);
+	result->ops = result->bytes = length;
+	return xz && (error == LZMA_OK || error == LZMA_STREAM_END);
+}
+
+/* SHA1 through EVP as bxpatch hashes its output, fed in reads of param bytes; param 0 is SHA1_File on a file */
+static bool bench_sha1(size_t param, bench_result_t *result) {
+	uint8_t digest[SHA_DIGEST_LENGTH];
+	if (!param) {
+		FILE *f = fopen(temp_path, "rb");
+		bool ok = f && SHA1_File(f, digest);
+		if (f) fclose(f);
+		if (!ok) return false;
+	} else {
+		unsigned length;
+		EVP_MD_CTX *ctx = hash_new(NULL);
+		if (!ctx) return false;
+		for (size_t i = 0; i < data_size; i += param)
+			EVP_DigestUpdate(ctx, old_data + i, data_size - i < param ? data_size - i : param);
+		if (!hash_final(ctx, digest, &length)) return false;
+	}
+	sink = digest[0];
+	result->ops = result->bytes = data_size;
+	return true;
+}
+
+static const benchmark_t benchmarks[] = {
+	{"parse_integer", 0, bench_parse_integer},
+	{"mix_add", 0, bench_mix_add},
+	{"bytematch_generic", 0, bench_bytematch},
+	{"bytematch_sse4.2", 1, bench_bytematch},
+	{"bytematch_avx2", 2, bench_bytematch},
+	{"bytematch_avx512", 3, bench_bytematch},
+	{"pbzx_framing_4k", 0, bench_pbzx},
+	{"pbzx_framing_64k", 1, bench_pbzx},
+	{"pbzx_framing_1m", 2, bench_pbzx},
+	{"xz_buffer_decompress", 0, bench_xz_decompress},
+	{"xz_write_64k", 65536, bench_xz_write},
+	{"xz_write_1m", 1 << 20, bench_xz_write},
+	{"xz_write_8m", 8 << 20, bench_xz_write},
+	{"sha1_file", 0, bench_sha1},
+	{"sha1_read_4k", 4096, bench_sha1},
+	{"sha1_read_64k", 65536, bench_sha1},
+	{"sha1_read_1m", 1 << 20, bench_sha1},
+};
+
+#define BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static bool selected(const benchmark_t *b, int count, const char **prefixes) {
+	if (!count) return true;
+	for (int i = 0; i < count; i++) {
+		if (!strncmp(b->name, prefixes[i], strlen(prefixes[i])))
+			return true;
+	}
+	return false;
+}
+
+static void run_benchmark(const benchmark_t *b, unsigned repetitions) {
+	bench_result_t result;
+	if (!b->run(b->param, &result)) {
+		printf("%-22s unavailable\n", b->name);
+		return;
+	}
+	
+	double ns_sum = 0, ns_squares = 0, gbs_sum = 0, gbs_squares = 0;
+	for (unsigned r = 0; r < repetitions; r++) {
+		double start = now();
+		b->run(b->param, &result);
+		double elapsed = now() - start;
+		double ns = elapsed * 1e9 / result.ops, gbs = result.bytes / elapsed / 1e9;
+		ns_sum += ns;
+		ns_squares += ns * ns;
+		gbs_sum += gbs;
+		gbs_squares += gbs * gbs;
+	}
+	double ns = ns_sum / repetitions, gbs = gbs_sum / repetitions;
+	double ns_sd = sqrt(fmax(ns_squares / repetitions - ns * ns, 0));
+	double gbs_sd = sqrt(fmax(gbs_squares / repetitions - gbs * gbs, 0));
+	printf("%-22s %12.3f ns/op +- %-10.3f %9.4f GB/s +- %.4f\n", b->name, ns, ns_sd, gbs, gbs_sd);
+}
+
+int main(int argc, const char * argv[]) {
+	unsigned repetitions = 10;
+	size_t megabytes = 16;
+	int cpu = -1;
+	bool list = false;
+	int ch;
+	
+	while ((ch = getopt(argc, (char * const *)argv, "c:r:s:l")) != -1) {
+		switch (ch) {
+			case 'c':
+				cpu = atoi(optarg);
+				break;
+			case 'r':
+				repetitions = (unsigned)strtoul(optarg, NULL, 0);
+				break;
+			case 's':
+				megabytes = strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				list = true;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	if (!repetitions || !megabytes) {
+		puts(usage);
+		return 0;
+	}
+	
+	if (list) {
+		for (size_t i = 0; i < BENCHMARKS; i++)
+			puts(benchmarks[i].name);
+		return 0;
+	}
+	
+	if (cpu >= 0) {
+#ifdef __linux__
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		if (sched_setaffinity(0, sizeof(set), &set)) {
+			fprintf(stderr, "Failed to pin to CPU %d.\n", cpu);
+			return 1;
+		}
+#else
+		fprintf(stderr, "Pinning is not supported on this system, running unpinned.\n");
+#endif
+	}
+	
+	data_size = megabytes << 20;
+	if (!prepare_data()) {
+		fprintf(stderr, "Failed to prepare benchmark data.\n");
+		return 1;
+	}
+	
+	printf("%zu MB, %u repetitions, bytematch kernel %s\n", megabytes, repetitions, bytematch_name());
+	for (size_t i = 0; i < BENCHMARKS; i++) {
+		if (selected(&benchmarks[i], argc - optind, argv + optind))
+			run_benchmark(&benchmarks[i], repetitions);
+	}
+	
+	unlink(temp_path);
+	return 0;
+}
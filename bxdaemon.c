@@ -0,0 +1,144 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxdaemon.h"
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static bool socket_address(const char *path, struct sockaddr_un *address) {
+	memset(address, 0, sizeof(struct sockaddr_un));
+	address->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(address->sun_path)) return false;
+	strcpy(address->sun_path, path);
+	return true;
+}
+
+/* A stale socket left by a daemon that did not exit cleanly is replaced */
+int bxdaemon_listen(const char *path) {
+	struct sockaddr_un address;
+	if (!socket_address(path, &address)) return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&address, sizeof(address)) || listen(sock, 64)) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+int bxdaemon_connect(const char *path) {
+	struct sockaddr_un address;
+	if (!socket_address(path, &address)) return -1;
+	int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (sock < 0) return -1;
+	if (connect(sock, (struct sockaddr *)&address, sizeof(address))) {
+		close(sock);
+		return -1;
+	}
+	return sock;
+}
+
+/* The count descriptors in fds travel with the first byte of the message */
+bool bxdaemon_send(int sock, const void *buf, size_t length, const int *fds, unsigned count) {
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(BXDAEMON_FDS * sizeof(int))];
+	} control;
+	
+	if (count > BXDAEMON_FDS) return false;
+	while (length) {
+		struct iovec iov = {(void *)buf, length};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		if (count) {
+			memset(&control, 0, sizeof(control));
+			msg.msg_control = control.space;
+			msg.msg_controllen = CMSG_SPACE(count * sizeof(int));
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+			memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+		}
+		
+		ssize_t n = sendmsg(sock, &msg, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf = (const uint8_t *)buf + n;
+		length -= n;
+		count = 0;
+	}
+	return true;
+}
+
+/*
+ * Reads exactly length bytes. Up to count descriptors that came along are
+ * stored in fds in the order they were sent, the remaining slots are -1.
+ * Any further descriptors are closed.
+ */
+bool bxdaemon_recv(int sock, void *buf, size_t length, int *fds, unsigned count) {
+	union {
+		struct cmsghdr header;
+		char space[CMSG_SPACE(BXDAEMON_FDS * sizeof(int))];
+	} control;
+	
+	unsigned received = 0;
+	for (unsigned i = 0; i < count; i++)
+		fds[i] = -1;
+	while (length) {
+		struct iovec iov = {buf, length};
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.space;
+		msg.msg_controllen = sizeof(control.space);
+		
+		ssize_t n = recvmsg(sock, &msg, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+			unsigned n_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			for (unsigned i = 0; i < n_fds; i++) {
+				int fd;
+				memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+				if (received < count) fds[received++] = fd;
+				else close(fd);
+			}
+		}
+		buf = (uint8_t *)buf + n;
+		length -= n;
+	}
+	return true;
+}
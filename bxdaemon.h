@@ -0,0 +1,76 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxdaemon_h
+#define bxdaemon_h
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Protocol between bxpatch --daemon and bxpatchd over a Unix stream
+ * socket. The client opens the old file, the patch and the new file
+ * itself, with its own credentials, and passes the three descriptors along
+ * with the request (SCM_RIGHTS). bxpatchd never opens a path on behalf of
+ * a client; it reads and writes the descriptors only and answers with one
+ * response. Both ends run on the same host, so the structs are sent as is.
+ */
+
+#define BXDAEMON_MAGIC "BXPD0002"
+
+/* Descriptors passed with a request, in this order */
+#define BXDAEMON_OLD_FD 0
+#define BXDAEMON_PATCH_FD 1
+#define BXDAEMON_NEW_FD 2
+#define BXDAEMON_FDS 3
+
+/* Request flags */
+#define BXDAEMON_FORCE 1
+
+/* Response flags */
+#define BXDAEMON_BASE_CACHED 1
+#define BXDAEMON_PATCH_CACHED 2
+
+typedef struct {
+	char magic[8];
+	uint32_t flags;
+} bxdaemon_request_t;
+
+typedef struct {
+	char magic[8];
+	int32_t status;
+	uint32_t flags;
+	uint64_t output_length;
+	char message[256];
+} bxdaemon_response_t;
+
+int bxdaemon_listen(const char *path);
+int bxdaemon_connect(const char *path);
+bool bxdaemon_send(int sock, const void *buf, size_t length, const int *fds, unsigned count);
+bool bxdaemon_recv(int sock, void *buf, size_t length, int *fds, unsigned count);
+
+#endif /* bxdaemon_h */
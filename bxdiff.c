@@ -30,10 +30,13 @@
 #include <stdbool.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include <lzma.h>
 #include <openssl/sha.h>
 
+#include "bxestimate.h"
+
 #if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
 #define bswapLittleToHost32(x) x
 #define bswapBigToHost32(x) __builtin_bswap32(x)
@@ -110,28 +113,54 @@ static void *pbzx_buffer_decompress(void *compressed_data, size_t size, size_t *
 static uint64_t parse_integer(uint64_t);
 static void print_hex(const void *, size_t);
 static int SHA1_File(FILE *, uint8_t *);
+static int estimate(const char *oldfile_path, const char *newfile_path, unsigned threads);
+
+static const char *usage = "usage: bxpatch [-f] <oldfile> <newfile> <patchfile>\n"
+                           "       bxdiff --estimate [-j <threads>] <oldfile> <newfile>";
+
+static const struct option long_options[] = {
+	{"estimate", no_argument, NULL, 'E'},
+	{NULL, 0, NULL, 0}
+};
 
 int main(int argc, const char * argv[]) {
-	const char *infile_path = argv[1];
-	const char *outfile_path = argv[2];
-	const char *patchfile_path = argv[3];
-	
-	if ((argc != 4) && (argc != 5)) {
-		puts("usage: bxpatch [-f] <oldfile> <newfile> <patchfile>");
-		return 0;
+	bool estimate_only = false;
+	/* All cores by default */
+	unsigned threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+	int ch;
+	while ((ch = getopt_long(argc, (char * const *)argv, "fj:", long_options, NULL)) != -1) {
+		switch (ch) {
+			case 'f':
+				force = true;
+				break;
+			case 'E':
+				estimate_only = true;
+				break;
+			case 'j':
+				threads = (unsigned)strtoul(optarg, NULL, 0);
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
 	}
-	if (argc == 5) {
-		if (strcmp(argv[1], "-f")) {
-			puts("usage: bxpatch [-f] <oldfile> <newfile> <patchfile>");
+	
+	if (estimate_only) {
+		if (argc - optind != 2) {
+			puts(usage);
 			return 0;
-		} else {
-			force = true;
-			infile_path = argv[2];
-			outfile_path = argv[3];
-			patchfile_path = argv[4];
 		}
+		return estimate(argv[optind], argv[optind + 1], threads);
 	}
 	
+	if (argc - optind != 3) {
+		puts(usage);
+		return 0;
+	}
+	const char *infile_path = argv[optind];
+	const char *outfile_path = argv[optind + 1];
+	const char *patchfile_path = argv[optind + 2];
+	
 	patch_file = open(patchfile_path, O_RDONLY);
 	if (patch_file < 0) {
 		fprintf(stderr, "Failed to open %s.\n", patchfile_path);
@@ -501,6 +530,27 @@ int main(int argc, const char * argv[]) {
 	return 0;
 }
 
+/*
+ * Predicts how large a patch from oldfile to newfile would be without
+ * building it, so callers can skip pairs where shipping the compressed new
+ * file is cheaper. Prints key: value lines; the verdict is "diff" or "skip".
+ */
+static int estimate(const char *oldfile_path, const char *newfile_path, unsigned threads) {
+	bxestimate_t result;
+	if (!bxestimate_files(oldfile_path, newfile_path, BXESTIMATE_DEFAULT_PROBES, threads, &result))
+		return 1;
+	
+	printf("old size: %llu\n", (unsigned long long)result.old_size);
+	printf("new size: %llu\n", (unsigned long long)result.new_size);
+	printf("probes: %u\n", result.probes);
+	printf("coverage: %.4f +- %.4f\n", result.coverage, result.coverage_error);
+	printf("patch size: %llu (%llu - %llu at the coverage interval bounds, excluding compression sampling error)\n", (unsigned long long)result.patch_size,
+	       (unsigned long long)result.patch_size_low, (unsigned long long)result.patch_size_high);
+	printf("compressed new size: %llu\n", (unsigned long long)result.compressed_new_size);
+	printf("verdict: %s\n", result.patch_size < result.compressed_new_size ? "diff" : "skip");
+	return 0;
+}
+
 #ifdef DEBUG
 
 static void __attribute__((unused)) print_hex(const void *data, size_t length) {
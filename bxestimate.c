@@ -0,0 +1,391 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxestimate.h"
+#include "bytematch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <lzma.h>
+
+#define ESTIMATE_WINDOW 32
+#define ESTIMATE_MIN_STRIDE 32
+#define ESTIMATE_MAX_ENTRIES (1 << 22)
+#define ESTIMATE_CHUNK 4096
+#define ESTIMATE_CHUNKS 128
+#define ESTIMATE_SAMPLE_LIMIT (ESTIMATE_CHUNK * ESTIMATE_CHUNKS)
+#define ESTIMATE_HASH_MULTIPLIER 0x100000001b3ULL
+
+/* Open addressing table of old file positions, keyed by window hash */
+typedef struct {
+	uint32_t check;
+	uint32_t block;
+} estimate_slot_t;
+
+typedef struct {
+	const uint8_t *old;
+	uint64_t old_size;
+	uint64_t stride;
+	estimate_slot_t *slots;
+	uint64_t mask;
+	uint64_t power;	/* multiplier^(window - 1), to roll bytes out */
+} estimate_index_t;
+
+typedef struct {
+	uint8_t *data;
+	size_t length;
+} estimate_sample_t;
+
+/* A contiguous run of probes matched by one thread */
+typedef struct {
+	const estimate_index_t *index;
+	const uint8_t *new;
+	uint64_t new_size;
+	const uint64_t *positions;
+	bool *hits;
+	uint64_t *old_positions;
+	unsigned first, last;
+} estimate_segment_t;
+
+static const uint8_t *map_file(const char *path, uint64_t *size) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return NULL;
+	}
+	struct stat st;
+	if (fstat(fd, &st)) {
+		close(fd);
+		return NULL;
+	}
+	*size = st.st_size;
+	
+	/* An empty mapping is not allowed, any non-NULL pointer will do */
+	const uint8_t *data = (const uint8_t *)"";
+	if (*size) {
+		void *mapping = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+		data = mapping == MAP_FAILED ? NULL : mapping;
+		if (!data) fprintf(stderr, "Failed to map %s.\n", path);
+	}
+	close(fd);
+	return data;
+}
+
+static void unmap_file(const uint8_t *data, uint64_t size) {
+	if (data && size) munmap((void *)data, size);
+}
+
+static uint64_t window_hash(const uint8_t *p) {
+	uint64_t h = 0;
+	for (int i = 0; i < ESTIMATE_WINDOW; i++)
+		h = h * ESTIMATE_HASH_MULTIPLIER + p[i];
+	return h;
+}
+
+static uint64_t mix_hash(uint64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h;
+}
+
+/* Indexes one window every stride bytes, the stride grows with the file so the table stays small */
+static bool index_build(estimate_index_t *index, const uint8_t *old, uint64_t old_size) {
+	index->old = old;
+	index->old_size = old_size;
+	index->stride = ESTIMATE_MIN_STRIDE;
+	if (old_size / index->stride > ESTIMATE_MAX_ENTRIES)
+		index->stride = (old_size + ESTIMATE_MAX_ENTRIES - 1) / ESTIMATE_MAX_ENTRIES;
+	
+	uint64_t entries = old_size / index->stride + 1;
+	uint64_t capacity = 1024;
+	while (capacity < entries * 2) capacity <<= 1;
+	index->slots = calloc(capacity, sizeof(estimate_slot_t));
+	if (!index->slots) return false;
+	index->mask = capacity - 1;
+	
+	index->power = 1;
+	for (int i = 1; i < ESTIMATE_WINDOW; i++)
+		index->power *= ESTIMATE_HASH_MULTIPLIER;
+	
+	/* Block 0 marks an empty slot, so blocks are stored plus one */
+	for (uint64_t pos = 0; pos + ESTIMATE_WINDOW <= old_size; pos += index->stride) {
+		uint64_t h = mix_hash(window_hash(old + pos));
+		uint64_t i = h & index->mask;
+		while (index->slots[i].block) {
+			if (index->slots[i].check == (uint32_t)(h >> 32)) break;
+			i = (i + 1) & index->mask;
+		}
+		if (!index->slots[i].block) {
+			index->slots[i].check = (uint32_t)(h >> 32);
+			index->slots[i].block = (uint32_t)(pos / index->stride + 1);
+		}
+	}
+	return true;
+}
+
+static bool index_lookup(const estimate_index_t *index, uint64_t rolling, const uint8_t *window, uint64_t *pos) {
+	uint64_t h = mix_hash(rolling);
+	for (uint64_t i = h & index->mask; index->slots[i].block; i = (i + 1) & index->mask) {
+		if (index->slots[i].check != (uint32_t)(h >> 32)) continue;
+		uint64_t candidate = (uint64_t)(index->slots[i].block - 1) * index->stride;
+		if (!memcmp(index->old + candidate, window, ESTIMATE_WINDOW)) {
+			*pos = candidate;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Finds where the bytes at new[probe] come from. Every alignment of the
+ * old file has an indexed window within stride bytes, so rolling over that
+ * many positions finds a seed if there is an exact match that long. The
+ * seed is accepted if at least half of the bytes from the probe to its
+ * end agree, which is bsdiff's criterion for mixing instead of copying.
+ */
+static bool probe_match(const estimate_index_t *index, const uint8_t *new, uint64_t new_size, uint64_t probe, uint64_t *old_pos) {
+	if (probe + ESTIMATE_WINDOW > new_size) return false;
+	
+	uint64_t end = probe + index->stride;
+	if (end + ESTIMATE_WINDOW > new_size) end = new_size - ESTIMATE_WINDOW + 1;
+	
+	uint64_t h = window_hash(new + probe);
+	for (uint64_t q = probe; q < end; q++) {
+		if (q > probe)
+			h = (h - new[q - 1] * index->power) * ESTIMATE_HASH_MULTIPLIER + new[q + ESTIMATE_WINDOW - 1];
+		
+		uint64_t seed;
+		if (!index_lookup(index, h, new + q, &seed) || seed < q - probe) continue;
+		
+		uint64_t start = seed - (q - probe);
+		uint64_t length = q - probe + ESTIMATE_WINDOW;
+		uint64_t matches = bytematch_count(index->old + start, new + probe, length);
+		if (matches * 2 >= length) {
+			*old_pos = start;
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Length of the mixed region that starts at a covered probe: it goes on as
+ * long as the running match score (matches minus mismatches) stays close to
+ * the best one seen, like bsdiff's extension of approximate matches.
+ */
+static uint64_t probe_extent(const uint8_t *old, uint64_t old_size, uint64_t old_pos, const uint8_t *new, uint64_t limit) {
+	if (limit > old_size - old_pos) limit = old_size - old_pos;
+	return bytematch_extent(old + old_pos, new, limit, 64);
+}
+
+static void *match_segment(void *arg) {
+	estimate_segment_t *segment = arg;
+	for (unsigned i = segment->first; i < segment->last; i++)
+		segment->hits[i] = probe_match(segment->index, segment->new, segment->new_size, segment->positions[i], &segment->old_positions[i]);
+	return NULL;
+}
+
+/*
+ * Matches all probes against the shared, read-only index. The probes are
+ * split into one contiguous segment per thread; results land in per-probe
+ * slots, so the caller sees them in order as if matched sequentially.
+ */
+static void match_probes(estimate_segment_t *base, unsigned probes, unsigned threads) {
+	if (threads < 1) threads = 1;
+	if (threads > probes) threads = probes ? probes : 1;
+	estimate_segment_t *segments = malloc(threads * sizeof(estimate_segment_t));
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	bool *started = calloc(threads, sizeof(bool));
+	if (!segments || !workers || !started) {
+		threads = 1;
+		segments = segments ? segments : base;
+	}
+	
+	for (unsigned t = 0; t < threads; t++) {
+		segments[t] = *base;
+		segments[t].first = (unsigned)((uint64_t)probes * t / threads);
+		segments[t].last = (unsigned)((uint64_t)probes * (t + 1) / threads);
+	}
+	
+	/* The calling thread takes the first segment and any whose thread could not be started */
+	for (unsigned t = 1; t < threads; t++)
+		started[t] = !pthread_create(&workers[t], NULL, match_segment, &segments[t]);
+	match_segment(&segments[0]);
+	for (unsigned t = 1; t < threads; t++) {
+		if (started[t]) pthread_join(workers[t], NULL);
+		else match_segment(&segments[t]);
+	}
+	
+	if (segments != base) free(segments);
+	free(workers);
+	free(started);
+}
+
+static void sample_append(estimate_sample_t *sample, const uint8_t *data, const uint8_t *base, size_t length) {
+	if (sample->length + length > ESTIMATE_SAMPLE_LIMIT)
+		length = ESTIMATE_SAMPLE_LIMIT - sample->length;
+	uint8_t *dst = sample->data + sample->length;
+	if (base) {
+		for (size_t i = 0; i < length; i++)
+			dst[i] = data[i] - base[i];
+	} else {
+		memcpy(dst, data, length);
+	}
+	sample->length += length;
+}
+
+/* Compressed size per input byte of a sample, with the same XZ preset bxdiff uses */
+static double sample_ratio(const estimate_sample_t *sample) {
+	if (!sample->length) return 1.0;
+	
+	size_t bound = lzma_stream_buffer_bound(sample->length);
+	uint8_t *out = malloc(bound);
+	size_t out_pos = 0;
+	if (!out || lzma_easy_buffer_encode(6, LZMA_CHECK_NONE, NULL, sample->data, sample->length, out, &out_pos, bound) != LZMA_OK)
+		out_pos = sample->length;
+	free(out);
+	return (double)out_pos / sample->length;
+}
+
+static uint64_t predict_size(const bxestimate_t *result, double coverage, double diff_ratio, double extra_ratio, uint64_t ops) {
+	double covered = coverage * result->new_size;
+	double size = sizeof(uint64_t) * 4 + 20 + ops * 24 + covered * diff_ratio + (result->new_size - covered) * extra_ratio;
+	return (uint64_t)size;
+}
+
+bool bxestimate_files(const char *old_path, const char *new_path, unsigned probes, unsigned threads, bxestimate_t *result) {
+	memset(result, 0, sizeof(bxestimate_t));
+	const uint8_t *old = map_file(old_path, &result->old_size);
+	if (!old) return false;
+	const uint8_t *new = map_file(new_path, &result->new_size);
+	if (!new) {
+		unmap_file(old, result->old_size);
+		return false;
+	}
+	
+	estimate_index_t index;
+	memset(&index, 0, sizeof(index));
+	estimate_sample_t diff_sample = {NULL, 0}, extra_sample = {NULL, 0}, new_sample = {NULL, 0};
+	uint64_t *positions = NULL, *old_positions = NULL;
+	bool *hits = NULL;
+	
+	if (!probes) probes = BXESTIMATE_DEFAULT_PROBES;
+	if (probes > result->new_size) probes = (unsigned)result->new_size;
+	result->probes = probes;
+	
+	bool ok = index_build(&index, old, result->old_size) &&
+	          (diff_sample.data = malloc(ESTIMATE_SAMPLE_LIMIT)) &&
+	          (extra_sample.data = malloc(ESTIMATE_SAMPLE_LIMIT)) &&
+	          (new_sample.data = malloc(ESTIMATE_SAMPLE_LIMIT)) &&
+	          (positions = malloc(probes * sizeof(uint64_t) + 1)) &&
+	          (old_positions = malloc(probes * sizeof(uint64_t) + 1)) &&
+	          (hits = malloc(probes * sizeof(bool) + 1));
+	if (!ok) {
+		fprintf(stderr, "Memory allocation error.\n");
+		goto done;
+	}
+	
+	/* Probes are spread evenly, each at a random point of its stretch */
+	uint64_t seed = 0x9e3779b97f4a7c15ULL;
+	for (unsigned i = 0; i < probes; i++) {
+		uint64_t first = result->new_size * i / probes;
+		uint64_t stretch = result->new_size * (i + 1) / probes - first;
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		positions[i] = first + (stretch ? (seed >> 33) % stretch : 0);
+	}
+	
+	estimate_segment_t segment = {&index, new, result->new_size, positions, hits, old_positions, 0, 0};
+	match_probes(&segment, probes, threads);
+	
+	/* Compression ratios come from one chunk every few probes, chunks never overlap */
+	unsigned chunk_every = probes > ESTIMATE_CHUNKS ? probes / ESTIMATE_CHUNKS : 1;
+	uint64_t chunk = probes ? result->new_size * chunk_every / probes : 0;
+	if (chunk > ESTIMATE_CHUNK) chunk = ESTIMATE_CHUNK;
+	
+	/* Transitions across segment boundaries are counted here, on the stitched results */
+	uint64_t covered = 0, transitions = 0;
+	bool previous = false;
+	for (unsigned i = 0; i < probes; i++) {
+		uint64_t probe = positions[i], old_pos = old_positions[i];
+		bool hit = hits[i];
+		covered += hit;
+		if (i && hit != previous) transitions++;
+		
+		if (i % chunk_every == 0) {
+			uint64_t length = chunk;
+			if (length > result->new_size - probe) length = result->new_size - probe;
+			sample_append(&new_sample, new + probe, NULL, length);
+			if (hit) {
+				length = probe_extent(old, result->old_size, old_pos, new + probe, length);
+				sample_append(&diff_sample, new + probe, old + old_pos, length);
+			} else {
+				sample_append(&extra_sample, new + probe, NULL, length);
+			}
+		}
+		previous = hit;
+	}
+	
+	if (probes) {
+		double p = (double)covered / probes;
+		result->coverage = p;
+		result->coverage_error = 1.96 * sqrt(p * (1 - p) / probes);
+	}
+	
+	/* Every switch between mixed and copied data costs at least one control triple */
+	double diff_ratio = sample_ratio(&diff_sample);
+	double extra_ratio = sample_ratio(&extra_sample);
+	uint64_t ops = transitions / 2 + 1;
+	double low = result->coverage - result->coverage_error, high = result->coverage + result->coverage_error;
+	if (low < 0) low = 0;
+	if (high > 1) high = 1;
+	
+	/* Less coverage means more extra data, unless the diff bytes compress worse */
+	uint64_t a = predict_size(result, low, diff_ratio, extra_ratio, ops);
+	uint64_t b = predict_size(result, high, diff_ratio, extra_ratio, ops);
+	result->patch_size = predict_size(result, result->coverage, diff_ratio, extra_ratio, ops);
+	result->patch_size_low = a < b ? a : b;
+	result->patch_size_high = a < b ? b : a;
+	result->compressed_new_size = (uint64_t)(sample_ratio(&new_sample) * result->new_size);
+	
+done:
+	free(index.slots);
+	free(diff_sample.data);
+	free(extra_sample.data);
+	free(new_sample.data);
+	free(positions);
+	free(old_positions);
+	free(hits);
+	unmap_file(old, result->old_size);
+	unmap_file(new, result->new_size);
+	return ok;
+}
@@ -0,0 +1,62 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxestimate_h
+#define bxestimate_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Patch size estimator. The old file is indexed sparsely with a rolling
+ * hash, the new file is probed at evenly spread positions and every probe
+ * is classified as covered (bsdiff would mix it from the old file) or not
+ * (it would become extra data). Coverage comes with a 95% confidence
+ * interval, and the compressed sizes are extrapolated from compressing the
+ * sampled diff and extra bytes. The patch size range only spans the
+ * coverage interval, not the error of those sampled ratios.
+ *
+ * Probes are matched on up to threads threads against the shared index;
+ * the result does not depend on the thread count.
+ */
+
+#define BXESTIMATE_DEFAULT_PROBES 16384
+
+typedef struct {
+	uint64_t old_size;
+	uint64_t new_size;
+	unsigned probes;
+	double coverage;
+	double coverage_error;
+	uint64_t patch_size;
+	uint64_t patch_size_low;
+	uint64_t patch_size_high;
+	uint64_t compressed_new_size;
+} bxestimate_t;
+
+bool bxestimate_files(const char *old_path, const char *new_path, unsigned probes, unsigned threads, bxestimate_t *result);
+
+#endif /* bxestimate_h */
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <openssl/sha.h>
+
+#include "bxformat.h"
+#include "branchfilter.h"
+
+static const char *usage = "usage: bxfilter [-d] <x86|arm64> <infile> <outfile>\n"
+                           "       bxfilter -m <x86|arm64> <oldfile> <newfile> <patchfile>";
+
+static bool hash_path(const char *path, uint8_t *dst) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	int ret = SHA1_File(f, dst);
+	fclose(f);
+	return ret;
+}
+
+static int filter_file(branchfilter_type_t type, bool encode, const char *infile_path, const char *outfile_path) {
+	int in_fd = open(infile_path, O_RDONLY);
+	if (in_fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", infile_path);
+		return 1;
+	}
+	int out_fd = open(outfile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (out_fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", outfile_path);
+		close(in_fd);
+		return 1;
+	}
+	
+	bool ok = branchfilter_fd(type, encode, in_fd, out_fd, NULL);
+	if (close(out_fd)) ok = false;
+	close(in_fd);
+	if (!ok) fprintf(stderr, "Failed to write %s.\n", outfile_path);
+	return !ok;
+}
+
+/*
+ * Turns a BXDIFF50 patch that was generated from filtered copies of the
+ * old and new file into a BXDIFF51 patch for the original files: the
+ * filter is recorded in the flags and the hashes are those of the
+ * unfiltered files, which is what bxpatch checks.
+ */
+static int mark_patch(branchfilter_type_t type, const char *oldfile_path, const char *newfile_path, const char *patchfile_path) {
+	bxdiff50_header_t header;
+	int fd = open(patchfile_path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", patchfile_path);
+		return 1;
+	}
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+	    (strncmp(header.magic, "BXDIFF50", 8) && strncmp(header.magic, "BXDIFF51", 8))) {
+		fprintf(stderr, "%s is not a BXDIFF50 patch.\n", patchfile_path);
+		close(fd);
+		return 1;
+	}
+	
+	if (!hash_path(oldfile_path, header.target_sha1) || !hash_path(newfile_path, header.result_sha1)) {
+		fprintf(stderr, "Failed to calculate SHA1 hash of the input files.\n");
+		close(fd);
+		return 1;
+	}
+	memcpy(header.magic, "BXDIFF51", 8);
+	header.unknown = bswapHostToLittle64((uint64_t)type);
+	
+	bool ok = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+	if (close(fd)) ok = false;
+	if (!ok) fprintf(stderr, "Failed to write %s.\n", patchfile_path);
+	return !ok;
+}
+
+int main(int argc, const char * argv[]) {
+	bool decode = false, mark = false;
+	int ch;
+	
+	while ((ch = getopt(argc, (char * const *)argv, "dm")) != -1) {
+		switch (ch) {
+			case 'd':
+				decode = true;
+				break;
+			case 'm':
+				mark = true;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	
+	branchfilter_type_t type;
+	if (argc - optind != 3 + mark || (mark && decode) || !branchfilter_parse(argv[optind], &type)) {
+		puts(usage);
+		return 0;
+	}
+	if (mark)
+		return mark_patch(type, argv[optind + 1], argv[optind + 2], argv[optind + 3]);
+	return filter_file(type, !decode, argv[optind + 1], argv[optind + 2]);
+}
@@ -0,0 +1,1022 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxformat.h"
+#include "hashio.h"
+#include "bxtrace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <lzma.h>
+#include <openssl/sha.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+/* Optional dictionary that zstd blocks may have been compressed with */
+static void *zstd_dictionary;
+static size_t zstd_dictionary_size;
+
+/* read() that does not give up on short reads, which pipes produce */
+static bool read_fully(int fd, void *buf, size_t length) {
+	while (length) {
+		ssize_t n = read(fd, buf, length);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return false;
+		buf = (uint8_t *)buf + n;
+		length -= n;
+	}
+	return true;
+}
+
+/* Reads until end of file, for the implied-length extra block of a streamed patch */
+static void *read_to_end(int fd, size_t *length) {
+	size_t capacity = 1 << 20;
+	uint8_t *buf = malloc(capacity);
+	*length = 0;
+	while (buf) {
+		if (*length == capacity) {
+			uint8_t *grown = realloc(buf, capacity * 2);
+			if (!grown) break;
+			buf = grown;
+			capacity *= 2;
+		}
+		ssize_t n = read(fd, buf + *length, capacity - *length);
+		if (n < 0 && errno == EINTR) continue;
+		if (n < 0) break;
+		if (n == 0) return buf;
+		*length += n;
+	}
+	if (buf) free(buf);
+	return NULL;
+}
+
+/* Block buffers come from the patch's arena when it has one and there is room, malloc otherwise */
+static void *block_alloc(bxarena_t *arena, size_t size) {
+	void *p = arena ? bxarena_alloc(arena, size) : NULL;
+	return p ? p : malloc(size);
+}
+
+static void *scratch_alloc(bxarena_t *arena, size_t size) {
+	void *p = arena ? bxarena_scratch(arena, size) : NULL;
+	return p ? p : malloc(size);
+}
+
+static void block_free(bxarena_t *arena, void *p) {
+	if (p && !bxarena_owns(arena, p)) free(p);
+}
+
+static bool xz_length(const uint8_t *tail, size_t tail_length, uint64_t stream_size, uint64_t *length);
+static void *xz_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize);
+static void *xz_decompress_slices(void *compressed_data, size_t size, size_t *dsize);
+static void *pbzx_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize, bool *empty);
+static void *zstd_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize, bool *empty);
+
+static bxdiff_patch_t *patch_open(int fd, bool streaming, const char *path);
+
+/*
+ * "-" reads the patch from stdin. Such a patch is streamed: the blocks are
+ * read in order exactly once and for BXDIFF40/41 the extra block is
+ * whatever follows the diff block.
+ */
+bxdiff_patch_t *bxdiff_patch_open(const char *path) {
+	if (!strcmp(path, "-"))
+		return patch_open(STDIN_FILENO, true, path);
+	
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return NULL;
+	}
+	return patch_open(fd, false, path);
+}
+
+bxdiff_patch_t *bxdiff_patch_open_fd(int fd, const char *name) {
+	return patch_open(fd, false, name);
+}
+
+static bxdiff_patch_t *patch_open(int fd, bool streaming, const char *path) {
+	bxdiff_patch_t *patch = calloc(1, sizeof(bxdiff_patch_t));
+	if (!patch) {
+		fprintf(stderr, "Memory allocation error.\n");
+		if (!streaming) close(fd);
+		return NULL;
+	}
+	patch->fd = fd;
+	patch->streaming = streaming;
+	
+	if (!streaming) {
+		patch->file_length = lseek(patch->fd, 0, SEEK_END);
+		if (patch->file_length <= sizeof(bxdiff40_header_t)) {
+			fprintf(stderr, "%s is not a BXDIFF patch.\n", path);
+			goto error;
+		}
+		lseek(patch->fd, 0, SEEK_SET);
+	}
+	
+	char magic[8];
+	if (!read_fully(patch->fd, &magic, 8)) {
+		fprintf(stderr, "Unexpected I/O error.\n");
+		goto error;
+	}
+	
+	if (!strncmp(magic, "BXDIFF40", 8)) {
+		patch->version = BXDIFF40;
+		patch->has_input_hash = false;
+		patch->has_output_hash = false;
+	} else if (!strncmp(magic, "BXDIFF41", 8)) {
+		patch->version = BXDIFF41;
+		patch->has_input_hash = true;
+		patch->has_output_hash = false;
+	} else if (!strncmp(magic, "BXDIFF50", 8)) {
+		patch->version = BXDIFF50;
+		patch->has_input_hash = true;
+		patch->has_output_hash = true;
+	} else if (!strncmp(magic, "BXDIFF51", 8)) {
+		patch->version = BXDIFF51;
+		patch->has_input_hash = true;
+		patch->has_output_hash = true;
+	} else if (!strncmp(magic, "BSDIFF", 6)) {
+		fprintf(stderr, "BSDIFF patches are not supported.\n");
+		goto error;
+	} else {
+		fprintf(stderr, "%s is not a BXDIFF patch.\n", path);
+		goto error;
+	}
+	
+	if (patch->version < BXDIFF50) {
+		bxdiff40_header_t header;
+		if (!read_fully(patch->fd, (uint8_t *)&header + 8, sizeof(bxdiff40_header_t) - 8)) {
+			fprintf(stderr, "Unexpected I/O error.\n");
+			goto error;
+		}
+		
+		if (patch->has_input_hash) {
+			if (!read_fully(patch->fd, patch->input_sha1, SHA_DIGEST_LENGTH)) {
+				fprintf(stderr, "Unexpected I/O error.\n");
+				goto error;
+			}
+		}
+		
+		patch->patched_file_size = bswapLittleToHost64(header.patched_file_size);
+		patch->control_size = bswapLittleToHost64(header.control_size);
+		patch->diff_size = bswapLittleToHost64(header.diff_size);
+		patch->control_offset = sizeof(bxdiff40_header_t) + SHA_DIGEST_LENGTH * patch->has_input_hash;
+		
+		/* The extra block takes the rest of the file */
+		if (patch->streaming) {
+			patch->extra_size = 0;
+		} else if (patch->control_offset > patch->file_length ||
+		           patch->control_size > patch->file_length - patch->control_offset ||
+		           patch->diff_size > patch->file_length - patch->control_offset - patch->control_size) {
+			fprintf(stderr, "Patch is truncated.\n");
+			goto error;
+		} else {
+			patch->extra_size = patch->file_length - patch->control_offset - patch->control_size - patch->diff_size;
+		}
+	} else {
+		bxdiff50_header_t header;
+		if (!read_fully(patch->fd, (uint8_t *)&header + 8, sizeof(bxdiff50_header_t) - 8)) {
+			fprintf(stderr, "Unexpected I/O error.\n");
+			goto error;
+		}
+		
+		patch->control_size = bswapLittleToHost64(header.control_size);
+		patch->diff_size = bswapLittleToHost64(header.diff_size);
+		patch->extra_size = bswapLittleToHost64(header.extra_size);
+		patch->patched_file_size = bswapLittleToHost64(header.patched_file_size);
+		patch->control_offset = sizeof(bxdiff50_header_t);
+		
+		uint64_t blocks_length = patch->file_length - patch->control_offset;
+		if (!patch->streaming && (patch->control_offset > patch->file_length ||
+		    patch->control_size > blocks_length || patch->diff_size > blocks_length - patch->control_size ||
+		    patch->extra_size != blocks_length - patch->control_size - patch->diff_size)) {
+			fprintf(stderr, "Patch is corrupt.\n");
+			goto error;
+		}
+		
+		memcpy(patch->input_sha1, header.target_sha1, SHA_DIGEST_LENGTH);
+		memcpy(patch->output_sha1, header.result_sha1, SHA_DIGEST_LENGTH);
+		
+		if (patch->version == BXDIFF51) {
+			uint64_t flags = bswapLittleToHost64(header.unknown);
+			if (flags & ~(uint64_t)BXDIFF51_KNOWN_FLAGS) {
+				fprintf(stderr, "%s uses unsupported features.\n", path);
+				goto error;
+			}
+			patch->filter = flags & BXDIFF51_FILTER_MASK;
+		}
+	}
+	
+	return patch;
+	
+error:
+	if (!patch->streaming) close(patch->fd);
+	free(patch);
+	return NULL;
+}
+
+/*
+ * BXDIFF50 blocks are pbzx. In BXDIFF51 every block picks its own codec,
+ * which is recognised by its magic: zstd, plain XZ or pbzx.
+ */
+static void *block_decompress(const bxdiff_patch_t *patch, void *data, size_t size, size_t *dsize, bool *empty) {
+	if (patch->version == BXDIFF51 && size >= 6) {
+		if (!memcmp(data, "\x28\xB5\x2F\xFD", 4))
+			return zstd_decompress(patch->arena, data, size, dsize, empty);
+		if (!memcmp(data, "\xFD" "7zXZ\0", 6)) {
+			void *buf = xz_decompress(patch->arena, data, size, dsize);
+			if (buf && !*dsize) {
+				block_free(patch->arena, buf);
+				buf = NULL;
+				*empty = true;
+			}
+			return buf;
+		}
+	}
+	return pbzx_decompress(patch->arena, data, size, dsize, empty);
+}
+
+/* Decodes one block and reports how long it took to the probes and the trace */
+static void *decode_block(const bxdiff_patch_t *patch, const char *name, void *data, size_t size, size_t *dsize, bool *empty) {
+	uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+	BXPROBE2(decode__start, name, size);
+	
+	void *buf;
+	if (patch->version < BXDIFF50) buf = xz_decompress(patch->arena, data, size, dsize);
+	else buf = block_decompress(patch, data, size, dsize, empty);
+	
+	BXPROBE3(decode__end, name, size, *dsize);
+	if (bxtrace_file)
+		bxtrace_event(name, "decode", start, "\"compressed\":%zu,\"length\":%zu", size, *dsize);
+	return buf;
+}
+
+/* Largest decoded to compressed size ratio of a block the arena is sized for */
+#define ARENA_MAX_RATIO (1 << 16)
+
+/* Decoded length of a block as recorded in its headers, 0 if it does not say */
+static uint64_t block_length(const bxdiff_patch_t *patch, uint64_t offset, uint64_t size) {
+	uint8_t head[20];
+	if (size < sizeof(head) || pread(patch->fd, head, sizeof(head), offset) != sizeof(head))
+		return 0;
+	if (patch->version >= BXDIFF50 && !memcmp(head, "pbzx", 4))
+		return bswapBigToHost64(*(uint64_t *)(head + 12));
+#ifdef WITH_ZSTD
+	if (patch->version == BXDIFF51 && !memcmp(head, "\x28\xB5\x2F\xFD", 4)) {
+		unsigned long long length = ZSTD_getFrameContentSize(head, sizeof(head));
+		return length == ZSTD_CONTENTSIZE_ERROR || length == ZSTD_CONTENTSIZE_UNKNOWN ? 0 : length;
+	}
+#endif
+	if (!memcmp(head, "\xFD" "7zXZ\0", 6)) {
+		uint8_t footer[LZMA_STREAM_HEADER_SIZE];
+		lzma_stream_flags flags;
+		if (pread(patch->fd, footer, sizeof(footer), offset + size - sizeof(footer)) != sizeof(footer) ||
+		    lzma_stream_footer_decode(&flags, footer) != LZMA_OK || flags.backward_size > size - sizeof(footer))
+			return 0;
+		size_t tail_length = flags.backward_size + sizeof(footer);
+		uint8_t *tail = malloc(tail_length);
+		uint64_t length = 0;
+		if (!tail || pread(patch->fd, tail, tail_length, offset + size - tail_length) != (ssize_t)tail_length ||
+		    !xz_length(tail, tail_length, size, &length))
+			length = 0;
+		free(tail);
+		return length;
+	}
+	return 0;
+}
+
+/*
+ * Gives the patch an arena for bxdiff_patch_decode(), with room for every
+ * decoded length the block headers record. The compressed blocks are
+ * decoded from the mapped patch file and need no room. Blocks that do not
+ * record their length are decoded with malloc as before. A streamed patch
+ * can not be sized upfront and keeps using malloc.
+ */
+bool bxdiff_patch_use_arena(bxdiff_patch_t *patch, bool huge_pages) {
+	if (patch->streaming || patch->arena) return false;
+	
+	/* The recorded lengths are untrusted. A diff or extra block never
+	 * decodes to more than the new file, and no codec expands a block
+	 * beyond ARENA_MAX_RATIO, which also caps the total against the length
+	 * of the patch file. A patch that claims more is left to malloc and
+	 * fails while decoding.
+	 */
+	uint64_t sizes[3] = {patch->control_size, patch->diff_size, patch->extra_size};
+	uint64_t offset = patch->control_offset, capacity = 0;
+	for (unsigned i = 0; i < 3; i++) {
+		uint64_t length = block_length(patch, offset, sizes[i]);
+		if (length / ARENA_MAX_RATIO > sizes[i] || (i && length > patch->patched_file_size))
+			return false;
+		if (length > UINT64_MAX - 64 - capacity)
+			return false;
+		capacity += length + 64;
+		offset += sizes[i];
+	}
+	if (capacity > SIZE_MAX) return false;
+	patch->arena = bxarena_new((size_t)capacity, huge_pages);
+	return patch->arena != NULL;
+}
+
+/* Compressed blocks live in the mapped patch file or in scratch buffers */
+static void input_free(const bxdiff_patch_t *patch, const uint8_t *mapping, void *p) {
+	if (!mapping) block_free(patch->arena, p);
+}
+
+bool bxdiff_patch_decode(bxdiff_patch_t *patch) {
+	void *control = NULL, *diff = NULL, *extra = NULL;
+	if (patch->control_size > SIZE_MAX || patch->diff_size > SIZE_MAX || patch->extra_size > SIZE_MAX) {
+		fprintf(stderr, "Patch is too large for this system.\n");
+		return false;
+	}
+	
+	/* A patch file is decoded straight from the page cache, only a
+	 * streamed one, or one that can not be mapped, is read into buffers.
+	 */
+	uint8_t *mapping = NULL;
+	if (!patch->streaming) {
+		mapping = mmap(NULL, patch->file_length, PROT_READ, MAP_SHARED, patch->fd, 0);
+		if (mapping == MAP_FAILED) mapping = NULL;
+		else madvise(mapping, patch->file_length, MADV_SEQUENTIAL);
+	}
+	if (mapping) {
+		control = mapping + patch->control_offset;
+		diff = mapping + patch->control_offset + patch->control_size;
+		if (patch->extra_size) extra = mapping + patch->control_offset + patch->control_size + patch->diff_size;
+		goto decode;
+	}
+	
+	control = scratch_alloc(patch->arena, patch->control_size);
+	diff = scratch_alloc(patch->arena, patch->diff_size);
+	if (patch->extra_size > 0) extra = scratch_alloc(patch->arena, patch->extra_size);
+	if (!control || !diff || (patch->extra_size && !extra)) {
+		fprintf(stderr, "Memory allocation error.\n");
+		goto error;
+	}
+	
+	/* Reading all patch blocks. */
+	if (!patch->streaming)
+		lseek(patch->fd, patch->control_offset, SEEK_SET);
+	if (!read_fully(patch->fd, control, patch->control_size)) {
+		fprintf(stderr, "Failed to read control block.\n");
+		goto error;
+	}
+	if (!read_fully(patch->fd, diff, patch->diff_size)) {
+		fprintf(stderr, "Failed to read diff block.\n");
+		goto error;
+	}
+	if (patch->streaming && patch->version < BXDIFF50) {
+		size_t extra_size;
+		extra = read_to_end(patch->fd, &extra_size);
+		if (!extra) {
+			fprintf(stderr, "Failed to read extra block.\n");
+			goto error;
+		}
+		patch->extra_size = extra_size;
+		if (!extra_size) {
+			block_free(patch->arena, extra);
+			extra = NULL;
+		}
+	} else if (extra) {
+		if (!read_fully(patch->fd, extra, patch->extra_size)) {
+			fprintf(stderr, "Failed to read extra block.\n");
+			goto error;
+		}
+	}
+	
+decode:;
+	void *buf;
+	if (patch->version < BXDIFF50) {
+		patch->control_length = 0;
+		buf = decode_block(patch, "control block", control, patch->control_size, &patch->control_length, NULL);
+		input_free(patch, mapping, control);
+		control = NULL;
+		if (!buf) {
+			fprintf(stderr, "Failed to extract control block.\n");
+			goto error;
+		}
+		patch->control = buf;
+		
+		patch->diff_length = 0;
+		buf = decode_block(patch, "diff block", diff, patch->diff_size, &patch->diff_length, NULL);
+		input_free(patch, mapping, diff);
+		diff = NULL;
+		if (!buf) {
+			fprintf(stderr, "Failed to extract diff block.\n");
+			goto error;
+		}
+		patch->diff = buf;
+		
+		if (extra) {
+			buf = decode_block(patch, "extra block", extra, patch->extra_size, &patch->extra_length, NULL);
+			input_free(patch, mapping, extra);
+			extra = NULL;
+			if (!buf) {
+				fprintf(stderr, "Failed to extract extra block.\n");
+				goto error;
+			}
+			patch->extra = buf;
+		}
+	} else {
+		bool empty = false;
+		
+		patch->control_length = 0;
+		buf = decode_block(patch, "control block", control, patch->control_size, &patch->control_length, &empty);
+		input_free(patch, mapping, control);
+		control = NULL;
+		if (!buf) {
+			if (!empty) fprintf(stderr, "Failed to extract control block.\n");
+			else fprintf(stderr, "Patch is corrupt (empty control block).\n");
+			goto error;
+		}
+		patch->control = buf;
+		
+		patch->diff_length = 0;
+		buf = decode_block(patch, "diff block", diff, patch->diff_size, &patch->diff_length, &empty);
+		input_free(patch, mapping, diff);
+		diff = NULL;
+		/* A BXDIFF51 patch made only of copy ops has an empty diff block */
+		if (!buf && !(empty && patch->version == BXDIFF51)) {
+			if (!empty) fprintf(stderr, "Failed to extract diff block.\n");
+			else fprintf(stderr, "Patch is corrupt (empty diff block).\n");
+			goto error;
+		}
+		patch->diff = buf;
+		
+		if (extra) {
+			buf = decode_block(patch, "extra block", extra, patch->extra_size, &patch->extra_length, &empty);
+			input_free(patch, mapping, extra);
+			extra = NULL;
+			if (!(buf || empty)) {
+				fprintf(stderr, "Failed to extract extra block.\n");
+				goto error;
+			}
+			patch->extra = buf;
+		}
+	}
+	
+	/* The compressed blocks are not needed anymore */
+	if (mapping)
+		munmap(mapping, patch->file_length);
+	if (patch->arena)
+		bxarena_clear_scratch(patch->arena);
+	return true;
+	
+error:
+	input_free(patch, mapping, control);
+	input_free(patch, mapping, diff);
+	input_free(patch, mapping, extra);
+	if (mapping)
+		munmap(mapping, patch->file_length);
+	block_free(patch->arena, patch->control);
+	block_free(patch->arena, patch->diff);
+	patch->control = patch->diff = NULL;
+	return false;
+}
+
+/*
+ * Checks that the control block is consistent with the diff and extra
+ * blocks and adds up to the patched file size.
+ */
+bool bxdiff_patch_validate(const bxdiff_patch_t *patch) {
+	if (!patch->control || patch->control_length % sizeof(bxdiff_control_t))
+		return false;
+	
+	const bxdiff_control_t *c = patch->control;
+	uint64_t ops = patch->control_length / sizeof(bxdiff_control_t);
+	uint64_t mixed = 0, copied = 0;
+	for (uint64_t i = 0; i < ops; i++, c++) {
+		uint64_t mixlen = parse_integer(c->mixlen);
+		uint64_t copylen = parse_integer(c->copylen);
+		if (mixlen > patch->diff_length - mixed || copylen > patch->extra_length - copied)
+			return false;
+		mixed += mixlen;
+		copied += copylen;
+	}
+	return mixed + copied == patch->patched_file_size;
+}
+
+bool bxdiff_patch_sha1(const bxdiff_patch_t *patch, uint8_t *dst) {
+	unsigned length;
+	return hash_fd(patch->fd, NULL, dst, &length);
+}
+
+#define PREPARED_MAGIC "BXPREP01"
+#define PREPARED_ALIGN 4096
+#define PREPARED_ALIGN_UP(x) (((x) + PREPARED_ALIGN - 1) & ~(uint64_t)(PREPARED_ALIGN - 1))
+
+static bool write_padded(FILE *f, const void *buf, size_t length) {
+	static const uint8_t zeros[PREPARED_ALIGN];
+	if (length && fwrite(buf, 1, length, f) != length) return false;
+	size_t pad = PREPARED_ALIGN_UP(length) - length;
+	return !pad || fwrite(zeros, 1, pad, f) == pad;
+}
+
+bool bxdiff_patch_prepare(const bxdiff_patch_t *patch, const uint8_t *patch_sha1, FILE *f) {
+	bxdiff_prepared_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PREPARED_MAGIC, 8);
+	memcpy(header.patch_sha1, patch_sha1, 20);
+	memcpy(header.input_sha1, patch->input_sha1, 20);
+	memcpy(header.output_sha1, patch->output_sha1, 20);
+	header.version = bswapHostToLittle32(patch->version);
+	header.flags = bswapHostToLittle32((patch->has_input_hash ? BXDIFF_PREPARED_INPUT_HASH : 0) |
+	                                   (patch->has_output_hash ? BXDIFF_PREPARED_OUTPUT_HASH : 0));
+	header.patched_file_size = bswapHostToLittle64(patch->patched_file_size);
+	
+	uint64_t offset = PREPARED_ALIGN;
+	header.control_offset = bswapHostToLittle64(offset);
+	header.control_length = bswapHostToLittle64(patch->control_length);
+	offset += PREPARED_ALIGN_UP(patch->control_length);
+	header.diff_offset = bswapHostToLittle64(offset);
+	header.diff_length = bswapHostToLittle64(patch->diff_length);
+	offset += PREPARED_ALIGN_UP(patch->diff_length);
+	header.extra_offset = bswapHostToLittle64(offset);
+	header.extra_length = bswapHostToLittle64(patch->extra_length);
+	
+	return write_padded(f, &header, sizeof(header)) &&
+	       write_padded(f, patch->control, patch->control_length) &&
+	       write_padded(f, patch->diff, patch->diff_length) &&
+	       write_padded(f, patch->extra, patch->extra_length);
+}
+
+/*
+ * Points the blocks of an opened patch into a prepared cache. Returns false,
+ * leaving the patch untouched, if the cache is missing, damaged or was made
+ * from a different patch file.
+ */
+bool bxdiff_patch_map(bxdiff_patch_t *patch, const char *cache_path, const uint8_t *patch_sha1) {
+	int fd = open(cache_path, O_RDONLY);
+	if (fd < 0) return false;
+	
+	struct stat st;
+	if (fstat(fd, &st) || (uint64_t)st.st_size < PREPARED_ALIGN) {
+		close(fd);
+		return false;
+	}
+	
+	void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) return false;
+	
+	const bxdiff_prepared_header_t *header = mapping;
+	uint64_t size = st.st_size;
+	uint64_t control_offset = bswapLittleToHost64(header->control_offset);
+	uint64_t control_length = bswapLittleToHost64(header->control_length);
+	uint64_t diff_offset = bswapLittleToHost64(header->diff_offset);
+	uint64_t diff_length = bswapLittleToHost64(header->diff_length);
+	uint64_t extra_offset = bswapLittleToHost64(header->extra_offset);
+	uint64_t extra_length = bswapLittleToHost64(header->extra_length);
+	
+	if (memcmp(header->magic, PREPARED_MAGIC, 8) ||
+	    memcmp(header->patch_sha1, patch_sha1, 20) ||
+	    bswapLittleToHost32(header->version) != patch->version ||
+	    bswapLittleToHost64(header->patched_file_size) != patch->patched_file_size ||
+	    control_offset > size || control_length > size - control_offset ||
+	    diff_offset > size || diff_length > size - diff_offset ||
+	    extra_offset > size || extra_length > size - extra_offset) {
+		munmap(mapping, st.st_size);
+		return false;
+	}
+	
+	patch->mapping = mapping;
+	patch->mapping_length = st.st_size;
+	patch->control = (uint8_t *)mapping + control_offset;
+	patch->control_length = control_length;
+	patch->diff = (uint8_t *)mapping + diff_offset;
+	patch->diff_length = diff_length;
+	patch->extra = extra_length ? (uint8_t *)mapping + extra_offset : NULL;
+	patch->extra_length = extra_length;
+	return true;
+}
+
+void bxdiff_patch_close(bxdiff_patch_t *patch) {
+	if (patch) {
+		if (patch->mapping) {
+			munmap(patch->mapping, patch->mapping_length);
+		} else {
+			block_free(patch->arena, patch->control);
+			block_free(patch->arena, patch->diff);
+			block_free(patch->arena, patch->extra);
+		}
+		bxarena_free(patch->arena);
+		if (patch->fd >= 0 && !patch->streaming) close(patch->fd);
+		free(patch);
+	}
+}
+
+int SHA1_File(FILE *f, uint8_t *dst) {
+	unsigned length;
+	return f && dst && !fflush(f) && hash_fd(fileno(f), NULL, dst, &length);
+}
+
+uint64_t parse_integer(uint64_t integer)
+{
+	uint8_t *buf = (u_char *)&integer;
+	uint64_t y;
+	
+	y = buf[7] & 0x7F;
+	y <<= 8;
+	y += buf[6];
+	y <<= 8;
+	y += buf[5];
+	y <<= 8;
+	y += buf[4];
+	y <<= 8;
+	y += buf[3];
+	y <<= 8;
+	y += buf[2];
+	y <<= 8;
+	y += buf[1];
+	y <<= 8;
+	y += buf[0];
+	
+	if (buf[7] & 0x80) y = -y;
+	
+	return y;
+}
+
+/*
+ * Decoded length of a single XZ stream of stream_size bytes, from its index.
+ * tail holds the end of the stream: the index followed by the footer.
+ * Fails for concatenated or padded streams, whose index only covers part.
+ */
+static bool xz_length(const uint8_t *tail, size_t tail_length, uint64_t stream_size, uint64_t *length) {
+	lzma_stream_flags footer;
+	if (tail_length < LZMA_STREAM_HEADER_SIZE || stream_size < 2 * LZMA_STREAM_HEADER_SIZE ||
+	    lzma_stream_footer_decode(&footer, tail + tail_length - LZMA_STREAM_HEADER_SIZE) != LZMA_OK ||
+	    footer.backward_size > tail_length - LZMA_STREAM_HEADER_SIZE)
+		return false;
+	
+	lzma_index *index = NULL;
+	uint64_t memory_limit = UINT64_MAX;
+	size_t pos = 0;
+	const uint8_t *p = tail + tail_length - LZMA_STREAM_HEADER_SIZE - footer.backward_size;
+	if (lzma_index_buffer_decode(&index, &memory_limit, NULL, p, &pos, footer.backward_size) != LZMA_OK)
+		return false;
+	bool single = lzma_index_stream_size(index) == stream_size;
+	*length = lzma_index_uncompressed_size(index);
+	lzma_index_end(index, NULL);
+	return single;
+}
+
+/*
+ * A single stream is decoded in one call straight into a buffer of its
+ * final size. Anything else goes through the incremental decoder below.
+ */
+static void *xz_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize) {
+	uint64_t length;
+	if (xz_length(compressed_data, size, size, &length) && length && length <= SIZE_MAX) {
+		uint8_t *buf = block_alloc(arena, length);
+		uint64_t memory_limit = UINT64_MAX;
+		size_t in_pos = 0, out_pos = 0;
+		if (buf && lzma_stream_buffer_decode(&memory_limit, 0, NULL, compressed_data, &in_pos, size, buf, &out_pos, length) == LZMA_OK && out_pos == length) {
+			*dsize = length;
+			return buf;
+		}
+		block_free(arena, buf);
+	}
+	return xz_decompress_slices(compressed_data, size, dsize);
+}
+
+void *lzma_easy_buffer_decompress(void *compressed_data, size_t size, size_t *dsize) {
+	return xz_decompress(NULL, compressed_data, size, dsize);
+}
+
+/*
+ * dsize is a pointer to a place where the size of decompressed file will be written.
+ * Contains code from XZ tools.
+ */
+
+static void *xz_decompress_slices(void *compressed_data, size_t size, size_t *dsize)
+{
+	lzma_stream strm = LZMA_STREAM_INIT; /* alloc and init lzma_stream struct */
+	const uint32_t flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
+	const uint64_t memory_limit = UINT64_MAX; /* no memory limit */
+	uint8_t out_buf[1024];
+	size_t out_len;	/* length of useful data in out_buf */
+	void *res = NULL;
+	lzma_action action;
+	lzma_ret ret_xz;
+	*dsize = 0;
+	
+	/* initialize xz decoder */
+	ret_xz = lzma_stream_decoder(&strm, memory_limit, flags);
+	if (ret_xz != LZMA_OK) {
+		fprintf(stderr, "lzma_stream_decoder error: %d\n", (int) ret_xz);
+		return NULL;
+	}
+	
+	strm.next_in = compressed_data;
+	strm.avail_in = size;
+	
+	/* if no more data from in_buf, flushes the
+	 internal xz buffers and closes the decompressed data
+	 with LZMA_FINISH */
+	action = LZMA_FINISH;
+	
+	/* loop until there's no pending decompressed output */
+	do {
+		/* out_buf is clean at this point */
+		strm.next_out = out_buf;
+		strm.avail_out = 1024;
+		
+		/* decompress data */
+		ret_xz = lzma_code(&strm, action);
+		
+		if ((ret_xz != LZMA_OK) && (ret_xz != LZMA_STREAM_END)) {
+			fprintf(stderr, "lzma_code error: %d\n", (int)ret_xz);
+			lzma_end(&strm);
+			if (res) free(res);
+			return NULL;
+		} else {
+			/* write decompressed data */
+			out_len = 1024 - strm.avail_out;
+			*dsize += out_len;
+			if (!res) res = malloc(out_len);
+			else res = realloc(res, *dsize);
+			memcpy(res + *dsize - out_len, out_buf, out_len);
+		}
+	} while (strm.avail_out == 0);
+	
+	lzma_end(&strm);
+	return res;
+}
+
+void *pbzx_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty) {
+	return pbzx_decompress(NULL, compressed_data, size, dsize, empty);
+}
+
+/*
+ * That code definitely needs to be fixed.
+ */
+static void *pbzx_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize, bool *empty) {
+	if (size == 12) *empty = 1;//todo fix
+	if (size > 20) {
+		if (memcmp(compressed_data, "pbzx", 4)) return NULL;
+		compressed_data += 4;
+		size -= 4;
+		uint64_t __attribute((unused)) flags = bswapBigToHost64(*(uint64_t *)compressed_data);
+		compressed_data += 8;
+		size -= 8;
+		uint64_t uncompressed_size = bswapBigToHost64(*(uint64_t *)compressed_data);
+		compressed_data += 8;
+		size -= 8;
+		if (!uncompressed_size) {
+			if (empty) *empty = true;
+			*dsize = 0;
+			return NULL;
+		} else {
+			if (empty) *empty = false;
+		}
+		
+		void *buf = uncompressed_size <= SIZE_MAX ? block_alloc(arena, uncompressed_size) : NULL;
+		if (buf) {
+			lzma_stream strm = LZMA_STREAM_INIT; /* alloc and init lzma_stream struct */
+			const uint32_t lzma_flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
+			const uint64_t memory_limit = UINT64_MAX; /* no memory limit */
+			lzma_action action = LZMA_RUN;
+			lzma_ret ret_xz;
+			*dsize = uncompressed_size;
+			
+			/* initialize xz decoder */
+			ret_xz = lzma_stream_decoder(&strm, memory_limit, lzma_flags);
+			if (ret_xz != LZMA_OK) {
+				fprintf(stderr, "lzma_stream_decoder error: %d\n", (int) ret_xz);
+				return NULL;
+			}
+			
+			void *p = buf;
+			uint64_t chunk_length;
+			bool first_chunk = true;
+			while (size) {
+				if (size < (first_chunk ? 8u : 16u)) {
+					fprintf(stderr, "Patch is truncated.\n");
+					block_free(arena, buf);
+					lzma_end(&strm);
+					return NULL;
+				}
+				
+				//read flags if needed
+				if (!first_chunk) {
+					flags = bswapBigToHost64(*(uint64_t *)compressed_data);
+					compressed_data += 8;
+					size -= 8;
+				} else {
+					first_chunk = false;
+				}
+				
+				chunk_length = bswapBigToHost64(*(uint64_t *)compressed_data);
+				compressed_data += 8;
+				size -= 8;
+				if (size < chunk_length) {
+					fprintf(stderr, "Patch is truncated.\n");
+					block_free(arena, buf);
+					lzma_end(&strm);
+					return NULL;
+				}
+				uint64_t chunk_start = bxtrace_file ? bxtrace_clock() : 0;
+				BXPROBE1(pbzx__chunk__start, chunk_length);
+				
+				/* Stored chunks are the ones that do not start with a valid
+				 * XZ stream header, whatever check the XZ ones use
+				 */
+				lzma_stream_flags chunk_flags;
+				if (chunk_length < LZMA_STREAM_HEADER_SIZE || lzma_stream_header_decode(&chunk_flags, compressed_data) != LZMA_OK) {
+					if (chunk_length > uncompressed_size) {
+						fprintf(stderr, "Patch is corrupt.\n");
+						block_free(arena, buf);
+						lzma_end(&strm);
+						return NULL;
+					}
+					memcpy(p, compressed_data, chunk_length);
+					BXPROBE2(pbzx__chunk__end, chunk_length, chunk_length);
+					if (bxtrace_file)
+						bxtrace_event("pbzx chunk", "decode", chunk_start, "\"compressed\":%llu,\"length\":%llu,\"raw\":true", (unsigned long long)chunk_length, (unsigned long long)chunk_length);
+					p += chunk_length;
+					uncompressed_size -= chunk_length;
+					compressed_data += chunk_length;
+					size -= chunk_length;
+					continue;
+				}
+				
+				//finish on end
+				if (size == chunk_length) {
+					action = LZMA_FINISH;
+				}
+				
+				strm.next_in = compressed_data;
+				strm.avail_in = chunk_length;
+				strm.next_out = p;
+				strm.avail_out = uncompressed_size;
+				
+				ret_xz = lzma_code(&strm, action);
+				
+				if ((ret_xz != LZMA_OK) && (ret_xz != LZMA_STREAM_END)) {
+					fprintf(stderr, "lzma_code error: %d\n", (int)ret_xz);
+					lzma_end(&strm);
+					block_free(arena, buf);
+					return NULL;
+				} else {
+					size_t out_len = uncompressed_size - strm.avail_out;
+					BXPROBE2(pbzx__chunk__end, chunk_length, out_len);
+					if (bxtrace_file)
+						bxtrace_event("pbzx chunk", "decode", chunk_start, "\"compressed\":%llu,\"length\":%zu", (unsigned long long)chunk_length, out_len);
+					p += out_len;
+					uncompressed_size = strm.avail_out;
+					compressed_data += chunk_length;
+					size -= chunk_length;
+				}
+			};
+			
+			lzma_end(&strm);
+			if (uncompressed_size) {
+				fprintf(stderr, "Patch is truncated.\n");
+				block_free(arena, buf);
+				return NULL;
+			}
+			return buf;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Sets the dictionary for zstd blocks that were compressed with one.
+ * Patches with such blocks can not be applied without it.
+ */
+bool bxdiff_load_dictionary(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return false;
+	}
+	size_t size;
+	void *dictionary = read_to_end(fd, &size);
+	close(fd);
+	if (!dictionary) {
+		fprintf(stderr, "Failed to read %s.\n", path);
+		return false;
+	}
+	if (zstd_dictionary) free(zstd_dictionary);
+	zstd_dictionary = dictionary;
+	zstd_dictionary_size = size;
+	return true;
+}
+
+#ifdef WITH_ZSTD
+
+/*
+ * Decompresses all zstd frames of a block. Frames written with long
+ * distance matching may use windows beyond the default decoder limit, so
+ * the limit is raised to the maximum; the output is allocated in one go
+ * when the first frame records its size.
+ */
+static void *zstd_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize, bool *empty) {
+	*dsize = 0;
+	*empty = false;
+	
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	if (!dctx) return NULL;
+	ZSTD_DCtx_setParameter(dctx, ZSTD_d_windowLogMax, sizeof(size_t) == 4 ? 30 : 31);
+	if (zstd_dictionary && ZSTD_isError(ZSTD_DCtx_loadDictionary(dctx, zstd_dictionary, zstd_dictionary_size))) {
+		ZSTD_freeDCtx(dctx);
+		return NULL;
+	}
+	
+	/* A single frame that records its size is decoded into a buffer of exactly that size */
+	unsigned long long content_size = ZSTD_getFrameContentSize(compressed_data, size);
+	size_t capacity = 1 << 20;
+	bool exact = false;
+	if (content_size != ZSTD_CONTENTSIZE_ERROR && content_size != ZSTD_CONTENTSIZE_UNKNOWN) {
+		capacity = content_size ? content_size : 1;
+		exact = ZSTD_findFrameCompressedSize(compressed_data, size) == size;
+	}
+	
+	uint8_t *res = exact ? block_alloc(arena, capacity) : malloc(capacity);
+	ZSTD_inBuffer in = {compressed_data, size, 0};
+	ZSTD_outBuffer out = {res, capacity, 0};
+	while (res) {
+		size_t ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret)) {
+			fprintf(stderr, "zstd error: %s\n", ZSTD_getErrorName(ret));
+			break;
+		}
+		if (in.pos == in.size && ret == 0) {
+			ZSTD_freeDCtx(dctx);
+			*dsize = out.pos;
+			if (!out.pos) {
+				block_free(arena, res);
+				*empty = true;
+				return NULL;
+			}
+			return res;
+		}
+		if (in.pos == in.size && out.pos < out.size) {
+			fprintf(stderr, "zstd error: truncated frame\n");
+			break;
+		}
+		if (out.pos == out.size) {
+			if (bxarena_owns(arena, res)) {
+				fprintf(stderr, "zstd error: frame is larger than its content size\n");
+				break;
+			}
+			uint8_t *grown = realloc(res, capacity * 2);
+			if (!grown) break;
+			res = grown;
+			capacity *= 2;
+			out.dst = res;
+			out.size = capacity;
+		}
+	}
+	
+	ZSTD_freeDCtx(dctx);
+	block_free(arena, res);
+	return NULL;
+}
+
+#else
+
+static void *zstd_decompress(bxarena_t *arena, void *compressed_data, size_t size, size_t *dsize, bool *empty) {
+	(void)arena;
+	(void)compressed_data;
+	(void)size;
+	*dsize = 0;
+	*empty = false;
+	fprintf(stderr, "This bxpatch was built without zstd support.\n");
+	return NULL;
+}
+
+#endif
+
+void *zstd_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty) {
+	return zstd_decompress(NULL, compressed_data, size, dsize, empty);
+}
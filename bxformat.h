@@ -0,0 +1,167 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxformat_h
+#define bxformat_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "bxarena.h"
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define bswapLittleToHost32(x) x
+#define bswapBigToHost32(x) __builtin_bswap32(x)
+#define bswapHostToLittle32(x) x
+#define bswapHostToBig32(x) __builtin_bswap32(x)
+#define bswapLittleToHost64(x) x
+#define bswapBigToHost64(x) __builtin_bswap64(x)
+#define bswapHostToLittle64(x) x
+#define bswapHostToBig64(x) __builtin_bswap64(x)
+#else
+#define bswapLittleToHost32(x) __builtin_bswap32(x)
+#define bswapBigToHost32(x) x
+#define bswapHostToLittle32(x) __builtin_bswap32(x)
+#define bswapHostToBig32(x) x
+#define bswapLittleToHost64(x) __builtin_bswap64(x)
+#define bswapBigToHost64(x) x
+#define bswapHostToLittle64(x) __builtin_bswap64(x)
+#define bswapHostToBig64(x) x
+#endif
+
+typedef enum {
+	BXDIFF_INVALID = 0,
+	BXDIFF40 = 1,
+	BXDIFF41 = 2,
+	BXDIFF50 = 3,
+	BXDIFF51 = 4,
+} bxdiff_version_t;
+
+typedef struct {
+	uint64_t mixlen;
+	uint64_t copylen;
+	uint64_t seeklen;
+} bxdiff_control_t;
+
+typedef struct {
+	char magic[8];
+	uint64_t control_size;
+	uint64_t diff_size;
+	uint64_t patched_file_size;
+} bxdiff40_header_t;
+
+/* BXDIFF51 has the same layout, with flags in place of the unknown field */
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint64_t unknown;
+	uint64_t patched_file_size;
+	uint64_t control_size;
+	uint64_t extra_size;
+	uint8_t result_sha1[20];
+	uint64_t diff_size;
+	uint8_t target_sha1[20];
+}  bxdiff50_header_t;
+
+/* The low byte of the BXDIFF51 flags is the branchfilter_type_t both files were filtered with */
+#define BXDIFF51_FILTER_MASK 0xFF
+#define BXDIFF51_KNOWN_FLAGS BXDIFF51_FILTER_MASK
+
+/*
+ * A patch file. bxdiff_patch_open() only parses the header, so callers can
+ * check the input hash before paying for bxdiff_patch_decode(), which reads
+ * and decompresses the control, diff and extra blocks.
+ */
+typedef struct {
+	int fd;
+	bool streaming;
+	size_t file_length;
+	
+	bxdiff_version_t version;
+	uint64_t patched_file_size;
+	bool has_input_hash;
+	bool has_output_hash;
+	uint8_t input_sha1[20];
+	uint8_t output_sha1[20];
+	
+	/* Branch filter applied to the old and new file before diffing */
+	unsigned filter;
+	
+	uint64_t control_offset;
+	uint64_t control_size, diff_size, extra_size;
+	
+	void *control, *diff, *extra;
+	size_t control_length, diff_length, extra_length;
+	
+	/* Set when the blocks point into a mapped prepared cache */
+	void *mapping;
+	size_t mapping_length;
+	
+	/* Set by bxdiff_patch_use_arena(), holds the blocks instead of malloc */
+	bxarena_t *arena;
+} bxdiff_patch_t;
+
+/*
+ * Prepared cache: the decoded and validated blocks of a patch, each
+ * page-aligned so bxdiff_patch_map() can use them in place. The cache is
+ * bound to the SHA1 of the patch file it was made from.
+ */
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint8_t patch_sha1[20];
+	uint8_t input_sha1[20];
+	uint8_t output_sha1[20];
+	uint32_t version;
+	uint32_t flags;
+	uint64_t patched_file_size;
+	uint64_t control_offset, control_length;
+	uint64_t diff_offset, diff_length;
+	uint64_t extra_offset, extra_length;
+} bxdiff_prepared_header_t;
+
+#define BXDIFF_PREPARED_INPUT_HASH 1
+#define BXDIFF_PREPARED_OUTPUT_HASH 2
+
+bxdiff_patch_t *bxdiff_patch_open(const char *path);
+/* Like bxdiff_patch_open() for an open patch file, which the patch takes over; name is for messages */
+bxdiff_patch_t *bxdiff_patch_open_fd(int fd, const char *name);
+bool bxdiff_patch_use_arena(bxdiff_patch_t *patch, bool huge_pages);
+bool bxdiff_patch_decode(bxdiff_patch_t *patch);
+bool bxdiff_patch_validate(const bxdiff_patch_t *patch);
+bool bxdiff_patch_sha1(const bxdiff_patch_t *patch, uint8_t *dst);
+bool bxdiff_patch_prepare(const bxdiff_patch_t *patch, const uint8_t *patch_sha1, FILE *f);
+bool bxdiff_patch_map(bxdiff_patch_t *patch, const char *cache_path, const uint8_t *patch_sha1);
+void bxdiff_patch_close(bxdiff_patch_t *patch);
+
+void *lzma_easy_buffer_decompress(void *compressed_data, size_t size, size_t *dsize);
+void *pbzx_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty);
+void *zstd_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty);
+bool bxdiff_load_dictionary(const char *path);
+uint64_t parse_integer(uint64_t integer);
+int SHA1_File(FILE *f, uint8_t *dst);
+
+#endif /* bxformat_h */
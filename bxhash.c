@@ -0,0 +1,130 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "hashio.h"
+
+static const char *usage = "usage: bxhash [-a <algorithm>] [-j <threads>] [-b] <file>...";
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t digest_length(const char *algorithm) {
+	uint8_t digest[HASHIO_MAX_DIGEST];
+	unsigned length = 0;
+	return hash_buffer("", 0, algorithm, digest, &length) ? length : 0;
+}
+
+int main(int argc, const char * argv[]) {
+	const char *algorithm = NULL;
+	unsigned threads = 1;
+	bool benchmark = false;
+	int ch;
+	
+	while ((ch = getopt(argc, (char * const *)argv, "a:j:b")) != -1) {
+		switch (ch) {
+			case 'a':
+				algorithm = optarg;
+				break;
+			case 'j':
+				threads = (unsigned)strtoul(optarg, NULL, 0);
+				break;
+			case 'b':
+				benchmark = true;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	
+	size_t count = argc - optind;
+	if (!count || !threads) {
+		puts(usage);
+		return 0;
+	}
+	
+	size_t length = digest_length(algorithm);
+	if (!length) {
+		fprintf(stderr, "Unknown digest %s.\n", algorithm);
+		return 1;
+	}
+	
+	uint8_t (*digests)[HASHIO_MAX_DIGEST] = malloc(count * HASHIO_MAX_DIGEST);
+	bool *ok = malloc(count * sizeof(bool));
+	if (!digests || !ok) {
+		fprintf(stderr, "Memory allocation error.\n");
+		return 1;
+	}
+	
+	/* Total input size for the throughput figure */
+	uint64_t bytes = 0;
+	for (size_t i = 0; i < count; i++) {
+		struct stat st;
+		if (!stat(argv[optind + i], &st)) bytes += st.st_size;
+	}
+	
+	double start = now();
+	if (!hash_files(argv + optind, count, algorithm, threads, digests, ok)) {
+		fprintf(stderr, "Failed to start hashing threads.\n");
+		return 1;
+	}
+	double elapsed = now() - start;
+	
+	int ret = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (!ok[i]) {
+			fprintf(stderr, "Failed to hash %s.\n", argv[optind + i]);
+			ret = 1;
+			continue;
+		}
+		for (size_t j = 0; j < length; j++)
+			printf("%02x", digests[i][j]);
+		printf("  %s\n", argv[optind + i]);
+	}
+	
+	if (benchmark && elapsed > 0) {
+		unsigned cores = threads < count ? threads : (unsigned)count;
+		double rate = bytes / elapsed / 1e9;
+		fprintf(stderr, "%llu bytes in %.3f s: %.2f GB/s, %.2f GB/s per core (%u threads)\n",
+		        (unsigned long long)bytes, elapsed, rate, rate / cores, cores);
+	}
+	
+	free(digests);
+	free(ok);
+	return ret;
+}
@@ -0,0 +1,216 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <getopt.h>
+
+#include <openssl/sha.h>
+
+#include "bxformat.h"
+#include "bxrange.h"
+#include "hashcache.h"
+
+static const char *usage = "usage: bxindex [-i <MB>] <patchfile> <indexfile>\n"
+                           "       bxindex -x [--no-verify] [-H <hashcache>] <offset> <length> <oldfile> <patchfile> <indexfile>";
+
+static const struct option options[] = {
+	{"no-verify", no_argument, NULL, 'n'},
+	{NULL, 0, NULL, 0}
+};
+
+static bool verify = true;
+static const char *hash_cache_path = NULL;
+
+static bool hash_path(const char *path, uint8_t *dst) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	int ret = SHA1_File(f, dst);
+	fclose(f);
+	return ret;
+}
+
+/*
+ * The ops of a range are replayed against the old file, so it has to be
+ * the one the patch was made for. A cached digest is used the way bxpatch
+ * uses it.
+ */
+static bool check_input(FILE *in_file, const bxdiff_patch_t *patch) {
+	uint8_t input_sha1[SHA_DIGEST_LENGTH];
+	hashcache_key_t key, key_after;
+	
+	if (!verify || !patch->has_input_hash) return true;
+	bool keyed = hash_cache_path && hashcache_key(fileno(in_file), &key);
+	if (!keyed || !hashcache_lookup(hash_cache_path, &key, input_sha1)) {
+		if (!SHA1_File(in_file, input_sha1)) {
+			fprintf(stderr, "Failed to calculate SHA1 hash of the input file.\n");
+			return false;
+		}
+		if (keyed && hashcache_key(fileno(in_file), &key_after) && !memcmp(&key, &key_after, sizeof(key)))
+			hashcache_store(hash_cache_path, &key, input_sha1);
+	}
+	if (memcmp(patch->input_sha1, input_sha1, SHA_DIGEST_LENGTH)) {
+		fprintf(stderr, "This patch shall not be applied to the provided file (wrong SHA1 hash).\nUse --no-verify to extract the range anyway.\n");
+		return false;
+	}
+	return true;
+}
+
+static int build_index(const char *patchfile_path, const char *indexfile_path, uint64_t interval) {
+	uint8_t patch_sha1[SHA_DIGEST_LENGTH];
+	if (!hash_path(patchfile_path, patch_sha1)) {
+		fprintf(stderr, "Failed to calculate SHA1 hash of %s.\n", patchfile_path);
+		return 1;
+	}
+	
+	bxdiff_patch_t *patch = bxdiff_patch_open(patchfile_path);
+	if (!patch) return 1;
+	
+	/* Ranges of a filtered patch could only be unfiltered from the start */
+	if (patch->filter) {
+		fprintf(stderr, "Filtered patches are not supported.\n");
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	if (!bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	
+	bxrange_index_t *index = bxrange_index_build(patch, patch_sha1, interval);
+	bxdiff_patch_close(patch);
+	if (!index) {
+		fprintf(stderr, "Memory allocation error.\n");
+		return 1;
+	}
+	
+	FILE *f = fopen(indexfile_path, "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s.\n", indexfile_path);
+		bxrange_index_free(index);
+		return 1;
+	}
+	bool ok = bxrange_index_write(index, f);
+	if (fclose(f)) ok = false;
+	if (!ok) fprintf(stderr, "Failed to write %s.\n", indexfile_path);
+	else printf("%llu checkpoints\n", (unsigned long long)index->count);
+	bxrange_index_free(index);
+	return !ok;
+}
+
+static int extract_range(uint64_t offset, uint64_t length, const char *infile_path, const char *patchfile_path, const char *indexfile_path) {
+	FILE *f = fopen(indexfile_path, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s.\n", indexfile_path);
+		return 1;
+	}
+	bxrange_index_t *index = bxrange_index_read(f);
+	fclose(f);
+	if (!index) {
+		fprintf(stderr, "%s is not a BXDIFF index.\n", indexfile_path);
+		return 1;
+	}
+	
+	uint8_t patch_sha1[SHA_DIGEST_LENGTH];
+	if (!hash_path(patchfile_path, patch_sha1) || memcmp(patch_sha1, index->patch_sha1, SHA_DIGEST_LENGTH)) {
+		fprintf(stderr, "%s was not built for %s.\n", indexfile_path, patchfile_path);
+		bxrange_index_free(index);
+		return 1;
+	}
+	
+	bxdiff_patch_t *patch = bxdiff_patch_open(patchfile_path);
+	if (!patch || !bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		bxrange_index_free(index);
+		return 1;
+	}
+	
+	int ret = 1;
+	FILE *in_file = fopen(infile_path, "rb");
+	void *buf = malloc(length ? length : 1);
+	if (!in_file) {
+		fprintf(stderr, "Failed to open %s.\n", infile_path);
+	} else if (!buf) {
+		fprintf(stderr, "Memory allocation error.\n");
+	} else if (!check_input(in_file, patch)) {
+		/* The reason was printed already */
+	} else if (!bxrange_read(index, patch, in_file, offset, length, buf)) {
+		fprintf(stderr, "Failed to extract the requested range.\n");
+	} else if (fwrite(buf, 1, length, stdout) != length) {
+		fprintf(stderr, "Unexpected I/O error.\n");
+	} else {
+		ret = 0;
+	}
+	
+	if (buf) free(buf);
+	if (in_file) fclose(in_file);
+	bxdiff_patch_close(patch);
+	bxrange_index_free(index);
+	return ret;
+}
+
+int main(int argc, const char * argv[]) {
+	uint64_t interval = 16;
+	bool extract = false;
+	int ch;
+	
+	while ((ch = getopt_long(argc, (char * const *)argv, "i:xH:", options, NULL)) != -1) {
+		switch (ch) {
+			case 'n':
+				verify = false;
+				break;
+			case 'H':
+				hash_cache_path = optarg;
+				break;
+			case 'i':
+				interval = strtoull(optarg, NULL, 0);
+				break;
+			case 'x':
+				extract = true;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	
+	if (extract) {
+		if (argc - optind != 5) {
+			puts(usage);
+			return 0;
+		}
+		return extract_range(strtoull(argv[optind], NULL, 0), strtoull(argv[optind + 1], NULL, 0), argv[optind + 2], argv[optind + 3], argv[optind + 4]);
+	}
+	
+	if (argc - optind != 2 || !interval) {
+		puts(usage);
+		return 0;
+	}
+	return build_index(argv[optind], argv[optind + 1], interval << 20);
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "bxformat.h"
+#include "branchfilter.h"
+
+static const char *usage = "usage: bxinfo [-j] [-D <dictionary>] <patchfile> [<oldfile>]\n"
+                           "       -j prints JSON instead of text\n"
+                           "       <oldfile> gives the size of the old file that is hashed, otherwise the span read by mix ops stands in for it";
+
+#define HISTOGRAM_BUCKETS 65
+
+/* Forward seeks up to this far are served by readahead and cost no positioning */
+#define READAHEAD_LIMIT (128 << 10)
+
+/* Hashing the old and new file, decompression is measured */
+#define HASH_RATE 1e9
+
+typedef struct {
+	const char *name;
+	double latency;		/* seconds per repositioning */
+	double read_rate;	/* bytes per second */
+	double write_rate;
+} storage_model_t;
+
+static const storage_model_t storage_models[] = {
+	{"ssd", 0.0001, 2e9, 1e9},
+	{"hdd", 0.008, 150e6, 120e6},
+	{"nfs", 0.002, 100e6, 80e6},
+};
+
+#define STORAGE_MODELS (sizeof(storage_models) / sizeof(storage_models[0]))
+
+/* Bucket 0 holds zero, bucket n holds [2^(n-1), 2^n) */
+typedef struct {
+	uint64_t counts[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+typedef struct {
+	uint64_t start, end;
+} extent_t;
+
+typedef struct {
+	uint64_t ops;
+	uint64_t mixed, copied;
+	uint64_t zero_diff;
+	uint64_t backward_seeks, backward_distance;
+	uint64_t jumps;
+	uint64_t working_set, old_span;
+	uint64_t old_size;	/* 0 unless the old file is given */
+	histogram_t mixlen, copylen, seeklen;
+	double decode_time;
+	uint64_t memory_peak, memory_used;
+	double apply_time[STORAGE_MODELS];
+	bool valid;
+} patch_info_t;
+
+static void histogram_add(histogram_t *h, uint64_t value) {
+	h->counts[value ? 64 - __builtin_clzll(value) : 0]++;
+}
+
+static int compare_extents(const void *a, const void *b) {
+	const extent_t *x = a, *y = b;
+	return x->start < y->start ? -1 : x->start > y->start;
+}
+
+/* Bytes of the old file read by mix ops, each counted once */
+static uint64_t union_length(extent_t *extents, uint64_t count) {
+	qsort(extents, count, sizeof(extent_t), compare_extents);
+	uint64_t total = 0, covered_to = 0;
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t start = extents[i].start > covered_to ? extents[i].start : covered_to;
+		if (extents[i].end > start) {
+			total += extents[i].end - start;
+			covered_to = extents[i].end;
+		}
+	}
+	return total;
+}
+
+static bool analyze(const bxdiff_patch_t *patch, patch_info_t *info) {
+	const bxdiff_control_t *c = patch->control;
+	info->ops = patch->control_length / sizeof(bxdiff_control_t);
+	info->valid = bxdiff_patch_validate(patch);
+	
+	extent_t *extents = malloc((info->ops ? info->ops : 1) * sizeof(extent_t));
+	if (!extents) return false;
+	
+	/* Replays the read pointer of the old file like bxpatch does */
+	uint64_t count = 0;
+	int64_t position = 0;
+	bool pending_jump = false;
+	for (uint64_t i = 0; i < info->ops; i++, c++) {
+		uint64_t mixlen = parse_integer(c->mixlen);
+		uint64_t copylen = parse_integer(c->copylen);
+		int64_t seeklen = parse_integer(c->seeklen);
+		histogram_add(&info->mixlen, mixlen);
+		histogram_add(&info->copylen, copylen);
+		histogram_add(&info->seeklen, seeklen < 0 ? -(uint64_t)seeklen : (uint64_t)seeklen);
+		
+		if (mixlen) {
+			if (pending_jump) info->jumps++;
+			pending_jump = false;
+			if (position >= 0) {
+				extents[count].start = position;
+				extents[count].end = position + mixlen;
+				if (extents[count].end > info->old_span) info->old_span = extents[count].end;
+				count++;
+			}
+		}
+		info->mixed += mixlen;
+		info->copied += copylen;
+		position += mixlen + seeklen;
+		
+		if (seeklen < 0) {
+			info->backward_seeks++;
+			info->backward_distance += -(uint64_t)seeklen;
+		}
+		if (seeklen < 0 || seeklen > READAHEAD_LIMIT)
+			pending_jump = true;
+	}
+	info->working_set = union_length(extents, count);
+	free(extents);
+	
+	const uint8_t *d = patch->diff;
+	for (size_t i = 0; i < patch->diff_length; i++)
+		info->zero_diff += !d[i];
+	
+	/* Hash the old file, read the mixed bytes with a repositioning per jump and write the new file */
+	uint64_t hashed = !patch->has_input_hash ? 0 : info->old_size ? info->old_size : info->old_span;
+	for (unsigned m = 0; m < STORAGE_MODELS; m++) {
+		const storage_model_t *model = &storage_models[m];
+		double hash_read = hashed / model->read_rate;
+		double hashing = (hashed + patch->patched_file_size) / HASH_RATE;
+		info->apply_time[m] = info->decode_time + hashing + hash_read + info->jumps * model->latency +
+		                      info->working_set / model->read_rate + patch->patched_file_size / model->write_rate;
+	}
+	return true;
+}
+
+static const char *version_name(bxdiff_version_t version) {
+	switch (version) {
+		case BXDIFF40: return "BXDIFF40";
+		case BXDIFF41: return "BXDIFF41";
+		case BXDIFF50: return "BXDIFF50";
+		case BXDIFF51: return "BXDIFF51";
+		default: return "unknown";
+	}
+}
+
+/* Codec of a stored block, from its first bytes */
+static const char *block_codec(const bxdiff_patch_t *patch, uint64_t offset, uint64_t size) {
+	if (patch->version < BXDIFF50) return "xz";
+	
+	uint8_t magic[6];
+	if (patch->streaming || size < sizeof(magic) || pread(patch->fd, magic, sizeof(magic), offset) != sizeof(magic))
+		return "pbzx";
+	if (!memcmp(magic, "\x28\xB5\x2F\xFD", 4)) return "zstd";
+	if (!memcmp(magic, "\xFD" "7zXZ\0", 6)) return "xz";
+	return "pbzx";
+}
+
+static void hex_string(const uint8_t *data, char *dst) {
+	for (unsigned i = 0; i < 20; i++)
+		sprintf(dst + i * 2, "%02x", data[i]);
+}
+
+static void print_histogram_text(const char *name, const histogram_t *h) {
+	printf("%s histogram:\n", name);
+	for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		if (!h->counts[b]) continue;
+		if (b < 2) printf("  %u: %llu\n", b, (unsigned long long)h->counts[b]);
+		else printf("  %llu-%llu: %llu\n", 1ULL << (b - 1), b == 64 ? ~0ULL : (1ULL << b) - 1, (unsigned long long)h->counts[b]);
+	}
+}
+
+static void print_histogram_json(const char *name, const histogram_t *h) {
+	printf("  \"%s_histogram\": [", name);
+	bool first = true;
+	for (unsigned b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		if (!h->counts[b]) continue;
+		printf("%s{\"min\": %llu, \"count\": %llu}", first ? "" : ", ", b ? 1ULL << (b - 1) : 0ULL, (unsigned long long)h->counts[b]);
+		first = false;
+	}
+	printf("],\n");
+}
+
+static void print_text(const bxdiff_patch_t *patch, const patch_info_t *info, const char **codecs) {
+	char hex[41];
+	printf("version: %s\n", version_name(patch->version));
+	if (patch->filter) printf("filter: %s\n", branchfilter_name(patch->filter));
+	if (patch->has_input_hash) {
+		hex_string(patch->input_sha1, hex);
+		printf("input sha1: %s\n", hex);
+	}
+	if (patch->has_output_hash) {
+		hex_string(patch->output_sha1, hex);
+		printf("output sha1: %s\n", hex);
+	}
+	printf("patched file size: %llu\n", (unsigned long long)patch->patched_file_size);
+	printf("control block: %llu -> %zu (%s)\n", (unsigned long long)patch->control_size, patch->control_length, codecs[0]);
+	printf("diff block: %llu -> %zu (%s)\n", (unsigned long long)patch->diff_size, patch->diff_length, codecs[1]);
+	printf("extra block: %llu -> %zu (%s)\n", (unsigned long long)patch->extra_size, patch->extra_length, codecs[2]);
+	printf("valid: %s\n", info->valid ? "yes" : "no");
+	printf("ops: %llu\n", (unsigned long long)info->ops);
+	printf("mixed bytes: %llu\n", (unsigned long long)info->mixed);
+	printf("copied bytes: %llu\n", (unsigned long long)info->copied);
+	printf("zero diff bytes: %.4f\n", patch->diff_length ? (double)info->zero_diff / patch->diff_length : 0.0);
+	printf("backward seeks: %llu (%llu bytes)\n", (unsigned long long)info->backward_seeks, (unsigned long long)info->backward_distance);
+	printf("jumps: %llu\n", (unsigned long long)info->jumps);
+	printf("working set: %llu of %llu bytes\n", (unsigned long long)info->working_set, (unsigned long long)info->old_span);
+	if (info->old_size) printf("old file size: %llu\n", (unsigned long long)info->old_size);
+	print_histogram_text("mixlen", &info->mixlen);
+	print_histogram_text("copylen", &info->copylen);
+	print_histogram_text("seeklen", &info->seeklen);
+	printf("decode time: %.3f s\n", info->decode_time);
+	if (info->memory_peak)
+		printf("decode arena: %llu bytes in use, %llu at peak\n", (unsigned long long)info->memory_used, (unsigned long long)info->memory_peak);
+	for (unsigned m = 0; m < STORAGE_MODELS; m++)
+		printf("apply time %s: %.3f s\n", storage_models[m].name, info->apply_time[m]);
+}
+
+static void print_json(const bxdiff_patch_t *patch, const patch_info_t *info, const char **codecs) {
+	char hex[41];
+	const char *names[] = {"control", "diff", "extra"};
+	uint64_t sizes[] = {patch->control_size, patch->diff_size, patch->extra_size};
+	size_t lengths[] = {patch->control_length, patch->diff_length, patch->extra_length};
+	
+	printf("{\n");
+	printf("  \"version\": \"%s\",\n", version_name(patch->version));
+	printf("  \"filter\": \"%s\",\n", patch->filter ? branchfilter_name(patch->filter) : "none");
+	if (patch->has_input_hash) {
+		hex_string(patch->input_sha1, hex);
+		printf("  \"input_sha1\": \"%s\",\n", hex);
+	}
+	if (patch->has_output_hash) {
+		hex_string(patch->output_sha1, hex);
+		printf("  \"output_sha1\": \"%s\",\n", hex);
+	}
+	printf("  \"patched_file_size\": %llu,\n", (unsigned long long)patch->patched_file_size);
+	printf("  \"blocks\": {");
+	for (unsigned b = 0; b < 3; b++)
+		printf("%s\"%s\": {\"compressed\": %llu, \"decompressed\": %zu, \"codec\": \"%s\"}", b ? ", " : "", names[b], (unsigned long long)sizes[b], lengths[b], codecs[b]);
+	printf("},\n");
+	printf("  \"valid\": %s,\n", info->valid ? "true" : "false");
+	printf("  \"ops\": %llu,\n", (unsigned long long)info->ops);
+	printf("  \"mixed_bytes\": %llu,\n", (unsigned long long)info->mixed);
+	printf("  \"copied_bytes\": %llu,\n", (unsigned long long)info->copied);
+	printf("  \"zero_diff_fraction\": %.6f,\n", patch->diff_length ? (double)info->zero_diff / patch->diff_length : 0.0);
+	printf("  \"backward_seeks\": %llu,\n", (unsigned long long)info->backward_seeks);
+	printf("  \"backward_seek_distance\": %llu,\n", (unsigned long long)info->backward_distance);
+	printf("  \"jumps\": %llu,\n", (unsigned long long)info->jumps);
+	printf("  \"working_set\": %llu,\n", (unsigned long long)info->working_set);
+	printf("  \"old_span\": %llu,\n", (unsigned long long)info->old_span);
+	if (info->old_size) printf("  \"old_size\": %llu,\n", (unsigned long long)info->old_size);
+	print_histogram_json("mixlen", &info->mixlen);
+	print_histogram_json("copylen", &info->copylen);
+	print_histogram_json("seeklen", &info->seeklen);
+	printf("  \"decode_time\": %.6f,\n", info->decode_time);
+	printf("  \"decode_memory\": %llu,\n", (unsigned long long)info->memory_used);
+	printf("  \"decode_memory_peak\": %llu,\n", (unsigned long long)info->memory_peak);
+	printf("  \"apply_time\": {");
+	for (unsigned m = 0; m < STORAGE_MODELS; m++)
+		printf("%s\"%s\": %.6f", m ? ", " : "", storage_models[m].name, info->apply_time[m]);
+	printf("}\n}\n");
+}
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, const char * argv[]) {
+	bool json = false;
+	int ch;
+	
+	while ((ch = getopt(argc, (char * const *)argv, "jD:")) != -1) {
+		switch (ch) {
+			case 'j':
+				json = true;
+				break;
+			case 'D':
+				if (!bxdiff_load_dictionary(optarg))
+					return 1;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	if (argc - optind != 1 && argc - optind != 2) {
+		puts(usage);
+		return 0;
+	}
+	
+	patch_info_t info;
+	memset(&info, 0, sizeof(info));
+	if (argc - optind == 2) {
+		struct stat st;
+		if (stat(argv[optind + 1], &st)) {
+			fprintf(stderr, "Failed to open %s.\n", argv[optind + 1]);
+			return 1;
+		}
+		info.old_size = st.st_size;
+	}
+	
+	bxdiff_patch_t *patch = bxdiff_patch_open(argv[optind]);
+	if (!patch) return 1;
+	
+	/* Codecs are read before decoding moves the file position */
+	uint64_t diff_offset = patch->control_offset + patch->control_size;
+	const char *codecs[3] = {
+		block_codec(patch, patch->control_offset, patch->control_size),
+		block_codec(patch, diff_offset, patch->diff_size),
+		block_codec(patch, diff_offset + patch->diff_size, patch->extra_size)
+	};
+	
+	bxdiff_patch_use_arena(patch, false);
+	double start = now();
+	if (!bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	info.decode_time = now() - start;
+	
+	if (!analyze(patch, &info)) {
+		fprintf(stderr, "Memory allocation error.\n");
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	
+	if (patch->arena) {
+		bxarena_stats_t stats;
+		bxarena_stats(patch->arena, &stats);
+		info.memory_peak = stats.peak;
+		info.memory_used = stats.used;
+	}
+	
+	if (json) print_json(patch, &info, codecs);
+	else print_text(patch, &info, codecs);
+	
+	bxdiff_patch_close(patch);
+	return 0;
+}
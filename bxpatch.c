@@ -24,477 +24,842 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 
-#include <lzma.h>
 #include <openssl/sha.h>
 
-#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
-#define bswapLittleToHost32(x) x
-#define bswapBigToHost32(x) __builtin_bswap32(x)
-#define bswapHostToLittle32(x) x
-#define bswapHostToBig32(x) __builtin_bswap32(x)
-#define bswapLittleToHost64(x) x
-#define bswapBigToHost64(x) __builtin_bswap64(x)
-#define bswapHostToLittle64(x) x
-#define bswapHostToBig64(x) __builtin_bswap64(x)
-#else
-#define bswapLittleToHost32(x) __builtin_bswap32(x)
-#define bswapBigToHost32(x) x
-#define bswapHostToLittle32(x) __builtin_bswap32(x)
-#define bswapHostToBig32(x) x
-#define bswapLittleToHost64(x) __builtin_bswap64(x)
-#define bswapBigToHost64(x) x
-#define bswapHostToLittle64(x) __builtin_bswap64(x)
-#define bswapHostToBig64(x) x
-#endif
+#include "bxformat.h"
+#include "hashcache.h"
+#include "uringio.h"
+#include "bxresume.h"
+#include "bxundo.h"
+#include "branchfilter.h"
+#include "bxtrace.h"
+#include "bxdaemon.h"
+#include "bxapply.h"
+#include "hashio.h"
 
-typedef enum {
-	BXDIFF_INVALID = 0,
-	BXDIFF40 = 1,
-	BXDIFF41 = 2,
-	BXDIFF50 = 3,
-} bxdiff_version_t;
+static const char *usage = "usage: bxpatch [-f] [-d] [-c <cachefile>] [-H <hashcache>] [--resume] [--emit-undo <undopatch>] [--zstd-dict <dictionary>] [--trace <trace.json>] [--huge-pages] [--no-uring] <oldfile> <newfile> <patchfile>\n"
+                           "       bxpatch [-f] --daemon <socket> <oldfile> <newfile> <patchfile>\n"
+                           "       bxpatch [-f] [-j <threads>] [-H <hashcache>] --fan-out <oldfile> <newfile> <patchfile> [<newfile> <patchfile>...]\n"
+                           "       bxpatch --prepare <patchfile> <cachefile>\n"
+                           "       <newfile> and <patchfile> may be - for stdout and stdin\n"
+                           "       --resume reads and hashes the output written before the checkpoint again and decodes the patch again unless -c is given";
 
-typedef struct {
-	uint64_t mixlen;
-	uint64_t copylen;
-	uint64_t seeklen;
-} bxdiff_control_t;
+static const struct option long_options[] = {
+	{"force", no_argument, NULL, 'f'},
+	{"direct", no_argument, NULL, 'd'},
+	{"cache", required_argument, NULL, 'c'},
+	{"prepare", no_argument, NULL, 'P'},
+	{"hash-cache", required_argument, NULL, 'H'},
+	{"resume", no_argument, NULL, 'R'},
+	{"emit-undo", required_argument, NULL, 'U'},
+	{"zstd-dict", required_argument, NULL, 'Z'},
+	{"trace", required_argument, NULL, 'T'},
+	{"huge-pages", no_argument, NULL, 'G'},
+	{"no-uring", no_argument, NULL, 'N'},
+	{"daemon", required_argument, NULL, 'S'},
+	{"fan-out", no_argument, NULL, 'F'},
+	{"threads", required_argument, NULL, 'j'},
+	{NULL, 0, NULL, 0}
+};
 
-typedef struct {
-	char magic[8];
-	uint64_t control_size;
-	uint64_t diff_size;
-	uint64_t patched_file_size;
-} bxdiff40_header_t;
-
-typedef struct __attribute__((packed)) {
-	char magic[8];
-	uint64_t unknown;
-	uint64_t patched_file_size;
-	uint64_t control_size;
-	uint64_t extra_size;
-	uint8_t result_sha1[20];
-	uint64_t diff_size;
-	uint8_t target_sha1[20];
-}  bxdiff50_header_t;
-
-FILE *in_file, *out_file;
-int patch_file;
+FILE *in_file;
+FILE *message_file;
+int out_fd;
+URING *ring;
 bool force = false;
+bool direct_output = false;
+bool resume = false;
+bool huge_pages = false;
+bool use_uring = true;
+const char *cache_path = NULL;
+const char *hash_cache_path = NULL;
+char *resume_path = NULL;
+const char *undo_path = NULL;
+const char *daemon_path = NULL;
+unsigned threads = 0;
 
 size_t in_file_size = 0;
-size_t patch_file_length;
 
-bxdiff_version_t version;
+bxdiff_patch_t *patch;
+bxundo_t *undo;
 size_t patched_file_size = 0;
-void *control, *diff, *extra;
-size_t control_length, diff_length, extra_length;
 
 uint8_t input_sha1[20];
-bool has_input_hash;
 uint8_t output_sha1[20];
-uint8_t target_output_sha1[20];
-bool has_output_hash;
+EVP_MD_CTX *output_hash;
+
+uint64_t output_length;
 
-size_t extra_compressed_length;
+/* Where the apply starts, all zero unless an earlier run is resumed */
+bxresume_t checkpoint;
+uint64_t next_checkpoint;
 
-static void *lzma_easy_buffer_decompress (void *compressed_data, size_t size, size_t *dsize);
-static void *pbzx_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty);
-static uint64_t parse_integer(uint64_t);
 static void print_hex(const void *, size_t);
-static int SHA1_File(FILE *, uint8_t *);
+static int open_output(const char *path, bool resuming);
+static bool output_open(uint64_t start);
+static uint8_t *output_reserve(size_t *length);
+static void output_commit(size_t length);
+static void output_write(const void *buf, size_t length);
+static void output_sync(void);
+static void output_close(void);
+static void output_hash_update(const void *buf, size_t length);
+static void __attribute__((noreturn)) apply_fail(const char *message);
+static void trace_op(const bxdiff_control_t *c, uint64_t start);
+static void apply_stdio(void);
+static bool apply_uring(int in_fd, int out_fd);
+static bool resume_load(const char *outfile_path);
+static void resume_save(const bxapply_state_t *state);
+static FILE *filter_input(FILE *f, const char *outfile_path);
+static void unfilter_output(void);
+static void write_undo(void);
+static int prepare(const char *patchfile_path, const char *cachefile_path);
+static int apply_remote(const char *infile_path, const char *outfile_path, const char *patchfile_path);
+static int fan_out(const char *infile_path, size_t count, const char **paths);
 
 int main(int argc, const char * argv[]) {
-	const char *infile_path = argv[1];
-	const char *outfile_path = argv[2];
-	const char *patchfile_path = argv[3];
+	bool prepare_only = false;
+	bool fan_out_only = false;
+	int ch;
+	while ((ch = getopt_long(argc, (char * const *)argv, "fdc:H:j:", long_options, NULL)) != -1) {
+		switch (ch) {
+			case 'f':
+				force = true;
+				break;
+			case 'd':
+				direct_output = true;
+				break;
+			case 'c':
+				cache_path = optarg;
+				break;
+			case 'P':
+				prepare_only = true;
+				break;
+			case 'H':
+				hash_cache_path = optarg;
+				break;
+			case 'R':
+				resume = true;
+				break;
+			case 'U':
+				undo_path = optarg;
+				break;
+			case 'Z':
+				if (!bxdiff_load_dictionary(optarg))
+					exit(1);
+				break;
+			case 'T':
+				if (!bxtrace_open(optarg))
+					exit(1);
+				break;
+			case 'G':
+				huge_pages = true;
+				break;
+			case 'N':
+				use_uring = false;
+				break;
+			case 'S':
+				daemon_path = optarg;
+				break;
+			case 'F':
+				fan_out_only = true;
+				break;
+			case 'j':
+				threads = (unsigned)strtoul(optarg, NULL, 0);
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
 	
-	if ((argc != 4) && (argc != 5)) {
-		puts("usage: bxpatch [-f] <oldfile> <newfile> <patchfile>");
-		return 0;
+	if (prepare_only) {
+		if (argc - optind != 2) {
+			puts(usage);
+			return 0;
+		}
+		return prepare(argv[optind], argv[optind + 1]);
 	}
-	if (argc == 5) {
-		if (strcmp(argv[1], "-f")) {
-			puts("usage: bxpatch [-f] <oldfile> <newfile> <patchfile>");
+	
+	if (fan_out_only) {
+		if (argc - optind < 3 || (argc - optind) % 2 != 1) {
+			puts(usage);
 			return 0;
-		} else {
-			force = true;
-			infile_path = argv[2];
-			outfile_path = argv[3];
-			patchfile_path = argv[4];
 		}
+		return fan_out(argv[optind], (argc - optind - 1) / 2, argv + optind + 1);
 	}
 	
-	patch_file = open(patchfile_path, O_RDONLY);
-	if (patch_file < 0) {
-		fprintf(stderr, "Failed to open %s.\n", patchfile_path);
-		exit(1);
+	if (argc - optind != 3) {
+		puts(usage);
+		return 0;
 	}
+	const char *infile_path = argv[optind];
+	const char *outfile_path = argv[optind + 1];
+	const char *patchfile_path = argv[optind + 2];
 	
-	patch_file_length = lseek(patch_file, 0, SEEK_END);
-	if (patch_file_length <= sizeof(bxdiff40_header_t)) {
-		fprintf(stderr, "%s is not a BXDIFF patch.\n", patchfile_path);
-		close(patch_file);
+	/* The undo patch needs every mix op, a resumed run has skipped some */
+	if (undo_path && resume) {
+		fprintf(stderr, "--emit-undo can not be combined with --resume.\n");
 		exit(1);
 	}
-	lseek(patch_file, 0, SEEK_SET);
 	
-	char magic[8];
-	if (read(patch_file, &magic, 8) != 8) {
-		fprintf(stderr, "Unexpected I/O error.\n");
-		close(patch_file);
-		exit(1);
+	/* Keep stdout clean when the new file is written there */
+	message_file = strcmp(outfile_path, "-") ? stdout : stderr;
+	
+	if (daemon_path) {
+		/* bxpatchd decodes, hashes and writes by itself */
+		const char *option = direct_output ? "-d" : cache_path ? "-c" : hash_cache_path ? "-H" :
+		                     resume ? "--resume" : undo_path ? "--emit-undo" : huge_pages ? "--huge-pages" : NULL;
+		if (option) {
+			fprintf(stderr, "--daemon can not be combined with %s.\n", option);
+			exit(1);
+		}
+		return apply_remote(infile_path, outfile_path, patchfile_path);
 	}
 	
-	if (!strncmp(magic, "BXDIFF40", 8)) {
-		version = BXDIFF40;
-		has_input_hash = false;
-		has_output_hash = false;
-	} else if (!strncmp(magic, "BXDIFF41", 8)) {
-		version = BXDIFF41;
-		has_input_hash = true;
-		has_output_hash = false;
-	} else if (!strncmp(magic, "BXDIFF50", 8)) {
-		version = BXDIFF50;
-		has_input_hash = true;
-		has_output_hash = true;
-	} else if (!strncmp(magic, "BSDIFF", 6)) {
-		fprintf(stderr, "BSDIFF patches are not supported.\n");
-		close(patch_file);
+	patch = bxdiff_patch_open(patchfile_path);
+	if (!patch)
 		exit(1);
-	} else {
-		fprintf(stderr, "%s is not a BXDIFF patch.\n", patchfile_path);
-		close(patch_file);
-		exit(1);
-	}
 	
 	in_file = fopen(infile_path, "rb");
 	if (!in_file) {
-		fprintf(stderr, "Failed to open %s.", infile_path);
-		close(patch_file);
+		fprintf(stderr, "Failed to open %s.\n", infile_path);
+		bxdiff_patch_close(patch);
 		exit(1);
 	}
 	fseek(in_file, 0, SEEK_END);
 	in_file_size = ftell(in_file);
 	fseek(in_file, 0, SEEK_SET);
-	if (has_input_hash) {
-		if (!SHA1_File(in_file, input_sha1)) {
-			fprintf(stderr, "Failed to calculate SHA1 hash of the input file.\n");
-			fclose(in_file);
-			close(patch_file);
-			exit(1);
-		}
-	}
-	fclose(in_file);
-	
-	lseek(patch_file, 0, SEEK_SET);
-	if (version < BXDIFF50) {
-		bxdiff40_header_t header;
-		if (read(patch_file, &header, sizeof(bxdiff40_header_t)) != sizeof(bxdiff40_header_t)) {
-			fprintf(stderr, "Unexpected I/O error.\n");
-			close(patch_file);
-			exit(1);
-		}
-		
-		if (has_input_hash) {
-			void *actual_hash = alloca(SHA_DIGEST_LENGTH);
-			if (read(patch_file, actual_hash, SHA_DIGEST_LENGTH) != SHA_DIGEST_LENGTH) {
-				fprintf(stderr, "Unexpected I/O error.\n");
-				close(patch_file);
-				exit(1);
-			}
-			
-			if (memcmp(actual_hash, input_sha1, SHA_DIGEST_LENGTH)) {
-				if (!force) {
-					printf("This patch shall not be applied to the provided file (wrong SHA1 hash).\nDo you still want to continue? (y/n) [n]: ");
-					char c = getchar();
-					if ((c != 'y') && (c != 'Y')) {
-						close(patch_file);
-						exit(1);
-					}
-				} else {
-					puts("SHA1 hash mismatch. Forcing patch anyway.");
-				}
-			}
-		}
-		
-		patched_file_size = header.patched_file_size;
-		size_t patch_length_no_extra = header.control_size + header.diff_size + SHA_DIGEST_LENGTH * has_input_hash + sizeof(bxdiff40_header_t);
-		if (patch_length_no_extra > patch_file_length) {
-			fprintf(stderr, "Patch is truncated.\n");
-			close(patch_file);
-			exit(1);
-		}
-		extra_compressed_length = patch_file_length - patch_length_no_extra;
-		
-		control = malloc(header.control_size);
-		diff = malloc(header.diff_size);
-		if (!control || !diff) {
-			fprintf(stderr, "Memory allocation error.\n");
-			if (control) free(control);
-			else if (diff) free(diff);
-			close(patch_file);
-			exit(1);
-		}
-		if (extra_compressed_length > 0) {
-			extra = malloc(extra_compressed_length);
-			if (!extra) {
-				fprintf(stderr, "Memory allocation error.\n");
-				free(control);
-				free(diff);
-				close(patch_file);
-				exit(1);
-			}
-		}
-		
-		/* Reading all patch blocks. */
-		if (read(patch_file, control, header.control_size) != header.control_size) {
-			fprintf(stderr, "Failed to read control block.\n");
-			goto bxdiff40_block_read_error;
-		}
-		if (read(patch_file, diff, header.diff_size) != header.diff_size) {
-			fprintf(stderr, "Failed to read diff block.\n");
-			goto bxdiff40_block_read_error;
-		}
-		if (extra) {
-			if (read(patch_file, extra, extra_compressed_length) != extra_compressed_length) {
-				fprintf(stderr, "Failed to read extra block.\n");
-			bxdiff40_block_read_error:
-				free(control);
-				free(diff);
-				if (extra) free(extra);
-				close(patch_file);
-				exit(1);
-			}
-		}
-		
-		close(patch_file);
-		
-		void *buf;
-		
-		control_length = 0;
-		buf = lzma_easy_buffer_decompress(control, (uint32_t)header.control_size, &control_length);
-		free(control);
-		if (!buf) {
-			fprintf(stderr, "Failed to extract control block.\n");
-			free(diff);
-			if (extra) free(extra);
-			exit(1);
-		}
-		control = buf;
-		
-		diff_length = 0;
-		buf = lzma_easy_buffer_decompress(diff, (uint32_t)header.diff_size, &diff_length);
-		free(diff);
-		if (!buf) {
-			fprintf(stderr, "Failed to extract diff block.\n");
-			free(control);
-			if (extra) free(extra);
-			exit(1);
-		}
-		diff = buf;
-		
-		if (extra) {
-			buf = lzma_easy_buffer_decompress(extra, extra_compressed_length, &extra_length);
-			free(extra);
-			if (!buf) {
-				fprintf(stderr, "Failed to extract extra block.\n");
-				free(control);
-				free(diff);
+	if (patch->has_input_hash) {
+		/* The cached digest is only trusted if the file did not change
+		 * since it was recorded, and only stored if it did not change
+		 * while being hashed.
+		 */
+		hashcache_key_t key, key_after;
+		bool keyed = hash_cache_path && hashcache_key(fileno(in_file), &key);
+		if (!keyed || !hashcache_lookup(hash_cache_path, &key, input_sha1)) {
+			uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+			bool hashed = SHA1_File(in_file, input_sha1);
+			if (bxtrace_file)
+				bxtrace_event("hash input", "hash", start, "\"length\":%zu", in_file_size);
+			if (!hashed) {
+				fprintf(stderr, "Failed to calculate SHA1 hash of the input file.\n");
+				fclose(in_file);
+				bxdiff_patch_close(patch);
 				exit(1);
 			}
-			extra = buf;
+			if (keyed && hashcache_key(fileno(in_file), &key_after) && !memcmp(&key, &key_after, sizeof(key)))
+				hashcache_store(hash_cache_path, &key, input_sha1);
 		}
-	} else if (version == BXDIFF50) {
-		bxdiff50_header_t header;
-		if (read(patch_file, &header, sizeof(bxdiff50_header_t)) != sizeof(bxdiff50_header_t)) {
-			fprintf(stderr, "Unexpected I/O error.\n");
-			close(patch_file);
-			exit(1);
-		}
-		
-		header.control_size = bswapLittleToHost64(header.control_size);
-		header.diff_size = bswapLittleToHost64(header.diff_size);
-		header.extra_size = bswapLittleToHost64(header.extra_size);
-		header.patched_file_size = bswapLittleToHost64(header.patched_file_size);
-		
-		patched_file_size = header.patched_file_size;
-		if ((header.control_size + header.diff_size + header.extra_size + sizeof(bxdiff50_header_t)) != patch_file_length) {
-			fprintf(stderr, "Patch is corrupt.\n");
-			close(patch_file);
+	}
+	
+	if (patch->has_input_hash && memcmp(patch->input_sha1, input_sha1, SHA_DIGEST_LENGTH)) {
+		if (!force && patch->streaming) {
+			fprintf(stderr, "This patch shall not be applied to the provided file (wrong SHA1 hash).\nUse -f to apply it anyway.\n");
+			bxdiff_patch_close(patch);
 			exit(1);
-		}
-		
-		if (memcmp(header.target_sha1, input_sha1, SHA_DIGEST_LENGTH)) {
-			printf("This patch shall not be applied to the provided file (wrong SHA1 hash).\nDo you still want to continue? (y/n) [n]: ");
+		} else if (!force) {
+			fprintf(message_file, "This patch shall not be applied to the provided file (wrong SHA1 hash).\nDo you still want to continue? (y/n) [n]: ");
+			fflush(message_file);
 			char c = getchar();
 			if ((c != 'y') && (c != 'Y')) {
-				close(patch_file);
+				bxdiff_patch_close(patch);
 				exit(1);
 			}
+		} else {
+			fputs("SHA1 hash mismatch. Forcing patch anyway.\n", message_file);
 		}
-		memcpy(target_output_sha1, header.result_sha1, 20);
-		
-		control = malloc(header.control_size);
-		diff = malloc(header.diff_size);
-		extra = malloc(header.extra_size);
-		if (!control || !diff || !extra) {
-			fprintf(stderr, "Memory allocation error.\n");
-			if (control) free(control);
-			if (diff) free(diff);
-			if (extra) free(extra);
-			close(patch_file);
+	}
+	
+	patched_file_size = patch->patched_file_size;
+	
+	/* Filtered patches are applied to a filtered copy of the old file and
+	 * the output is unfiltered in place afterwards.
+	 */
+	if (patch->filter) {
+		const char *problem = NULL;
+		if (patch->filter > BRANCHFILTER_ARM64) problem = "This patch uses an unknown branch filter.";
+		else if (!strcmp(outfile_path, "-")) problem = "Filtered patches can not be written to stdout.";
+		else if (resume) problem = "Filtered patches can not be resumed.";
+		else if (undo_path) problem = "--emit-undo does not support filtered patches.";
+		if (problem) {
+			fprintf(stderr, "%s\n", problem);
+			bxdiff_patch_close(patch);
 			exit(1);
 		}
-		
-		/* Reading all patch blocks. */
-		if (read(patch_file, control, header.control_size) != header.control_size) {
-			fprintf(stderr, "Failed to read control block.\n");
-			goto bxdiff50_block_read_error;
+	}
+	
+	/* A prepared cache made from this very patch replaces decoding */
+	bool mapped = false;
+	if (cache_path && patch->streaming) {
+		fprintf(stderr, "A prepared cache can not be used with a patch read from stdin.\n");
+	} else if (cache_path) {
+		uint8_t patch_sha1[SHA_DIGEST_LENGTH];
+		mapped = bxdiff_patch_sha1(patch, patch_sha1) && bxdiff_patch_map(patch, cache_path, patch_sha1);
+		if (!mapped)
+			fprintf(stderr, "%s does not match the patch, decoding it instead.\n", cache_path);
+	}
+	/* All decoded blocks live in one arena, sized from the patch headers */
+	if (!mapped && !patch->streaming && !bxdiff_patch_use_arena(patch, huge_pages) && huge_pages)
+		fprintf(stderr, "Failed to reserve memory for the patch, using malloc.\n");
+	if (!mapped && !bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		exit(1);
+	}
+	if (bxtrace_file && patch->arena) {
+		bxarena_stats_t stats;
+		bxarena_stats(patch->arena, &stats);
+		bxtrace_event("arena", "memory", bxtrace_clock(), "\"capacity\":%llu,\"used\":%llu,\"peak\":%llu,\"allocations\":%llu,\"fallbacks\":%llu,\"huge_pages\":%s",
+			(unsigned long long)stats.capacity, (unsigned long long)stats.used, (unsigned long long)stats.peak,
+			(unsigned long long)stats.allocations, (unsigned long long)stats.fallbacks, stats.huge_pages ? "true" : "false");
+	}
+	
+	/* The digest of the new file is computed while it is produced. An undo
+	 * patch records it as its input hash. With a filter the digest is taken
+	 * while unfiltering instead.
+	 */
+	if ((patch->has_output_hash || undo_path) && !patch->filter && !(output_hash = hash_new(NULL))) {
+		fprintf(stderr, "Memory allocation error.\n");
+		bxdiff_patch_close(patch);
+		exit(1);
+	}
+	
+	/* A checkpoint left by an interrupted run of this patch is picked up */
+	bool resuming = false;
+	if (resume && !strcmp(outfile_path, "-")) {
+		fprintf(stderr, "--resume needs a regular output file, ignoring it.\n");
+		resume = false;
+	} else if (resume) {
+		resuming = resume_load(outfile_path);
+		if (resuming)
+			fprintf(message_file, "Resuming at %llu bytes.\n", (unsigned long long)checkpoint.out_offset);
+	}
+	
+	if (undo_path && !(undo = bxundo_new())) {
+		fprintf(stderr, "Memory allocation error.\n");
+		bxdiff_patch_close(patch);
+		exit(1);
+	}
+	
+	/* The handle that was hashed is the one read from, so the file can not be swapped in between */
+	rewind(in_file);
+	if (patch->filter)
+		in_file = filter_input(in_file, outfile_path);
+	out_fd = open_output(outfile_path, resuming);
+	if (out_fd < 0) {
+		fprintf(stderr, "Failed to open %s.\n", outfile_path);
+		bxdiff_patch_close(patch);
+		fclose(in_file);
+		exit(1);
+	}
+	
+	/* A checkpoint does not carry the digest, the output written before it is hashed again */
+	if (resuming && output_hash) {
+		uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+		if (!hash_update_fd(output_hash, out_fd, checkpoint.out_offset))
+			apply_fail("Failed to read output file.");
+		if (bxtrace_file)
+			bxtrace_event("hash resumed output", "hash", start, "\"length\":%llu", (unsigned long long)checkpoint.out_offset);
+	}
+	
+	/* The asynchronous backend is preferred, stdio is the fallback */
+	if (!apply_uring(fileno(in_file), out_fd))
+		apply_stdio();
+	
+	/* The output was preallocated to the expected size, so there is
+	 * nothing to do unless the patch produced a different amount.
+	 */
+	if (output_length != patched_file_size) {
+		fprintf(message_file, "Expected size: %zu\nActual size:   %llu\n", patched_file_size, (unsigned long long)output_length);
+		ftruncate(out_fd, output_length);
+	}
+	
+	if (patch->filter)
+		unfilter_output();
+	
+	bool output_ok = output_length == patched_file_size;
+	if (output_hash) {
+		unsigned length;
+		bool hashed = hash_final(output_hash, output_sha1, &length);
+		output_hash = NULL;
+		if (!hashed) {
+			fprintf(stderr, "Failed to calculate SHA1 hash of the output file.\n");
+			output_ok = false;
+		} else if (patch->has_output_hash && memcmp(patch->output_sha1, output_sha1, 20)) {
+			fprintf(stderr, "Output file is corrupt (SHA1 hash mismatch).\n");
+			output_ok = false;
 		}
-		if (read(patch_file, diff, header.diff_size) != header.diff_size) {
-			fprintf(stderr, "Failed to read diff block.\n");
-			goto bxdiff50_block_read_error;
+	}
+	
+	if (undo && output_ok)
+		write_undo();
+	else if (undo)
+		fprintf(stderr, "The output does not match the patch, not writing %s.\n", undo_path);
+	bxundo_free(undo);
+	
+	/* Finished, nothing left to resume */
+	if (resume) {
+		unlink(resume_path);
+		free(resume_path);
+	}
+	
+	bxdiff_patch_close(patch);
+	fclose(in_file);
+	close(out_fd);
+	
+	return 0;
+}
+
+/*
+ * Resume support. With --resume the apply stops between operations, or
+ * between steps of a large one, every RESUME_INTERVAL bytes of output, makes the output durable and
+ * records a checkpoint in <newfile>.bxresume. A later run with --resume
+ * continues from that checkpoint instead of starting over. The checkpoint
+ * is tied to the patch through a digest of its header and sizes.
+ */
+
+#define RESUME_INTERVAL (64ULL << 20)
+
+static void resume_identity(uint8_t *id) {
+	uint64_t fields[7] = {
+		patch->version,
+		patch->file_length,
+		patch->patched_file_size,
+		patch->control_size,
+		patch->diff_size,
+		patch->extra_size,
+		in_file_size
+	};
+	uint8_t buf[sizeof(fields) + 40];
+	memcpy(buf, fields, sizeof(fields));
+	memcpy(buf + sizeof(fields), patch->input_sha1, 20);
+	memcpy(buf + sizeof(fields) + 20, patch->output_sha1, 20);
+	SHA1(buf, sizeof(buf), id);
+}
+
+/* Returns true if a usable checkpoint was loaded into the global one */
+static bool resume_load(const char *outfile_path) {
+	size_t length = strlen(outfile_path) + 10;
+	resume_path = malloc(length);
+	if (!resume_path) {
+		resume = false;
+		return false;
+	}
+	snprintf(resume_path, length, "%s.bxresume", outfile_path);
+	
+	bxresume_t loaded;
+	struct stat st;
+	resume_identity(checkpoint.patch_id);
+	next_checkpoint = RESUME_INTERVAL;
+	if (!bxresume_load(resume_path, &loaded))
+		return false;
+	
+	/* Everything has to agree with this patch and the file on disk */
+	uint64_t count = patch->control_length / sizeof(bxdiff_control_t);
+	uint64_t op_length = 0;
+	if (loaded.control_index < count) {
+		const bxdiff_control_t *c = (const bxdiff_control_t *)patch->control + loaded.control_index;
+		op_length = parse_integer(c->mixlen) + parse_integer(c->copylen);
+	}
+	if (memcmp(loaded.patch_id, checkpoint.patch_id, 20) ||
+	    loaded.control_index > count ||
+	    (loaded.op_offset && loaded.op_offset >= op_length) ||
+	    loaded.diff_offset > patch->diff_length ||
+	    loaded.extra_offset > patch->extra_length ||
+	    loaded.in_offset > in_file_size ||
+	    loaded.out_offset > patched_file_size ||
+	    stat(outfile_path, &st) || (uint64_t)st.st_size < loaded.out_offset) {
+		fprintf(message_file, "%s does not match this patch, starting over.\n", resume_path);
+		return false;
+	}
+	
+	checkpoint = loaded;
+	next_checkpoint = checkpoint.out_offset + RESUME_INTERVAL;
+	return true;
+}
+
+/* The output up to out_offset must already be durable */
+static void resume_save(const bxapply_state_t *state) {
+	checkpoint.control_index = state->control_index;
+	checkpoint.diff_offset = state->diff_offset;
+	checkpoint.extra_offset = state->extra_offset;
+	checkpoint.in_offset = state->in_offset;
+	checkpoint.out_offset = state->out_offset;
+	checkpoint.op_offset = state->op_offset;
+	
+	BXPROBE1(checkpoint, state->out_offset);
+	if (!bxresume_save(resume_path, &checkpoint))
+		fprintf(stderr, "Failed to write %s.\n", resume_path);
+	next_checkpoint = state->out_offset + RESUME_INTERVAL;
+}
+
+/*
+ * Returns a filtered copy of the old file. It lives next to the output,
+ * where there is room for a file of that size, and is unlinked right away.
+ */
+static FILE *filter_input(FILE *f, const char *outfile_path) {
+	size_t length = strlen(outfile_path) + 16;
+	char *tmp_path = malloc(length);
+	if (!tmp_path) {
+		fprintf(stderr, "Memory allocation error.\n");
+		exit(1);
+	}
+	snprintf(tmp_path, length, "%s.bxfilterXXXXXX", outfile_path);
+	int fd = mkstemp(tmp_path);
+	if (fd >= 0) unlink(tmp_path);
+	free(tmp_path);
+	
+	FILE *filtered = NULL;
+	if (fd >= 0 && branchfilter_fd(patch->filter, true, fileno(f), fd, NULL))
+		filtered = fdopen(fd, "rb");
+	if (!filtered) {
+		fprintf(stderr, "Failed to filter the input file.\n");
+		if (fd >= 0) close(fd);
+		fclose(f);
+		bxdiff_patch_close(patch);
+		exit(1);
+	}
+	fclose(f);
+	return filtered;
+}
+
+static void unfilter_output(void) {
+	if (patch->has_output_hash && !(output_hash = hash_new(NULL)))
+		apply_fail("Memory allocation error.");
+	if (!branchfilter_fd(patch->filter, false, out_fd, out_fd, output_hash))
+		apply_fail("Failed to unfilter output file.");
+}
+
+/*
+ * Writes the reverse patch collected during the apply. The extra data of
+ * the undo patch is read from the old file, which is still intact.
+ */
+static void write_undo(void) {
+	FILE *f = fopen(undo_path, "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s.\n", undo_path);
+		return;
+	}
+	bool ok = bxundo_write(undo, f, patch->diff, fileno(in_file), in_file_size, output_sha1);
+	if (fclose(f)) ok = false;
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s.\n", undo_path);
+		unlink(undo_path);
+	}
+}
+
+/*
+ * Decodes and validates the patch once and stores the result in a cache
+ * file that later runs can map with -c instead of decompressing.
+ */
+static int prepare(const char *patchfile_path, const char *cachefile_path) {
+	uint8_t patch_sha1[SHA_DIGEST_LENGTH];
+	
+	patch = bxdiff_patch_open(patchfile_path);
+	if (!patch)
+		return 1;
+	if (!bxdiff_patch_sha1(patch, patch_sha1)) {
+		fprintf(stderr, "Failed to calculate SHA1 hash of the patch file.\n");
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	if (!bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	if (!bxdiff_patch_validate(patch)) {
+		fprintf(stderr, "Patch is corrupt.\n");
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	
+	FILE *f = fopen(cachefile_path, "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s.\n", cachefile_path);
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	bool ok = bxdiff_patch_prepare(patch, patch_sha1, f);
+	if (fclose(f)) ok = false;
+	bxdiff_patch_close(patch);
+	
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s.\n", cachefile_path);
+		unlink(cachefile_path);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * The old file, the patch and the new file are opened here, with the
+ * caller's credentials, and only their descriptors go to the daemon.
+ */
+static int apply_remote(const char *infile_path, const char *outfile_path, const char *patchfile_path) {
+	bxdaemon_request_t request;
+	bxdaemon_response_t response;
+	
+	memset(&request, 0, sizeof(request));
+	memcpy(request.magic, BXDAEMON_MAGIC, 8);
+	request.flags = force ? BXDAEMON_FORCE : 0;
+	if (!strcmp(patchfile_path, "-")) {
+		fprintf(stderr, "bxpatchd can not read a patch from stdin.\n");
+		return 1;
+	}
+	
+	int fds[BXDAEMON_FDS] = {-1, -1, -1};
+	const char *paths[BXDAEMON_FDS];
+	paths[BXDAEMON_OLD_FD] = infile_path;
+	paths[BXDAEMON_PATCH_FD] = patchfile_path;
+	paths[BXDAEMON_NEW_FD] = outfile_path;
+	int status = 1;
+	int sock = -1;
+	for (unsigned i = 0; i < BXDAEMON_FDS; i++) {
+		if (i == BXDAEMON_NEW_FD)
+			fds[i] = strcmp(outfile_path, "-") ? open(outfile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : STDOUT_FILENO;
+		else
+			fds[i] = open(paths[i], O_RDONLY);
+		if (fds[i] < 0) {
+			fprintf(stderr, "Failed to open %s.\n", paths[i]);
+			goto done;
 		}
-		if (read(patch_file, extra, header.extra_size) != header.extra_size) {
-			fprintf(stderr, "Failed to read extra block.\n");
-		bxdiff50_block_read_error:
-			free(control);
-			free(diff);
-			if (extra) free(extra);
-			close(patch_file);
-			exit(1);
+	}
+	
+	sock = bxdaemon_connect(daemon_path);
+	if (sock < 0) {
+		fprintf(stderr, "Failed to connect to %s.\n", daemon_path);
+		goto done;
+	}
+	
+	uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+	bool ok = bxdaemon_send(sock, &request, sizeof(request), fds, BXDAEMON_FDS) &&
+	          bxdaemon_recv(sock, &response, sizeof(response), NULL, 0) &&
+	          !memcmp(response.magic, BXDAEMON_MAGIC, 8);
+	if (!ok) {
+		fprintf(stderr, "bxpatchd did not answer.\n");
+		goto done;
+	}
+	if (bxtrace_file)
+		bxtrace_event("daemon apply", "apply", start, "\"length\":%llu,\"base_cached\":%s,\"patch_cached\":%s",
+			(unsigned long long)response.output_length, response.flags & BXDAEMON_BASE_CACHED ? "true" : "false",
+			response.flags & BXDAEMON_PATCH_CACHED ? "true" : "false");
+	
+	response.message[sizeof(response.message) - 1] = 0;
+	if (response.message[0])
+		fprintf(response.status ? stderr : message_file, "%s\n", response.message);
+	status = response.status ? 1 : 0;
+	
+done:
+	if (sock >= 0)
+		close(sock);
+	for (unsigned i = 0; i < BXDAEMON_FDS; i++)
+		if (fds[i] >= 0 && fds[i] != STDOUT_FILENO)
+			close(fds[i]);
+	return status;
+}
+
+/*
+ * Fan-out: one old file, many patches. The old file is mapped and hashed
+ * once, then the patches are decoded and applied on up to -j threads (all
+ * cores by default) that share the mapping, so each page of the old file
+ * is read from storage once however many patches use it.
+ */
+typedef struct {
+	const char *outfile_path;
+	const char *patchfile_path;
+	bxdiff_patch_t *patch;
+	const char *error;
+	bool ok;
+} fan_out_job_t;
+
+typedef struct {
+	const uint8_t *old;
+	size_t old_size;
+	fan_out_job_t *jobs;
+	size_t count;
+	size_t next;
+	pthread_mutex_t lock;
+} fan_out_batch_t;
+
+static void fan_out_apply(const fan_out_batch_t *batch, fan_out_job_t *job) {
+	bxdiff_patch_t *p = job->patch;
+	uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+	uint64_t length = 0;
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+	
+	bxdiff_patch_use_arena(p, huge_pages);
+	if (!bxdiff_patch_decode(p)) {
+		job->error = "Failed to decode the patch.";
+	} else if (!bxdiff_patch_validate(p)) {
+		job->error = "Patch is corrupt.";
+	} else {
+		int fd = open(job->outfile_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			job->error = "Failed to open the new file.";
+		} else {
+			bool ok = bxapply_buffer(batch->old, batch->old_size, p, fd, &length, sha1, &job->error);
+			if (close(fd) && ok) {
+				job->error = "Failed to write the new file.";
+				ok = false;
+			}
+			if (ok && length != p->patched_file_size)
+				job->error = "The new file does not have the expected size.";
+			else if (ok && p->has_output_hash && memcmp(p->output_sha1, sha1, SHA_DIGEST_LENGTH))
+				job->error = "Output file is corrupt (SHA1 hash mismatch).";
+			else
+				job->ok = ok;
 		}
-		
-		close(patch_file);
-		
-		void *buf;
-		bool empty = false;
-		
-		control_length = 0;
-		buf = pbzx_buffer_decompress(control, header.control_size, &control_length, &empty);
-		free(control);
-		if (!buf) {
-			if (!empty) fprintf(stderr, "Failed to extract control block.\n");
-			else fprintf(stderr, "Patch is corrupt (empty control block).\n");
-			free(diff);
-			if (extra) free(extra);
-			exit(1);
+	}
+	
+	/* The decoded blocks are dropped as soon as the job is done */
+	bxdiff_patch_close(p);
+	job->patch = NULL;
+	if (bxtrace_file)
+		bxtrace_event("fan-out apply", "apply", start, "\"job\":%zu,\"length\":%llu,\"ok\":%s",
+			(size_t)(job - batch->jobs), (unsigned long long)length, job->ok ? "true" : "false");
+}
+
+static void *fan_out_worker(void *arg) {
+	fan_out_batch_t *batch = arg;
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->count) break;
+		fan_out_apply(batch, &batch->jobs[i]);
+	}
+	return NULL;
+}
+
+static int fan_out(const char *infile_path, size_t count, const char **paths) {
+	fan_out_batch_t batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.count = count;
+	batch.jobs = calloc(count, sizeof(fan_out_job_t));
+	if (!batch.jobs || pthread_mutex_init(&batch.lock, NULL)) {
+		fprintf(stderr, "Memory allocation error.\n");
+		exit(1);
+	}
+	
+	/* Every header is checked before anything is written */
+	int status = 1, fd = -1;
+	bool hashed = false;
+	for (size_t i = 0; i < count; i++) {
+		fan_out_job_t *job = &batch.jobs[i];
+		job->outfile_path = paths[2 * i];
+		job->patchfile_path = paths[2 * i + 1];
+		if (!strcmp(job->outfile_path, "-") || !strcmp(job->patchfile_path, "-")) {
+			fprintf(stderr, "--fan-out can not use stdin or stdout.\n");
+			goto done;
 		}
-		control = buf;
-		
-		diff_length = 0;
-		buf = pbzx_buffer_decompress(diff, (uint32_t)header.diff_size, &diff_length, &empty);
-		free(diff);
-		if (!buf) {
-			if (!empty) fprintf(stderr, "Failed to extract diff block.\n");
-			else fprintf(stderr, "Patch is corrupt (empty diff block).");
-			free(control);
-			if (extra) free(extra);
-			exit(1);
+		if (!(job->patch = bxdiff_patch_open(job->patchfile_path)))
+			goto done;
+		if (job->patch->filter) {
+			fprintf(stderr, "--fan-out does not support filtered patches (%s).\n", job->patchfile_path);
+			goto done;
 		}
-		diff = buf;
-		
-		if (extra) {
-			buf = pbzx_buffer_decompress(extra, header.extra_size, &extra_length, &empty);
-			free(extra);
-			if (!(buf || empty)) {
-				fprintf(stderr, "Failed to extract extra block.\n");
-				free(control);
-				free(diff);
-				exit(1);
-			}
-			extra = buf;
+		hashed |= job->patch->has_input_hash;
+	}
+	
+	fd = open(infile_path, O_RDONLY);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st)) {
+		fprintf(stderr, "Failed to open %s.\n", infile_path);
+		goto done;
+	}
+	batch.old_size = st.st_size;
+	if (batch.old_size) {
+		void *mapping = mmap(NULL, batch.old_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (mapping == MAP_FAILED) {
+			fprintf(stderr, "Failed to map %s.\n", infile_path);
+			goto done;
 		}
+		madvise(mapping, batch.old_size, MADV_WILLNEED);
+		batch.old = mapping;
 	}
 	
-	in_file = fopen(infile_path, "rb");
-	out_file = fopen(outfile_path, "w+");
-	ftruncate(fileno(out_file), 0);
-	
-	bxdiff_control_t *c = control;
-	uint8_t *d = diff, *e = extra;
-	uint64_t mixlen, copylen;
-	int64_t seeklen;
-	
-	while (((void *)c - control) < control_length) {
-		copylen = parse_integer(c->copylen);
-		mixlen = parse_integer(c->mixlen);
-		seeklen = parse_integer(c->seeklen);
-		
-		/* Read mixlen bytes from diff block and from the input file,
-		 * add them modulo 256 and write that to the output file
-		 */
-		if (mixlen) {
-			uint8_t *diff_block = malloc(mixlen);
-			if (fread(diff_block, 1, mixlen, in_file) != mixlen) {
-				fprintf(stderr, "Input file is truncated.\n");
-				free(control);
-				free(diff);
-				if (extra) free(extra);
-				fclose(in_file);
-				fclose(out_file);
-				exit(1);
-			}
-			for (uint64_t i = 0; i < mixlen; i++) {
-				diff_block[i] = *d + diff_block[i];
-				d++;
+	if (hashed) {
+		hashcache_key_t key;
+		bool keyed = hash_cache_path && hashcache_key(fd, &key);
+		if (!keyed || !hashcache_lookup(hash_cache_path, &key, input_sha1)) {
+			uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+			unsigned length;
+			if (!hash_buffer(batch.old, batch.old_size, NULL, input_sha1, &length)) {
+				fprintf(stderr, "Failed to calculate SHA1 hash of the input file.\n");
+				goto done;
 			}
-			fwrite(diff_block, 1, mixlen, out_file);
-			free(diff_block);
+			if (bxtrace_file)
+				bxtrace_event("hash input", "hash", start, "\"length\":%zu", batch.old_size);
+			hashcache_key_t key_after;
+			if (keyed && hashcache_key(fd, &key_after) && !memcmp(&key, &key_after, sizeof(key)))
+				hashcache_store(hash_cache_path, &key, input_sha1);
 		}
-		
-		/* Copy copylen bytes from extra block to the output file */
-		if (copylen) {
-			if (!extra) {
-				fprintf(stderr, "Patch is corrupt.\n");
-				free(control);
-				free(diff);
-				if (extra) free(extra);
-				fclose(in_file);
-				fclose(out_file);
-				exit(1);
-			}
-			fwrite(e, 1, copylen, out_file);
-			e += copylen;
+	}
+	for (size_t i = 0; i < count; i++) {
+		const bxdiff_patch_t *p = batch.jobs[i].patch;
+		if (!p->has_input_hash || !memcmp(p->input_sha1, input_sha1, SHA_DIGEST_LENGTH))
+			continue;
+		if (!force) {
+			fprintf(stderr, "%s shall not be applied to the provided file (wrong SHA1 hash).\nUse -f to apply it anyway.\n", batch.jobs[i].patchfile_path);
+			goto done;
 		}
-		
-		/* Advance the read pointer by seeklen bytes */
-		if (seeklen)
-			fseeko(in_file, seeklen, SEEK_CUR);
-		
-		/* Advance control block read pointer */
-		c++;
+		printf("%s: SHA1 hash mismatch. Forcing patch anyway.\n", batch.jobs[i].patchfile_path);
 	}
 	
-	free(control);
-	free(diff);
-	if (extra) free(extra);
-	
-	size_t expected_size = patched_file_size;
-	size_t actual_size = ftello(out_file);
-	if (expected_size != actual_size)
-		printf("Expected size: %zu\nActual size:   %zu\n", expected_size, actual_size);
+	if (!threads)
+		threads = (unsigned)sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads < 1) threads = 1;
+	if (threads > count) threads = (unsigned)count;
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		fprintf(stderr, "Memory allocation error.\n");
+		goto done;
+	}
 	
-	if (has_output_hash) {
-		if (!SHA1_File(out_file, output_sha1)) {
-			fprintf(stderr, "Failed to calculate SHA1 hash of the input file.\n");
-		} else if (memcmp(target_output_sha1, output_sha1, 20)) {
-			fprintf(stderr, "Output file is corrupt (SHA1 hash mismatch).\n");
-		}
+	/* The calling thread is one of the workers */
+	unsigned started = 1;
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, fan_out_worker, &batch))
+			break;
 	}
+	fan_out_worker(&batch);
+	for (unsigned i = 1; i < started; i++)
+		pthread_join(workers[i], NULL);
+	free(workers);
 	
-	fclose(in_file);
-	fclose(out_file);
+	status = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (batch.jobs[i].ok) continue;
+		fprintf(stderr, "%s: %s\n", batch.jobs[i].outfile_path, batch.jobs[i].error);
+		status = 1;
+	}
 	
-	return 0;
+done:
+	for (size_t i = 0; i < count; i++)
+		bxdiff_patch_close(batch.jobs[i].patch);
+	if (batch.old)
+		munmap((void *)batch.old, batch.old_size);
+	if (fd >= 0)
+		close(fd);
+	pthread_mutex_destroy(&batch.lock);
+	free(batch.jobs);
+	return status;
 }
 
 #ifdef DEBUG
@@ -507,234 +872,681 @@ static void __attribute__((unused)) print_hex(const void *data, size_t length) {
 
 #endif
 
-static int SHA1_File(FILE *f, uint8_t *dst) {
-	int ret = false;
-	if (f && dst) {
-		size_t bytes_read = 0;
-		off_t pos = ftello(f);
-		fseek(f, 0, SEEK_END);
-		size_t length = ftello(f);
-		fseek(f, 0, SEEK_SET);
-		
-		SHA_CTX ctx;
-		if (SHA1_Init(&ctx)) {
-			void *buf = malloc(512);
-			memset(buf, 0, 512);
-			size_t bytes_available;
-			
-			while (bytes_read < length) {
-				if ((bytes_available = fread(buf, 1, 512, f)) <= 0) {
-					fseeko(f, pos, SEEK_SET);
-					return false;
-				}
-				SHA1_Update(&ctx, buf, bytes_available);
-				bytes_read += bytes_available;
-			}
-			
-			SHA1_Final(dst, &ctx);
-			ret = true;
+/*
+ * Output file handling. The output is preallocated to the size recorded in
+ * the header and written in large extents: mixed bytes are produced right
+ * inside an aligned staging buffer, big extra runs are referenced in place
+ * and everything is handed to writev() at once. With -d the file is opened
+ * with O_DIRECT (F_NOCACHE on Darwin) so partition images do not go through
+ * the page cache; in that mode every byte is staged to keep writes aligned.
+ */
+
+#define OUTPUT_EXTENT (4 << 20)
+#define OUTPUT_ALIGN 4096
+#define OUTPUT_IOV 64
+#define OUTPUT_INLINE_LIMIT (64 << 10)
+
+static uint8_t *out_stage;
+static size_t out_staged;
+static struct iovec out_iov[OUTPUT_IOV];
+static int out_iovcnt;
+static size_t out_pending;
+
+static int open_output(const char *path, bool resuming) {
+	output_length = 0;
+	
+	/* stdout is written as a stream, nothing to preallocate */
+	if (!strcmp(path, "-")) {
+		direct_output = false;
+		return STDOUT_FILENO;
+	}
+	
+	/* A resumed output keeps what the earlier run wrote */
+	int flags = O_RDWR | O_CREAT | (resuming ? 0 : O_TRUNC);
+#ifdef O_DIRECT
+	if (direct_output) flags |= O_DIRECT;
+#endif
+	int fd = open(path, flags, 0644);
+#ifdef O_DIRECT
+	if (fd < 0 && direct_output && errno == EINVAL) {
+		fprintf(stderr, "Direct I/O is not supported for %s, using buffered writes.\n", path);
+		direct_output = false;
+		fd = open(path, flags & ~O_DIRECT, 0644);
+	}
+#endif
+	if (fd < 0) return -1;
+#ifdef F_NOCACHE
+	if (direct_output) fcntl(fd, F_NOCACHE, 1);
+#endif
+	
+	/* Best effort, block devices and some file systems refuse it */
+	if (patched_file_size) {
+#if defined(__linux__)
+		fallocate(fd, 0, 0, patched_file_size);
+#elif defined(F_PREALLOCATE)
+		fstore_t store = {F_ALLOCATECONTIG, F_PEOFPOSMODE, 0, patched_file_size, 0};
+		if (fcntl(fd, F_PREALLOCATE, &store) == -1) {
+			store.fst_flags = F_ALLOCATEALL;
+			fcntl(fd, F_PREALLOCATE, &store);
 		}
-		
-		fseeko(f, pos, SEEK_SET);
+#endif
 	}
 	
-	return ret;
+	return fd;
+}
+
+/* Turns O_DIRECT off again, needed for unaligned tails */
+static void output_buffered(void) {
+#ifdef O_DIRECT
+	if (direct_output)
+		fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) & ~O_DIRECT);
+#endif
+}
+
+static void output_direct(void) {
+#ifdef O_DIRECT
+	if (direct_output)
+		fcntl(out_fd, F_SETFL, fcntl(out_fd, F_GETFL) | O_DIRECT);
+#endif
+}
+
+/*
+ * Direct writes have to start at an aligned offset, so a resumed run
+ * reads back the partial block in front of start into dst and rewrites
+ * it. Returns the number of bytes placed in dst.
+ */
+static size_t output_read_prefix(uint8_t *dst, uint64_t start) {
+	size_t prefix = direct_output ? start % OUTPUT_ALIGN : 0;
+	if (prefix && pread(out_fd, dst, OUTPUT_ALIGN, start - prefix) < (ssize_t)prefix)
+		apply_fail("Failed to read output file.");
+	return prefix;
+}
+
+static bool output_open(uint64_t start) {
+	if (posix_memalign((void **)&out_stage, OUTPUT_ALIGN, OUTPUT_EXTENT))
+		return false;
+	out_staged = 0;
+	out_iovcnt = 0;
+	out_pending = 0;
+	
+	/* The bytes before start are already part of the digest */
+	if (start) {
+		size_t prefix = output_read_prefix(out_stage, start);
+		output_length = start - prefix;
+		if (lseek(out_fd, output_length, SEEK_SET) < 0)
+			apply_fail("Failed to seek output file.");
+		if (prefix) {
+			out_iov[0].iov_base = out_stage;
+			out_iov[0].iov_len = prefix;
+			out_iovcnt = 1;
+			out_staged = prefix;
+			out_pending = prefix;
+		}
+	}
+	return true;
 }
 
-static uint64_t parse_integer(uint64_t integer)
-{
-	uint8_t *buf = (u_char *)&integer;
-	uint64_t y;
+static void output_flush(bool final) {
+	struct iovec *iov = out_iov;
+	int iovcnt = out_iovcnt;
+	size_t length = out_pending;
+	size_t tail = 0;
 	
-	y = buf[7] & 0x7F;
-	y <<= 8;
-	y += buf[6];
-	y <<= 8;
-	y += buf[5];
-	y <<= 8;
-	y += buf[4];
-	y <<= 8;
-	y += buf[3];
-	y <<= 8;
-	y += buf[2];
-	y <<= 8;
-	y += buf[1];
-	y <<= 8;
-	y += buf[0];
+	/* Direct writes must be aligned, keep the unaligned remainder staged */
+	if (direct_output && !final) {
+		tail = length % OUTPUT_ALIGN;
+		length -= tail;
+		iov[0].iov_len = length;
+	}
 	
-	if (buf[7] & 0x80) y = -y;
+	while (length) {
+		ssize_t written = writev(out_fd, iov, iovcnt);
+		if (written <= 0)
+			apply_fail("Failed to write output file.");
+		output_length += written;
+		length -= written;
+		while (iovcnt && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt) {
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
 	
-	return y;
+	if (tail) memmove(out_stage, out_stage + out_pending - tail, tail);
+	out_staged = tail;
+	out_pending = tail;
+	out_iovcnt = 0;
+	if (tail) {
+		out_iov[0].iov_base = out_stage;
+		out_iov[0].iov_len = tail;
+		out_iovcnt = 1;
+	}
+}
+
+/* Returns room for up to *length bytes at the end of the staging buffer */
+static uint8_t *output_reserve(size_t *length) {
+	if (out_staged == OUTPUT_EXTENT || out_iovcnt == OUTPUT_IOV)
+		output_flush(false);
+	if (*length > OUTPUT_EXTENT - out_staged)
+		*length = OUTPUT_EXTENT - out_staged;
+	return out_stage + out_staged;
+}
+
+static void output_commit(size_t length) {
+	if (output_hash)
+		output_hash_update(out_stage + out_staged, length);
+	
+	struct iovec *last = out_iovcnt ? &out_iov[out_iovcnt - 1] : NULL;
+	if (last && (uint8_t *)last->iov_base + last->iov_len == out_stage + out_staged) {
+		last->iov_len += length;
+	} else {
+		out_iov[out_iovcnt].iov_base = out_stage + out_staged;
+		out_iov[out_iovcnt].iov_len = length;
+		out_iovcnt++;
+	}
+	out_staged += length;
+	out_pending += length;
+	if (out_pending >= OUTPUT_EXTENT)
+		output_flush(false);
+}
+
+static void output_write(const void *buf, size_t length) {
+	if (direct_output || length < OUTPUT_INLINE_LIMIT) {
+		while (length) {
+			size_t n = length;
+			uint8_t *p = output_reserve(&n);
+			memcpy(p, buf, n);
+			output_commit(n);
+			buf = (const uint8_t *)buf + n;
+			length -= n;
+		}
+	} else {
+		if (output_hash)
+			output_hash_update(buf, length);
+		if (out_iovcnt == OUTPUT_IOV)
+			output_flush(false);
+		out_iov[out_iovcnt].iov_base = (void *)buf;
+		out_iov[out_iovcnt].iov_len = length;
+		out_iovcnt++;
+		out_pending += length;
+		if (out_pending >= OUTPUT_EXTENT)
+			output_flush(false);
+	}
+}
+
+/* Feeds produced bytes to the output digest */
+static void output_hash_update(const void *buf, size_t length) {
+	uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+	BXPROBE1(hash__update, length);
+	EVP_DigestUpdate(output_hash, buf, length);
+	if (bxtrace_file)
+		bxtrace_event("hash", "hash", start, "\"length\":%zu", length);
+}
+
+/* Makes everything produced so far durable, including a staged direct tail */
+static void output_sync(void) {
+	output_flush(false);
+	if (out_pending) {
+		output_buffered();
+		if (pwrite(out_fd, out_stage, out_pending, output_length) != (ssize_t)out_pending)
+			apply_fail("Failed to write output file.");
+		output_direct();
+	}
+	if (fsync(out_fd))
+		apply_fail("Failed to write output file.");
+}
+
+static void output_close(void) {
+	if (direct_output && out_pending % OUTPUT_ALIGN) {
+		output_flush(false);
+		output_buffered();
+	}
+	output_flush(true);
+	output_buffered();
+	free(out_stage);
+	out_stage = NULL;
+}
+
+static void __attribute__((noreturn)) apply_fail(const char *message) {
+	fprintf(stderr, "%s\n", message);
+	uring_close(ring);
+	bxdiff_patch_close(patch);
+	fclose(in_file);
+	if (out_fd != STDOUT_FILENO) close(out_fd);
+	exit(1);
+}
+
+/* Records a finished control op; time spent waiting for I/O is part of it */
+static void trace_op(const bxdiff_control_t *c, uint64_t start) {
+	bxtrace_event("op", "apply", start, "\"index\":%llu,\"mix\":%llu,\"copy\":%llu,\"seek\":%lld",
+		(unsigned long long)(c - (bxdiff_control_t *)patch->control), (unsigned long long)parse_integer(c->mixlen),
+		(unsigned long long)parse_integer(c->copylen), (long long)parse_integer(c->seeklen));
 }
 
 /*
- * dsize is a pointer to a place where the size of decompressed file will be written.
- * Contains code from XZ tools.
+ * Both apply backends run the control block through bxapply_run. These
+ * hooks are common to them: probes, the undo patch and the trace.
  */
 
-static void *lzma_easy_buffer_decompress(void *compressed_data, size_t size, size_t *dsize)
-{
-	lzma_stream strm = LZMA_STREAM_INIT; /* alloc and init lzma_stream struct */
-	const uint32_t flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
-	const uint64_t memory_limit = UINT64_MAX; /* no memory limit */
-	uint8_t out_buf[1024];
-	size_t out_len;	/* length of useful data in out_buf */
-	void *res = NULL;
-	lzma_action action;
-	lzma_ret ret_xz;
-	*dsize = 0;
-	
-	/* initialize xz decoder */
-	ret_xz = lzma_stream_decoder(&strm, memory_limit, flags);
-	if (ret_xz != LZMA_OK) {
-		fprintf(stderr, "lzma_stream_decoder error: %d\n", (int) ret_xz);
-		return NULL;
-	}
-	
-	strm.next_in = compressed_data;
-	strm.avail_in = size;
-	
-	/* if no more data from in_buf, flushes the
-	 internal xz buffers and closes the decompressed data
-	 with LZMA_FINISH */
-	action = LZMA_FINISH;
-	
-	/* loop until there's no pending decompressed output */
-	do {
-		/* out_buf is clean at this point */
-		strm.next_out = out_buf;
-		strm.avail_out = 1024;
-		
-		/* decompress data */
-		ret_xz = lzma_code(&strm, action);
-		
-		if ((ret_xz != LZMA_OK) && (ret_xz != LZMA_STREAM_END)) {
-			fprintf(stderr, "lzma_code error: %d\n", (int)ret_xz);
-			lzma_end(&strm);
-			if (res) free(res);
-			return NULL;
-		} else {
-			/* write decompressed data */
-			out_len = 1024 - strm.avail_out;
-			*dsize += out_len;
-			if (!res) res = malloc(out_len);
-			else res = realloc(res, *dsize);
-			memcpy(res + *dsize - out_len, out_buf, out_len);
-		}
-	} while (strm.avail_out == 0);
+static uint64_t op_start;
+
+/* Starts at the loaded checkpoint, or at the beginning */
+static bxapply_state_t apply_start(void) {
+	bxapply_state_t state = {
+		checkpoint.control_index,
+		checkpoint.diff_offset,
+		checkpoint.extra_offset,
+		checkpoint.in_offset,
+		checkpoint.out_offset,
+		checkpoint.op_offset
+	};
+	/* A checkpoint inside an op skips apply_begin */
+	op_start = bxtrace_file ? bxtrace_clock() : 0;
+	return state;
+}
+
+static const char *apply_begin(void *ctx, const bxapply_state_t *state, const bxdiff_control_t *c) {
+	uint64_t mixlen = parse_integer(c->mixlen);
+	(void)ctx;
+	op_start = bxtrace_file ? bxtrace_clock() : 0;
+	BXPROBE4(op, state->control_index, mixlen, parse_integer(c->copylen), parse_integer(c->seeklen));
 	
-	lzma_end(&strm);
-	return res;
+	if (undo && !bxundo_add_mix(undo, state->in_offset, state->out_offset, state->diff_offset, mixlen))
+		return "Memory allocation error.";
+	return NULL;
+}
+
+static void apply_end(const bxdiff_control_t *c) {
+	int64_t seeklen = parse_integer(c->seeklen);
+	if (seeklen)
+		BXPROBE1(seek, seeklen);
+	if (bxtrace_file)
+		trace_op(c, op_start);
+}
+
+/* Reads the old bytes straight into the output extent and adds the diff bytes modulo 256 there */
+static const char *stdio_mix(void *ctx, const bxapply_state_t *state, const uint8_t *d, uint64_t mixlen) {
+	(void)ctx;
+	/* Only an op that seeked moves the read position */
+	if ((uint64_t)ftello(in_file) != state->in_offset && fseeko(in_file, (off_t)state->in_offset, SEEK_SET))
+		return "Input file is truncated.";
+	
+	while (mixlen) {
+		size_t length = mixlen;
+		uint8_t *p = output_reserve(&length);
+		if (fread(p, 1, length, in_file) != length)
+			return "Input file is truncated.";
+		for (size_t i = 0; i < length; i++)
+			p[i] += d[i];
+		output_commit(length);
+		d += length;
+		mixlen -= length;
+	}
+	return NULL;
+}
+
+static const char *stdio_copy(void *ctx, const bxapply_state_t *state, const uint8_t *e, uint64_t copylen) {
+	(void)ctx;
+	(void)state;
+	output_write(e, copylen);
+	return NULL;
+}
+
+/* Checkpoints are taken between ops and between the steps of a large op */
+static const char *stdio_step(void *ctx, const bxapply_state_t *state) {
+	(void)ctx;
+	if (resume && state->out_offset >= next_checkpoint) {
+		output_sync();
+		resume_save(state);
+	}
+	return NULL;
+}
+
+static const char *stdio_end(void *ctx, const bxapply_state_t *state, const bxdiff_control_t *c) {
+	apply_end(c);
+	return stdio_step(ctx, state);
+}
+
+static void apply_stdio(void) {
+	static const bxapply_ops_t ops = {apply_begin, stdio_mix, stdio_copy, stdio_end, stdio_step};
+	bxapply_state_t state = apply_start();
+	
+	if (!output_open(state.out_offset))
+		apply_fail("Memory allocation error.");
+	const char *error = bxapply_run(patch, &state, UINT64_MAX, &ops, NULL);
+	if (error)
+		apply_fail(error);
+	output_close();
 }
 
 /*
- * That code definitely needs to be fixed.
+ * io_uring apply backend. The whole control block is known up front, so
+ * reads of the input file for upcoming mix ops are kept in flight while
+ * earlier ones are mixed. Output is staged in large slots that are written
+ * out in one request each, at offsets known in advance.
  */
-static void *pbzx_buffer_decompress(void *compressed_data, size_t size, size_t *dsize, bool *empty) {
-	if (size == 12) *empty = 1;//todo fix
-	if (size > 20) {
-		if (memcmp(compressed_data, "pbzx", 4)) return NULL;
-		compressed_data += 4;
-		size -= 4;
-		uint64_t __attribute((unused)) flags = bswapBigToHost64(*(uint64_t *)compressed_data);
-		compressed_data += 8;
-		size -= 8;
-		uint64_t uncompressed_size = bswapBigToHost64(*(uint64_t *)compressed_data);
-		compressed_data += 8;
-		size -= 8;
-		if (!uncompressed_size) {
-			if (empty) *empty = true;
-			*dsize = 0;
-			return NULL;
+
+#define URING_ENTRIES 256
+#define URING_SLOTS 8
+#define URING_SLOT_SIZE (1 << 20)
+#define URING_WRITE_TAG (1ULL << 63)
+
+typedef struct {
+	uint8_t *buf;
+	uint64_t out_offset;
+	uint32_t length;
+	uint32_t written;
+	uint32_t hashed;
+	unsigned pending;
+	bool sealed;
+	bool done;
+	bool busy;
+} uring_slot_t;
+
+typedef struct {
+	unsigned slot;
+	uint32_t pos;
+	uint32_t length;
+	uint64_t in_offset;
+	const uint8_t *diff;
+} uring_read_t;
+
+static int ring_in_fd, ring_out_fd;
+static uring_slot_t ring_slots[URING_SLOTS];
+static uring_read_t ring_reads[URING_ENTRIES];
+static unsigned ring_free_reads[URING_ENTRIES];
+static unsigned ring_free_read_count;
+static unsigned ring_retire_next;
+
+static void uring_queue_read(unsigned index) {
+	uring_read_t *r = &ring_reads[index];
+	uint8_t *dst = ring_slots[r->slot].buf + r->pos;
+	while (!uring_read(ring, ring_in_fd, dst, r->length, r->in_offset, index)) {
+		if (uring_submit(ring, 0) < 0)
+			apply_fail("io_uring submission failed.");
+	}
+}
+
+static void uring_queue_write(unsigned slot) {
+	uring_slot_t *s = &ring_slots[slot];
+	while (!uring_write(ring, ring_out_fd, s->buf + s->written, s->length - s->written, s->out_offset + s->written, URING_WRITE_TAG | slot)) {
+		if (uring_submit(ring, 0) < 0)
+			apply_fail("io_uring submission failed.");
+	}
+}
+
+/*
+ * A short direct write can leave the rest of the slot at an unaligned
+ * offset, where another direct write fails. It goes out through the page
+ * cache instead.
+ */
+static void uring_write_rest(unsigned slot) {
+	uring_slot_t *s = &ring_slots[slot];
+	output_buffered();
+	while (s->written < s->length) {
+		ssize_t n = pwrite(ring_out_fd, s->buf + s->written, s->length - s->written, s->out_offset + s->written);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) apply_fail("Failed to write output file.");
+		s->written += n;
+	}
+	output_direct();
+}
+
+/* Slots are released in output order so the output digest sees the bytes in sequence */
+static void uring_retire(unsigned slot) {
+	ring_slots[slot].done = true;
+	while (ring_slots[ring_retire_next].done) {
+		uring_slot_t *s = &ring_slots[ring_retire_next];
+		if (output_hash && s->length > s->hashed)
+			output_hash_update(s->buf + s->hashed, s->length - s->hashed);
+		s->done = false;
+		s->busy = false;
+		ring_retire_next = (ring_retire_next + 1) % URING_SLOTS;
+	}
+}
+
+/* Submits queued requests, waits for at least one completion and handles all available ones */
+static void uring_wait(void) {
+	uint64_t tag;
+	int32_t res;
+	
+	uint64_t start = bxtrace_file ? bxtrace_clock() : 0;
+	BXPROBE0(wait__start);
+	if (uring_submit(ring, 1) < 0)
+		apply_fail("io_uring submission failed.");
+	BXPROBE0(wait__end);
+	if (bxtrace_file)
+		bxtrace_event("wait", "io", start, NULL);
+	
+	while (uring_complete(ring, &tag, &res)) {
+		if (tag & URING_WRITE_TAG) {
+			uring_slot_t *s = &ring_slots[tag & ~URING_WRITE_TAG];
+			if (res <= 0)
+				apply_fail("Failed to write output file.");
+			s->written += res;
+			if (s->written < s->length && direct_output && (s->out_offset + s->written) % OUTPUT_ALIGN)
+				uring_write_rest(tag & ~URING_WRITE_TAG);
+			if (s->written < s->length) uring_queue_write(tag & ~URING_WRITE_TAG);
+			else uring_retire(tag & ~URING_WRITE_TAG);
 		} else {
-			if (empty) *empty = false;
-		}
-		
-		void *buf = malloc(uncompressed_size);
-		if (buf) {
-			lzma_stream strm = LZMA_STREAM_INIT; /* alloc and init lzma_stream struct */
-			const uint32_t lzma_flags = LZMA_TELL_UNSUPPORTED_CHECK | LZMA_CONCATENATED;
-			const uint64_t memory_limit = UINT64_MAX; /* no memory limit */
-			lzma_action action = LZMA_RUN;
-			lzma_ret ret_xz;
-			*dsize = uncompressed_size;
+			uring_read_t *r = &ring_reads[tag];
+			uring_slot_t *s = &ring_slots[r->slot];
+			if (res < 0)
+				apply_fail("Failed to read input file.");
+			else if (res == 0)
+				apply_fail("Input file is truncated.");
 			
-			/* initialize xz decoder */
-			ret_xz = lzma_stream_decoder(&strm, memory_limit, lzma_flags);
-			if (ret_xz != LZMA_OK) {
-				fprintf(stderr, "lzma_stream_decoder error: %d\n", (int) ret_xz);
-				return NULL;
-			}
+			/* Add the diff bytes modulo 256 to whatever has arrived */
+			uint8_t *p = s->buf + r->pos;
+			for (int32_t i = 0; i < res; i++)
+				p[i] += r->diff[i];
 			
-			void *p = buf;
-			uint64_t chunk_length;
-			bool first_chunk = true;
-			while (size) {
-				if (size < 8 + !first_chunk * 8) {
-					fprintf(stderr, "Patch is truncated.\n");
-					free(buf);
-					lzma_end(&strm);
-					return NULL;
-				}
-				
-				//read flags if needed
-				if (!first_chunk) {
-					flags = bswapBigToHost64(*(uint64_t *)compressed_data);
-					compressed_data += 8;
-					size -= 8;
-				} else {
-					first_chunk = false;
-				}
-				
-				chunk_length = bswapBigToHost64(*(uint64_t *)compressed_data);
-				compressed_data += 8;
-				size -= 8;
-				if (size < chunk_length) {
-					fprintf(stderr, "Patch is truncated.\n");
-					free(buf);
-					lzma_end(&strm);
-					return NULL;
-				}
-				
-				//detect raw data
-				if (memcmp(compressed_data, "\xFD""7zXZ\0\0", 8)) {
-					memcpy(p, compressed_data, chunk_length);
-					p += chunk_length;
-					uncompressed_size -= chunk_length;
-					compressed_data += chunk_length;
-					size -= chunk_length;
-					continue;
-				}
-				
-				//finish on end
-				if (size == chunk_length) {
-					action = LZMA_FINISH;
-				}
-				
-				strm.next_in = compressed_data;
-				strm.avail_in = chunk_length;
-				strm.next_out = p;
-				strm.avail_out = uncompressed_size;
-				
-				ret_xz = lzma_code(&strm, action);
-				
-				if ((ret_xz != LZMA_OK) && (ret_xz != LZMA_STREAM_END)) {
-					fprintf(stderr, "lzma_code error: %d\n", (int)ret_xz);
-					lzma_end(&strm);
-					free(buf);
-					return NULL;
-				} else {
-					size_t out_len = uncompressed_size - strm.avail_out;
-					p += out_len;
-					uncompressed_size = strm.avail_out;
-					compressed_data += chunk_length;
-					size -= chunk_length;
-				}
-			};
+			if ((uint32_t)res < r->length) {
+				r->pos += res;
+				r->length -= res;
+				r->in_offset += res;
+				r->diff += res;
+				uring_queue_read((unsigned)tag);
+				continue;
+			}
 			
-			lzma_end(&strm);
-			return buf;
+			ring_free_reads[ring_free_read_count++] = (unsigned)tag;
+			if (--s->pending == 0 && s->sealed)
+				uring_queue_write(r->slot);
 		}
 	}
+}
+
+static void uring_seal(unsigned slot) {
+	uring_slot_t *s = &ring_slots[slot];
+	s->sealed = true;
+	if (!s->pending) {
+		if (s->length) uring_queue_write(slot);
+		else uring_retire(slot);
+	}
+}
+
+static unsigned uring_open_slot(unsigned slot, uint64_t out_offset) {
+	while (ring_slots[slot].busy)
+		uring_wait();
+	
+	uring_slot_t *s = &ring_slots[slot];
+	s->out_offset = out_offset;
+	s->length = 0;
+	s->written = 0;
+	s->hashed = 0;
+	s->pending = 0;
+	s->sealed = false;
+	s->busy = true;
+	return slot;
+}
+
+static unsigned uring_next_slot(unsigned slot, uint64_t out_offset) {
+	uring_seal(slot);
+	return uring_open_slot((slot + 1) % URING_SLOTS, out_offset);
+}
+
+/*
+ * Waits until everything staged so far is written. Direct writes must be
+ * aligned, so the unaligned end of the last slot goes out through the page
+ * cache; its length is returned.
+ */
+static uint32_t uring_drain(unsigned slot) {
+	uring_slot_t *last = &ring_slots[slot];
+	uint32_t tail = direct_output ? last->length % OUTPUT_ALIGN : 0;
+	last->length -= tail;
+	
+	uring_seal(slot);
+	for (unsigned i = 0; i < URING_SLOTS; i++) {
+		while (ring_slots[i].busy)
+			uring_wait();
+	}
+	
+	if (tail) {
+		uint32_t end = last->length + tail;
+		uint32_t hashed = last->hashed > last->length ? last->hashed : last->length;
+		output_buffered();
+		if (pwrite(ring_out_fd, last->buf + last->length, tail, last->out_offset + last->length) != tail)
+			apply_fail("Failed to write output file.");
+		output_direct();
+		if (output_hash && end > hashed)
+			output_hash_update(last->buf + hashed, end - hashed);
+	}
+	return tail;
+}
+
+/* Drains the ring, records a checkpoint and carries the direct tail over into a new slot */
+static unsigned uring_checkpoint(unsigned slot, const bxapply_state_t *state) {
+	uint32_t tail = uring_drain(slot);
+	if (fsync(ring_out_fd))
+		apply_fail("Failed to write output file.");
+	resume_save(state);
+	
+	uring_slot_t *last = &ring_slots[slot];
+	slot = uring_open_slot((slot + 1) % URING_SLOTS, last->out_offset + last->length);
+	uring_slot_t *s = &ring_slots[slot];
+	memcpy(s->buf, last->buf + last->length, tail);
+	s->length = tail;
+	s->hashed = tail;
+	return slot;
+}
+
+/* The slot being filled */
+static unsigned ring_slot;
+
+/* Queues reads of the old bytes into the slots, the diff is added on completion */
+static const char *uring_mix(void *ctx, const bxapply_state_t *state, const uint8_t *d, uint64_t mixlen) {
+	uint64_t in_offset = state->in_offset, out_offset = state->out_offset;
+	(void)ctx;
+	
+	while (mixlen) {
+		uring_slot_t *s = &ring_slots[ring_slot];
+		uint32_t take = URING_SLOT_SIZE - s->length;
+		if (take > mixlen) take = (uint32_t)mixlen;
+		
+		while (!ring_free_read_count)
+			uring_wait();
+		
+		unsigned index = ring_free_reads[--ring_free_read_count];
+		uring_read_t *r = &ring_reads[index];
+		r->slot = ring_slot;
+		r->pos = s->length;
+		r->length = take;
+		r->in_offset = in_offset;
+		r->diff = d;
+		uring_queue_read(index);
+		
+		s->pending++;
+		s->length += take;
+		d += take;
+		in_offset += take;
+		out_offset += take;
+		mixlen -= take;
+		if (s->length == URING_SLOT_SIZE)
+			ring_slot = uring_next_slot(ring_slot, out_offset);
+	}
+	return NULL;
+}
+
+static const char *uring_copy(void *ctx, const bxapply_state_t *state, const uint8_t *e, uint64_t copylen) {
+	uint64_t out_offset = state->out_offset;
+	(void)ctx;
+	
+	while (copylen) {
+		uring_slot_t *s = &ring_slots[ring_slot];
+		uint32_t take = URING_SLOT_SIZE - s->length;
+		if (take > copylen) take = (uint32_t)copylen;
+		
+		memcpy(s->buf + s->length, e, take);
+		s->length += take;
+		e += take;
+		out_offset += take;
+		copylen -= take;
+		if (s->length == URING_SLOT_SIZE)
+			ring_slot = uring_next_slot(ring_slot, out_offset);
+	}
+	return NULL;
+}
+
+static const char *uring_step(void *ctx, const bxapply_state_t *state) {
+	(void)ctx;
+	if (resume && state->out_offset >= next_checkpoint)
+		ring_slot = uring_checkpoint(ring_slot, state);
 	return NULL;
 }
+
+static const char *uring_end(void *ctx, const bxapply_state_t *state, const bxdiff_control_t *c) {
+	apply_end(c);
+	return uring_step(ctx, state);
+}
+
+static bool apply_uring(int in_fd, int out_fd) {
+	/* Writes are positional, streams go through stdio */
+	if (!use_uring || getenv("BXPATCH_NO_URING") || lseek(out_fd, 0, SEEK_CUR) < 0)
+		return false;
+	
+	ring = uring_open(URING_ENTRIES);
+	if (!ring) return false;
+	
+	for (unsigned i = 0; i < URING_SLOTS; i++) {
+		memset(&ring_slots[i], 0, sizeof(uring_slot_t));
+		if (posix_memalign((void **)&ring_slots[i].buf, OUTPUT_ALIGN, URING_SLOT_SIZE)) {
+			while (i--) free(ring_slots[i].buf);
+			uring_close(ring);
+			return false;
+		}
+	}
+	for (unsigned i = 0; i < URING_ENTRIES; i++)
+		ring_free_reads[i] = URING_ENTRIES - 1 - i;
+	ring_free_read_count = URING_ENTRIES;
+	ring_retire_next = 0;
+	ring_in_fd = in_fd;
+	ring_out_fd = out_fd;
+	
+	/* The bytes before the starting point are already part of the digest */
+	bxapply_state_t state = apply_start();
+	size_t prefix = output_read_prefix(ring_slots[0].buf, state.out_offset);
+	ring_slot = uring_open_slot(0, state.out_offset - prefix);
+	ring_slots[0].length = prefix;
+	ring_slots[0].hashed = prefix;
+	
+	static const bxapply_ops_t ops = {apply_begin, uring_mix, uring_copy, uring_end, uring_step};
+	const char *error = bxapply_run(patch, &state, UINT64_MAX, &ops, NULL);
+	if (error)
+		apply_fail(error);
+	
+	uring_drain(ring_slot);
+	
+	for (unsigned i = 0; i < URING_SLOTS; i++)
+		free(ring_slots[i].buf);
+	uring_close(ring);
+	ring = NULL;
+	
+	output_buffered();
+	output_length = state.out_offset;
+	return true;
+}
@@ -0,0 +1,454 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <openssl/sha.h>
+
+#include "bxformat.h"
+#include "bxdaemon.h"
+#include "bxapply.h"
+#include "hashcache.h"
+#include "hashio.h"
+
+/*
+ * Patch daemon. Keeps old files mapped together with their SHA1 and
+ * patches decoded, so repeated applies against the same base or of the
+ * same patch skip hashing and decompression. Requests come from
+ * bxpatch --daemon, which opens all three files itself and hands over
+ * their descriptors, so a client can only use files it could open anyway.
+ * Entries are keyed by the device and inode of the passed descriptor and
+ * revalidated against its size and timestamps on every request.
+ * A fixed number of workers serve one connection each at a time.
+ */
+
+static const char *usage = "usage: bxpatchd [-b <bases>] [-p <patches>] [-w <workers>] [--huge-pages] <socket>\n"
+                           "       keeps up to <bases> (4) old files and <patches> (8) decoded patches,\n"
+                           "       serves up to <workers> (4) requests at a time";
+
+/* Upper bounds for -b, -p and -w */
+#define MAX_ENTRIES 1024
+#define MAX_WORKERS 256
+
+/* Seconds a client may take to send its request before the worker moves on */
+#define REQUEST_TIMEOUT 2
+
+static const struct option long_options[] = {
+	{"bases", required_argument, NULL, 'b'},
+	{"patches", required_argument, NULL, 'p'},
+	{"workers", required_argument, NULL, 'w'},
+	{"huge-pages", no_argument, NULL, 'G'},
+	{NULL, 0, NULL, 0}
+};
+
+/*
+ * A cache entry. The table holds one reference, every request using the
+ * entry another one, so an entry evicted while in use is freed by the
+ * request that releases it last.
+ */
+typedef struct {
+	hashcache_key_t key;
+	unsigned refs;
+	uint64_t used;
+	
+	/* Old files */
+	const uint8_t *data;
+	size_t size;
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+	
+	/* Patches */
+	bxdiff_patch_t *patch;
+} cache_entry_t;
+
+typedef struct {
+	cache_entry_t **entries;
+	unsigned count;
+} cache_t;
+
+static cache_t bases, patches;
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t cache_clock;
+static bool huge_pages = false;
+static const char *socket_path;
+static int listen_sock;
+
+static void *worker(void *arg);
+
+/* A count between 1 and max, 0 if the argument is not one */
+static unsigned parse_count(const char *arg, unsigned max) {
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul(arg, &end, 10);
+	if (errno || end == arg || *end || arg[strspn(arg, " \t")] == '-' || value > max)
+		return 0;
+	return (unsigned)value;
+}
+
+static void stop(int sig) {
+	(void)sig;
+	unlink(socket_path);
+	_exit(0);
+}
+
+int main(int argc, const char * argv[]) {
+	int ch;
+	unsigned workers = 4;
+	bases.count = 4;
+	patches.count = 8;
+	while ((ch = getopt_long(argc, (char * const *)argv, "b:p:w:", long_options, NULL)) != -1) {
+		switch (ch) {
+			case 'b':
+				bases.count = parse_count(optarg, MAX_ENTRIES);
+				break;
+			case 'p':
+				patches.count = parse_count(optarg, MAX_ENTRIES);
+				break;
+			case 'w':
+				workers = parse_count(optarg, MAX_WORKERS);
+				break;
+			case 'G':
+				huge_pages = true;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	if (argc - optind != 1 || !bases.count || !patches.count || !workers) {
+		puts(usage);
+		return 0;
+	}
+	socket_path = argv[optind];
+	
+	bases.entries = calloc(bases.count, sizeof(cache_entry_t *));
+	patches.entries = calloc(patches.count, sizeof(cache_entry_t *));
+	if (!bases.entries || !patches.entries) {
+		fprintf(stderr, "Memory allocation error.\n");
+		return 1;
+	}
+	
+	listen_sock = bxdaemon_listen(socket_path);
+	if (listen_sock < 0) {
+		fprintf(stderr, "Failed to listen on %s.\n", socket_path);
+		return 1;
+	}
+	signal(SIGINT, stop);
+	signal(SIGTERM, stop);
+	signal(SIGPIPE, SIG_IGN);
+	
+	/* The main thread is the last worker */
+	for (unsigned i = 1; i < workers; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, worker, NULL)) {
+			fprintf(stderr, "Failed to start a worker.\n");
+			unlink(socket_path);
+			return 1;
+		}
+		pthread_detach(thread);
+	}
+	worker(NULL);
+	
+	close(listen_sock);
+	unlink(socket_path);
+	return 1;
+}
+
+static void entry_free(cache_entry_t *entry) {
+	if (entry->data)
+		munmap((void *)entry->data, entry->size);
+	if (entry->patch)
+		bxdiff_patch_close(entry->patch);
+	free(entry);
+}
+
+static void entry_release(cache_entry_t *entry) {
+	if (!entry) return;
+	pthread_mutex_lock(&cache_lock);
+	bool last = !--entry->refs;
+	pthread_mutex_unlock(&cache_lock);
+	if (last)
+		entry_free(entry);
+}
+
+/* Called with cache_lock held, a stale entry to free is left in *stale */
+static cache_entry_t *cache_lookup(cache_t *cache, const hashcache_key_t *key, cache_entry_t **stale) {
+	for (unsigned i = 0; i < cache->count; i++) {
+		cache_entry_t *entry = cache->entries[i];
+		if (!entry || entry->key.dev != key->dev || entry->key.ino != key->ino) continue;
+		if (!memcmp(&entry->key, key, sizeof(hashcache_key_t))) {
+			entry->refs++;
+			entry->used = ++cache_clock;
+			return entry;
+		}
+		/* The file changed since it was cached */
+		cache->entries[i] = NULL;
+		if (!--entry->refs)
+			*stale = entry;
+		return NULL;
+	}
+	return NULL;
+}
+
+/*
+ * Inserts a freshly loaded entry, replacing the least recently used one.
+ * If another request loaded the same file meanwhile, that entry is used.
+ */
+static cache_entry_t *cache_insert(cache_t *cache, cache_entry_t *entry) {
+	cache_entry_t *victim = NULL, *stale = NULL;
+	pthread_mutex_lock(&cache_lock);
+	cache_entry_t *existing = cache_lookup(cache, &entry->key, &stale);
+	if (!existing) {
+		unsigned slot = 0;
+		for (unsigned i = 0; i < cache->count; i++) {
+			if (!cache->entries[i]) {
+				slot = i;
+				break;
+			}
+			if (cache->entries[i]->used < cache->entries[slot]->used)
+				slot = i;
+		}
+		victim = cache->entries[slot];
+		if (victim && --victim->refs)
+			victim = NULL;
+		entry->refs = 2;
+		entry->used = ++cache_clock;
+		cache->entries[slot] = entry;
+	}
+	pthread_mutex_unlock(&cache_lock);
+	
+	if (victim)
+		entry_free(victim);
+	if (stale)
+		entry_free(stale);
+	if (existing) {
+		entry_free(entry);
+		return existing;
+	}
+	return entry;
+}
+
+/* Whether fd was opened for mode (O_RDONLY or O_WRONLY) by the client */
+static bool fd_allows(int fd, int mode) {
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0) return false;
+#ifdef O_PATH
+	if (flags & O_PATH) return false;
+#endif
+	return (flags & O_ACCMODE) == mode || (flags & O_ACCMODE) == O_RDWR;
+}
+
+static cache_entry_t *base_acquire(int fd, bool *cached, char *message) {
+	hashcache_key_t key;
+	if (!fd_allows(fd, O_RDONLY) || !hashcache_key(fd, &key)) {
+		snprintf(message, 256, "The old file is not a readable regular file.");
+		return NULL;
+	}
+	
+	cache_entry_t *stale = NULL;
+	pthread_mutex_lock(&cache_lock);
+	cache_entry_t *entry = cache_lookup(&bases, &key, &stale);
+	pthread_mutex_unlock(&cache_lock);
+	if (stale)
+		entry_free(stale);
+	*cached = entry != NULL;
+	if (entry)
+		return entry;
+	
+	entry = calloc(1, sizeof(cache_entry_t));
+	if (!entry) {
+		snprintf(message, 256, "Memory allocation error.");
+		return NULL;
+	}
+	entry->key = key;
+	entry->size = key.size;
+	if (entry->size) {
+		void *data = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data == MAP_FAILED) {
+			snprintf(message, 256, "Failed to map the old file.");
+			free(entry);
+			return NULL;
+		}
+		entry->data = data;
+	}
+	
+	unsigned length;
+	if (!hash_buffer(entry->data, entry->size, NULL, entry->sha1, &length)) {
+		snprintf(message, 256, "Failed to calculate SHA1 hash of the old file.");
+		entry_free(entry);
+		return NULL;
+	}
+	return cache_insert(&bases, entry);
+}
+
+static cache_entry_t *patch_acquire(int fd, bool *cached, char *message) {
+	hashcache_key_t key;
+	if (!fd_allows(fd, O_RDONLY) || !hashcache_key(fd, &key)) {
+		snprintf(message, 256, "The patch is not a readable regular file.");
+		return NULL;
+	}
+	
+	cache_entry_t *stale = NULL;
+	pthread_mutex_lock(&cache_lock);
+	cache_entry_t *entry = cache_lookup(&patches, &key, &stale);
+	pthread_mutex_unlock(&cache_lock);
+	if (stale)
+		entry_free(stale);
+	*cached = entry != NULL;
+	if (entry)
+		return entry;
+	
+	entry = calloc(1, sizeof(cache_entry_t));
+	if (!entry) {
+		snprintf(message, 256, "Memory allocation error.");
+		return NULL;
+	}
+	entry->key = key;
+	
+	/* The patch keeps its own descriptor, the client's one is closed after the request */
+	int patch_fd = dup(fd);
+	entry->patch = patch_fd < 0 ? NULL : bxdiff_patch_open_fd(patch_fd, "The patch");
+	if (!entry->patch) {
+		snprintf(message, 256, "Failed to open the patch.");
+		entry_free(entry);
+		return NULL;
+	}
+	if (entry->patch->filter) {
+		snprintf(message, 256, "Filtered patches can not be applied by bxpatchd.");
+		entry_free(entry);
+		return NULL;
+	}
+	if (!bxdiff_patch_use_arena(entry->patch, huge_pages) && huge_pages)
+		fprintf(stderr, "Failed to reserve memory for a patch, using malloc.\n");
+	if (!bxdiff_patch_decode(entry->patch) || !bxdiff_patch_validate(entry->patch)) {
+		snprintf(message, 256, "Patch is corrupt.");
+		entry_free(entry);
+		return NULL;
+	}
+	return cache_insert(&patches, entry);
+}
+
+static void serve(int sock) {
+	bxdaemon_request_t request;
+	bxdaemon_response_t response;
+	int fds[BXDAEMON_FDS];
+	
+	memset(&response, 0, sizeof(response));
+	memcpy(response.magic, BXDAEMON_MAGIC, 8);
+	response.status = 1;
+	
+	cache_entry_t *base = NULL, *patch = NULL;
+	bool base_cached = false, patch_cached = false;
+	if (!bxdaemon_recv(sock, &request, sizeof(request), fds, BXDAEMON_FDS))
+		goto done;
+	if (memcmp(request.magic, BXDAEMON_MAGIC, 8) ||
+	    fds[BXDAEMON_OLD_FD] < 0 || fds[BXDAEMON_PATCH_FD] < 0 || fds[BXDAEMON_NEW_FD] < 0) {
+		snprintf(response.message, sizeof(response.message), "Invalid request.");
+		goto reply;
+	}
+	int out_fd = fds[BXDAEMON_NEW_FD];
+	if (!fd_allows(out_fd, O_WRONLY)) {
+		snprintf(response.message, sizeof(response.message), "The new file is not open for writing.");
+		goto reply;
+	}
+	
+	if (!(patch = patch_acquire(fds[BXDAEMON_PATCH_FD], &patch_cached, response.message)))
+		goto reply;
+	if (!(base = base_acquire(fds[BXDAEMON_OLD_FD], &base_cached, response.message)))
+		goto reply;
+	response.flags = (base_cached ? BXDAEMON_BASE_CACHED : 0) | (patch_cached ? BXDAEMON_PATCH_CACHED : 0);
+	
+	const bxdiff_patch_t *p = patch->patch;
+	bool mismatch = p->has_input_hash && memcmp(p->input_sha1, base->sha1, SHA_DIGEST_LENGTH);
+	if (mismatch && !(request.flags & BXDAEMON_FORCE)) {
+		snprintf(response.message, sizeof(response.message), "This patch shall not be applied to the provided file (wrong SHA1 hash).\nUse -f to apply it anyway.");
+		goto reply;
+	} else if (mismatch) {
+		snprintf(response.message, sizeof(response.message), "SHA1 hash mismatch. Forcing patch anyway.");
+	}
+	
+	uint8_t sha1[SHA_DIGEST_LENGTH];
+	uint64_t length;
+	const char *error;
+	if (!bxapply_buffer(base->data, base->size, p, out_fd, &length, sha1, &error)) {
+		snprintf(response.message, sizeof(response.message), "%s", error);
+		goto reply;
+	}
+	response.output_length = length;
+	if (length != p->patched_file_size)
+		snprintf(response.message, sizeof(response.message), "Expected size: %llu\nActual size:   %llu",
+			(unsigned long long)p->patched_file_size, (unsigned long long)length);
+	else if (p->has_output_hash && memcmp(p->output_sha1, sha1, SHA_DIGEST_LENGTH))
+		snprintf(response.message, sizeof(response.message), "Output file is corrupt (SHA1 hash mismatch).");
+	else
+		response.status = 0;
+	
+reply:
+	entry_release(base);
+	entry_release(patch);
+	for (unsigned i = 0; i < BXDAEMON_FDS; i++) {
+		if (fds[i] >= 0) close(fds[i]);
+		fds[i] = -1;
+	}
+	bxdaemon_send(sock, &response, sizeof(response), NULL, 0);
+	
+done:
+	for (unsigned i = 0; i < BXDAEMON_FDS; i++)
+		if (fds[i] >= 0) close(fds[i]);
+	close(sock);
+}
+
+static void *worker(void *arg) {
+	(void)arg;
+	while (1) {
+		int client = accept(listen_sock, NULL, NULL);
+		if (client < 0) {
+			if (errno == EINTR || errno == ECONNABORTED) continue;
+			fprintf(stderr, "Failed to accept a connection.\n");
+			break;
+		}
+		
+		/* A client that connects and sends nothing must not hold the worker */
+		struct timeval timeout = {REQUEST_TIMEOUT, 0};
+		if (setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout))) {
+			close(client);
+			continue;
+		}
+		serve(client);
+	}
+	return NULL;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxrange.h"
+#include "bxapply.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BXRANGE_MAGIC "BXINDEX1"
+
+bxrange_index_t *bxrange_index_build(const bxdiff_patch_t *patch, const uint8_t *patch_sha1, uint64_t interval) {
+	if (!patch || !patch->control || !interval) return NULL;
+	
+	bxrange_index_t *index = calloc(1, sizeof(bxrange_index_t));
+	if (!index) return NULL;
+	memcpy(index->patch_sha1, patch_sha1, 20);
+	index->interval = interval;
+	index->patched_file_size = patch->patched_file_size;
+	
+	size_t capacity = 0;
+	uint64_t ops = patch->control_length / sizeof(bxdiff_control_t);
+	const bxdiff_control_t *c = patch->control;
+	uint64_t out_offset = 0, in_offset = 0, diff_offset = 0, extra_offset = 0;
+	uint64_t next = 0;
+	
+	for (uint64_t i = 0; i < ops; i++, c++) {
+		uint64_t mixlen = parse_integer(c->mixlen);
+		uint64_t copylen = parse_integer(c->copylen);
+		int64_t seeklen = parse_integer(c->seeklen);
+		uint64_t end = out_offset + mixlen + copylen;
+		
+		/* Checkpoint the op that covers the next interval boundary */
+		if (end > next) {
+			if (index->count == capacity) {
+				capacity = capacity ? capacity * 2 : 64;
+				void *checkpoints = realloc(index->checkpoints, capacity * sizeof(bxrange_checkpoint_t));
+				if (!checkpoints) {
+					bxrange_index_free(index);
+					return NULL;
+				}
+				index->checkpoints = checkpoints;
+			}
+			bxrange_checkpoint_t *cp = &index->checkpoints[index->count++];
+			cp->out_offset = out_offset;
+			cp->in_offset = in_offset;
+			cp->diff_offset = diff_offset;
+			cp->extra_offset = extra_offset;
+			cp->control_index = i;
+			next = (end / interval + 1) * interval;
+		}
+		
+		out_offset = end;
+		in_offset += mixlen + seeklen;
+		diff_offset += mixlen;
+		extra_offset += copylen;
+	}
+	
+	return index;
+}
+
+bool bxrange_index_write(const bxrange_index_t *index, FILE *f) {
+	uint64_t fields[3] = {
+		bswapHostToLittle64(index->interval),
+		bswapHostToLittle64(index->patched_file_size),
+		bswapHostToLittle64(index->count),
+	};
+	if (fwrite(BXRANGE_MAGIC, 1, 8, f) != 8) return false;
+	if (fwrite(index->patch_sha1, 1, 20, f) != 20) return false;
+	if (fwrite(fields, sizeof(uint64_t), 3, f) != 3) return false;
+	
+	for (uint64_t i = 0; i < index->count; i++) {
+		const bxrange_checkpoint_t *cp = &index->checkpoints[i];
+		uint64_t record[5] = {
+			bswapHostToLittle64(cp->out_offset),
+			bswapHostToLittle64(cp->in_offset),
+			bswapHostToLittle64(cp->diff_offset),
+			bswapHostToLittle64(cp->extra_offset),
+			bswapHostToLittle64(cp->control_index),
+		};
+		if (fwrite(record, sizeof(uint64_t), 5, f) != 5) return false;
+	}
+	return true;
+}
+
+bxrange_index_t *bxrange_index_read(FILE *f) {
+	char magic[8];
+	uint64_t fields[3];
+	
+	bxrange_index_t *index = calloc(1, sizeof(bxrange_index_t));
+	if (!index) return NULL;
+	if (fread(magic, 1, 8, f) != 8 || memcmp(magic, BXRANGE_MAGIC, 8)) goto error;
+	if (fread(index->patch_sha1, 1, 20, f) != 20) goto error;
+	if (fread(fields, sizeof(uint64_t), 3, f) != 3) goto error;
+	index->interval = bswapLittleToHost64(fields[0]);
+	index->patched_file_size = bswapLittleToHost64(fields[1]);
+	index->count = bswapLittleToHost64(fields[2]);
+	if (!index->interval || index->count > SIZE_MAX / sizeof(bxrange_checkpoint_t)) goto error;
+	
+	if (index->count) {
+		index->checkpoints = malloc(index->count * sizeof(bxrange_checkpoint_t));
+		if (!index->checkpoints) goto error;
+	}
+	for (uint64_t i = 0; i < index->count; i++) {
+		uint64_t record[5];
+		if (fread(record, sizeof(uint64_t), 5, f) != 5) goto error;
+		bxrange_checkpoint_t *cp = &index->checkpoints[i];
+		cp->out_offset = bswapLittleToHost64(record[0]);
+		cp->in_offset = bswapLittleToHost64(record[1]);
+		cp->diff_offset = bswapLittleToHost64(record[2]);
+		cp->extra_offset = bswapLittleToHost64(record[3]);
+		cp->control_index = bswapLittleToHost64(record[4]);
+	}
+	return index;
+	
+error:
+	bxrange_index_free(index);
+	return NULL;
+}
+
+void bxrange_index_free(bxrange_index_t *index) {
+	if (index) {
+		if (index->checkpoints) free(index->checkpoints);
+		free(index);
+	}
+}
+
+/* The requested range and where it goes; ops are clipped to it */
+typedef struct {
+	uint64_t offset, end;
+	uint8_t *dst;
+	FILE *in_file;
+} range_t;
+
+/* Overlap [*a, *b) of a run of length output bytes at state->out_offset with the range */
+static bool range_clip(const range_t *r, const bxapply_state_t *state, uint64_t length, uint64_t *a, uint64_t *b) {
+	if (state->out_offset >= r->end) return false;
+	*a = state->out_offset > r->offset ? state->out_offset : r->offset;
+	*b = length < r->end - state->out_offset ? state->out_offset + length : r->end;
+	return *a < *b;
+}
+
+static const char *range_mix(void *ctx, const bxapply_state_t *state, const uint8_t *diff, uint64_t length) {
+	range_t *r = ctx;
+	uint64_t a, b;
+	if (!range_clip(r, state, length, &a, &b)) return NULL;
+	
+	uint64_t skip = a - state->out_offset;
+	uint8_t *q = r->dst + (a - r->offset);
+	if (state->in_offset + skip > INT64_MAX || fseeko(r->in_file, (off_t)(state->in_offset + skip), SEEK_SET) ||
+	    fread(q, 1, b - a, r->in_file) != b - a)
+		return "Input file is truncated.";
+	for (uint64_t j = 0; j < b - a; j++)
+		q[j] += diff[skip + j];
+	return NULL;
+}
+
+static const char *range_copy(void *ctx, const bxapply_state_t *state, const uint8_t *extra, uint64_t length) {
+	range_t *r = ctx;
+	uint64_t a, b;
+	if (range_clip(r, state, length, &a, &b))
+		memcpy(r->dst + (a - r->offset), extra + (a - state->out_offset), b - a);
+	return NULL;
+}
+
+/*
+ * Produces [offset, offset + length) of the patched file into dst.
+ * Returns false if the range is outside of the output or the patch or
+ * the input file turn out to be inconsistent with the index.
+ */
+bool bxrange_read(const bxrange_index_t *index, const bxdiff_patch_t *patch, FILE *in_file, uint64_t offset, uint64_t length, void *dst) {
+	if (offset > index->patched_file_size || length > index->patched_file_size - offset) return false;
+	if (!length) return true;
+	
+	/* Last checkpoint at or before offset */
+	bxrange_checkpoint_t start = {0, 0, 0, 0, 0};
+	uint64_t lo = 0, hi = index->count;
+	while (lo < hi) {
+		uint64_t mid = lo + (hi - lo) / 2;
+		if (index->checkpoints[mid].out_offset <= offset) lo = mid + 1;
+		else hi = mid;
+	}
+	if (lo) start = index->checkpoints[lo - 1];
+	
+	static const bxapply_ops_t ops = {NULL, range_mix, range_copy, NULL, NULL};
+	range_t range = {offset, offset + length, dst, in_file};
+	bxapply_state_t state = {start.control_index, start.diff_offset, start.extra_offset, start.in_offset, start.out_offset, 0};
+	if (bxapply_run(patch, &state, range.end, &ops, &range))
+		return false;
+	return state.out_offset >= range.end;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxrange_h
+#define bxrange_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "bxformat.h"
+
+/*
+ * Sidecar index for random access into the patched file. Every interval
+ * bytes of output the apply state at the start of the covering control op
+ * is recorded, so a byte range can be produced by replaying only the ops
+ * that overlap it. The control, diff and extra blocks still have to be
+ * decoded, but the input file is only read where the range needs it.
+ */
+
+typedef struct {
+	uint64_t out_offset;
+	uint64_t in_offset;
+	uint64_t diff_offset;
+	uint64_t extra_offset;
+	uint64_t control_index;
+} bxrange_checkpoint_t;
+
+typedef struct {
+	uint8_t patch_sha1[20];
+	uint64_t interval;
+	uint64_t patched_file_size;
+	uint64_t count;
+	bxrange_checkpoint_t *checkpoints;
+} bxrange_index_t;
+
+bxrange_index_t *bxrange_index_build(const bxdiff_patch_t *patch, const uint8_t *patch_sha1, uint64_t interval);
+bool bxrange_index_write(const bxrange_index_t *index, FILE *f);
+bxrange_index_t *bxrange_index_read(FILE *f);
+void bxrange_index_free(bxrange_index_t *index);
+
+bool bxrange_read(const bxrange_index_t *index, const bxdiff_patch_t *patch, FILE *in_file, uint64_t offset, uint64_t length, void *dst);
+
+#endif /* bxrange_h */
@@ -0,0 +1,211 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "bxformat.h"
+#include "lzmaio.h"
+#include "zstdio.h"
+
+/* zstd is the default where it is compiled in */
+#ifdef WITH_ZSTD
+#define CODEC_DEFAULT CODEC_ZSTD
+#define CODEC_DEFAULT_NAME "zstd"
+#else
+#define CODEC_DEFAULT CODEC_XZ
+#define CODEC_DEFAULT_NAME "xz"
+#endif
+
+static const char *usage = "usage: bxrecode [-c <codec>] [-d <codec>] [-e <codec>] [-l <level>] [-w <windowlog>] [-D <dictionary>] <patchfile> <newpatchfile>\n"
+                           "       codecs: xz, zstd (default: " CODEC_DEFAULT_NAME ")";
+
+#define RECODE_BUFFER_SIZE (1 << 20)
+#define RECODE_XZ_LEVEL 9
+
+typedef enum {
+	CODEC_XZ,
+	CODEC_ZSTD,
+} codec_t;
+
+static int zstd_level = 19;
+static int zstd_window_log = 27;
+static void *dictionary;
+static size_t dictionary_size;
+
+static bool parse_codec(const char *name, codec_t *codec) {
+	if (!strcmp(name, "xz")) *codec = CODEC_XZ;
+	else if (!strcmp(name, "zstd")) *codec = CODEC_ZSTD;
+	else return false;
+	return true;
+}
+
+static bool read_file(const char *path, void **data, size_t *size) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	fseeko(f, 0, SEEK_END);
+	*size = ftello(f);
+	fseeko(f, 0, SEEK_SET);
+	*data = malloc(*size ? *size : 1);
+	bool ok = *data && fread(*data, 1, *size, f) == *size;
+	fclose(f);
+	return ok;
+}
+
+/*
+ * Compresses one block as its own stream, returns its size or -1. An empty
+ * block still gets a stream, so its codec can be recognised.
+ */
+static off_t write_block(FILE *f, codec_t codec, const void *data, size_t length) {
+	off_t start = ftello(f);
+	
+	if (codec == CODEC_XZ) {
+		lzma_ret error;
+		LZMA_FILE *xz = lzma_xzWriteOpen(&error, f, RECODE_BUFFER_SIZE, RECODE_XZ_LEVEL);
+		if (!xz) return -1;
+		if (length) lzma_xzWrite(&error, xz, data, length);
+		lzma_xzClose(&error, xz);
+		if (error != LZMA_OK) return -1;
+	} else {
+		bool error;
+		ZSTD_FILE *zstd = zstd_WriteOpen(&error, f, RECODE_BUFFER_SIZE, zstd_level, zstd_window_log, dictionary, dictionary_size);
+		if (!zstd) {
+			fprintf(stderr, "zstd is not available.\n");
+			return -1;
+		}
+		if (length) zstd_Write(&error, zstd, data, length);
+		zstd_Close(&error, zstd);
+		if (error) return -1;
+	}
+	return ferror(f) ? -1 : ftello(f) - start;
+}
+
+/*
+ * Rewrites a BXDIFF50/51 patch as BXDIFF51 with every block compressed by
+ * the codec chosen for it. The ops and hashes stay the same.
+ */
+static int recode(const char *patchfile_path, const char *newpatchfile_path, const codec_t *codecs) {
+	bxdiff_patch_t *patch = bxdiff_patch_open(patchfile_path);
+	if (!patch) return 1;
+	if (!patch->has_output_hash) {
+		fprintf(stderr, "Only BXDIFF50 and BXDIFF51 patches carry the hashes BXDIFF51 needs.\n");
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	if (!bxdiff_patch_decode(patch)) {
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	
+	FILE *f = fopen(newpatchfile_path, "wb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s.\n", newpatchfile_path);
+		bxdiff_patch_close(patch);
+		return 1;
+	}
+	
+	/* The block sizes are only known afterwards, the header is written last */
+	bxdiff50_header_t header;
+	memset(&header, 0, sizeof(header));
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+	off_t control_size = ok ? write_block(f, codecs[0], patch->control, patch->control_length) : -1;
+	off_t diff_size = control_size >= 0 ? write_block(f, codecs[1], patch->diff, patch->diff_length) : -1;
+	off_t extra_size = diff_size >= 0 ? write_block(f, codecs[2], patch->extra, patch->extra_length) : -1;
+	
+	if (extra_size >= 0) {
+		memcpy(header.magic, "BXDIFF51", 8);
+		header.unknown = bswapHostToLittle64((uint64_t)patch->filter);
+		header.patched_file_size = bswapHostToLittle64(patch->patched_file_size);
+		header.control_size = bswapHostToLittle64(control_size);
+		header.diff_size = bswapHostToLittle64(diff_size);
+		header.extra_size = bswapHostToLittle64(extra_size);
+		memcpy(header.result_sha1, patch->output_sha1, 20);
+		memcpy(header.target_sha1, patch->input_sha1, 20);
+		ok = !fseeko(f, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, f) == 1;
+	} else {
+		ok = false;
+	}
+	if (fclose(f)) ok = false;
+	bxdiff_patch_close(patch);
+	
+	if (!ok) {
+		fprintf(stderr, "Failed to write %s.\n", newpatchfile_path);
+		unlink(newpatchfile_path);
+		return 1;
+	}
+	return 0;
+}
+
+int main(int argc, const char * argv[]) {
+	codec_t codecs[3] = {CODEC_DEFAULT, CODEC_DEFAULT, CODEC_DEFAULT};
+	const char *dictionary_path = NULL;
+	int ch;
+	
+	while ((ch = getopt(argc, (char * const *)argv, "c:d:e:l:w:D:")) != -1) {
+		switch (ch) {
+			case 'c':
+			case 'd':
+			case 'e':
+				if (!parse_codec(optarg, &codecs[ch == 'c' ? 0 : ch == 'd' ? 1 : 2])) {
+					puts(usage);
+					return 0;
+				}
+				break;
+			case 'l':
+				zstd_level = atoi(optarg);
+				break;
+			case 'w':
+				zstd_window_log = atoi(optarg);
+				break;
+			case 'D':
+				dictionary_path = optarg;
+				break;
+			default:
+				puts(usage);
+				return 0;
+		}
+	}
+	
+	if (argc - optind != 2) {
+		puts(usage);
+		return 0;
+	}
+	
+	/* The same dictionary serves a source patch that already uses it */
+	if (dictionary_path) {
+		if (!read_file(dictionary_path, &dictionary, &dictionary_size)) {
+			fprintf(stderr, "Failed to read %s.\n", dictionary_path);
+			return 1;
+		}
+		if (!bxdiff_load_dictionary(dictionary_path))
+			return 1;
+	}
+	
+	return recode(argv[optind], argv[optind + 1], codecs);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxresume.h"
+#include "bxformat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define BXRESUME_MAGIC "BXRESUM3"
+
+typedef struct __attribute__((packed)) {
+	char magic[8];
+	uint8_t patch_id[20];
+	uint64_t control_index;
+	uint64_t in_offset;
+	uint64_t diff_offset;
+	uint64_t extra_offset;
+	uint64_t out_offset;
+	uint64_t op_offset;
+} bxresume_record_t;
+
+bool bxresume_load(const char *path, bxresume_t *checkpoint) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return false;
+	
+	bxresume_record_t record;
+	bool ok = fread(&record, sizeof(record), 1, f) == 1 &&
+	          !memcmp(record.magic, BXRESUME_MAGIC, 8);
+	fclose(f);
+	if (!ok) return false;
+	
+	memcpy(checkpoint->patch_id, record.patch_id, 20);
+	checkpoint->control_index = bswapLittleToHost64(record.control_index);
+	checkpoint->in_offset = bswapLittleToHost64(record.in_offset);
+	checkpoint->diff_offset = bswapLittleToHost64(record.diff_offset);
+	checkpoint->extra_offset = bswapLittleToHost64(record.extra_offset);
+	checkpoint->out_offset = bswapLittleToHost64(record.out_offset);
+	checkpoint->op_offset = bswapLittleToHost64(record.op_offset);
+	return true;
+}
+
+static bool sync_parent(const char *path) {
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash == path ? 1 : slash - path) : strdup(".");
+	if (!dir) return false;
+	
+	int fd = open(dir, O_RDONLY | O_DIRECTORY);
+	free(dir);
+	if (fd < 0) return false;
+	bool ok = !fsync(fd);
+	close(fd);
+	return ok;
+}
+
+bool bxresume_save(const char *path, const bxresume_t *checkpoint) {
+	bxresume_record_t record;
+	memset(&record, 0, sizeof(record));
+	memcpy(record.magic, BXRESUME_MAGIC, 8);
+	memcpy(record.patch_id, checkpoint->patch_id, 20);
+	record.control_index = bswapHostToLittle64(checkpoint->control_index);
+	record.in_offset = bswapHostToLittle64(checkpoint->in_offset);
+	record.diff_offset = bswapHostToLittle64(checkpoint->diff_offset);
+	record.extra_offset = bswapHostToLittle64(checkpoint->extra_offset);
+	record.out_offset = bswapHostToLittle64(checkpoint->out_offset);
+	record.op_offset = bswapHostToLittle64(checkpoint->op_offset);
+	
+	size_t tmp_length = strlen(path) + 32;
+	char *tmp_path = malloc(tmp_length);
+	if (!tmp_path) return false;
+	snprintf(tmp_path, tmp_length, "%s.%d", path, (int)getpid());
+	
+	/* The record has to be on disk before it replaces the previous one,
+	 * and the rename is only durable once the directory is synced.
+	 */
+	bool ok = false;
+	int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd >= 0) {
+		ok = write(fd, &record, sizeof(record)) == sizeof(record) && !fsync(fd);
+		if (close(fd)) ok = false;
+		if (ok) ok = !rename(tmp_path, path);
+		if (!ok) unlink(tmp_path);
+		if (ok) ok = sync_parent(path);
+	}
+	
+	free(tmp_path);
+	return ok;
+}
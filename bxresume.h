@@ -0,0 +1,56 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxresume_h
+#define bxresume_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Checkpoint of an interrupted apply. It records where in the control,
+ * diff and extra blocks and in the input file the apply continues, how
+ * much of the current operation is done, and how much of the output is
+ * known to be on disk. The output digest is not saved; a resumed run
+ * hashes that part of the output again. The file
+ * is replaced atomically, so a crash leaves either the previous checkpoint
+ * or the new one.
+ */
+
+typedef struct {
+	uint8_t patch_id[20];
+	uint64_t control_index;
+	uint64_t in_offset;
+	uint64_t diff_offset;
+	uint64_t extra_offset;
+	uint64_t out_offset;
+	uint64_t op_offset;
+} bxresume_t;
+
+bool bxresume_load(const char *path, bxresume_t *checkpoint);
+bool bxresume_save(const char *path, const bxresume_t *checkpoint);
+
+#endif /* bxresume_h */
@@ -0,0 +1,103 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxtrace.h"
+#include <stdlib.h>
+#include <stdarg.h>
+#include <time.h>
+#include <unistd.h>
+
+FILE *bxtrace_file = NULL;
+static uint64_t trace_epoch;
+static bool trace_first;
+static unsigned trace_threads;
+static __thread unsigned trace_tid;
+
+/* Microseconds, the unit of the trace event format */
+uint64_t bxtrace_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000 - trace_epoch;
+}
+
+/*
+ * Opens the trace file. It is closed at exit, so the JSON stays valid
+ * when the tool bails out with exit(1) halfway through.
+ */
+bool bxtrace_open(const char *path) {
+	if (bxtrace_file) bxtrace_close();
+	
+	bxtrace_file = fopen(path, "w");
+	if (!bxtrace_file) {
+		fprintf(stderr, "Failed to open %s.\n", path);
+		return false;
+	}
+	trace_epoch = 0;
+	trace_epoch = bxtrace_clock();
+	trace_first = true;
+	fputs("{\"traceEvents\":[", bxtrace_file);
+	
+	static bool registered = false;
+	if (!registered) {
+		atexit(bxtrace_close);
+		registered = true;
+	}
+	return true;
+}
+
+void bxtrace_close(void) {
+	if (bxtrace_file) {
+		fputs("\n],\"displayTimeUnit\":\"ms\"}\n", bxtrace_file);
+		fclose(bxtrace_file);
+		bxtrace_file = NULL;
+	}
+}
+
+/*
+ * Writes a complete ("X") event lasting from start until now. args_format
+ * produces the members of the args object and may be NULL. Events may come
+ * from several threads, each gets its own track.
+ */
+void bxtrace_event(const char *name, const char *category, uint64_t start, const char *args_format, ...) {
+	if (!bxtrace_file) return;
+	
+	uint64_t now = bxtrace_clock();
+	if (!trace_tid)
+		trace_tid = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
+	flockfile(bxtrace_file);
+	fprintf(bxtrace_file, "%s\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%u", trace_first ? "" : ",", name, category, (unsigned long long)start, (unsigned long long)(now - start), (int)getpid(), trace_tid);
+	trace_first = false;
+	if (args_format) {
+		va_list ap;
+		va_start(ap, args_format);
+		fputs(",\"args\":{", bxtrace_file);
+		vfprintf(bxtrace_file, args_format, ap);
+		fputc('}', bxtrace_file);
+		va_end(ap);
+	}
+	fputc('}', bxtrace_file);
+	funlockfile(bxtrace_file);
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxtrace_h
+#define bxtrace_h
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Static probes and trace export.
+ *
+ * BXPROBEn() are USDT probes in the "bxdiff" provider when <sys/sdt.h>
+ * from SystemTap is available and expand to nothing otherwise. An enabled
+ * USDT site is a single nop, so they may sit on per operation paths.
+ *
+ * bxtrace_open() starts a trace in Chrome trace event format, which loads
+ * in chrome://tracing and Perfetto. Events are only produced while
+ * bxtrace_file is set; callers test it before taking timestamps.
+ */
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define BXPROBE0(name) DTRACE_PROBE(bxdiff, name)
+#define BXPROBE1(name, a) DTRACE_PROBE1(bxdiff, name, a)
+#define BXPROBE2(name, a, b) DTRACE_PROBE2(bxdiff, name, a, b)
+#define BXPROBE3(name, a, b, c) DTRACE_PROBE3(bxdiff, name, a, b, c)
+#define BXPROBE4(name, a, b, c, d) DTRACE_PROBE4(bxdiff, name, a, b, c, d)
+#endif
+#endif
+
+#ifndef BXPROBE0
+#define BXPROBE0(name) do {} while (0)
+#define BXPROBE1(name, a) do {} while (0)
+#define BXPROBE2(name, a, b) do {} while (0)
+#define BXPROBE3(name, a, b, c) do {} while (0)
+#define BXPROBE4(name, a, b, c, d) do {} while (0)
+#endif
+
+extern FILE *bxtrace_file;
+
+bool bxtrace_open(const char *path);
+void bxtrace_close(void);
+uint64_t bxtrace_clock(void);
+void bxtrace_event(const char *name, const char *category, uint64_t start, const char *args_format, ...) __attribute__((format(printf, 4, 5)));
+
+#endif /* bxtrace_h */
@@ -0,0 +1,267 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bxundo.h"
+#include "bxformat.h"
+#include "lzmaio.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define UNDO_BUFFER_SIZE (1 << 20)
+#define UNDO_XZ_LEVEL 6
+
+typedef struct {
+	uint64_t old_offset;
+	uint64_t new_offset;
+	uint64_t diff_offset;
+	uint64_t length;
+} bxundo_mix_t;
+
+/* One control triple of the reverse patch and where its data comes from */
+typedef struct {
+	uint64_t mixlen;
+	uint64_t copylen;
+	int64_t seeklen;
+	uint64_t diff_offset;
+	uint64_t extra_offset;
+} bxundo_op_t;
+
+struct bxundo {
+	bxundo_mix_t *mixes;
+	size_t count, capacity;
+	bxundo_op_t *ops;
+	size_t op_count, op_capacity;
+};
+
+bxundo_t *bxundo_new(void) {
+	return calloc(1, sizeof(bxundo_t));
+}
+
+bool bxundo_add_mix(bxundo_t *undo, uint64_t old_offset, uint64_t new_offset, uint64_t diff_offset, uint64_t length) {
+	if (!length) return true;
+	
+	/* Ops that continue the previous one in all three streams are merged */
+	if (undo->count) {
+		bxundo_mix_t *last = &undo->mixes[undo->count - 1];
+		if (last->old_offset + last->length == old_offset &&
+		    last->new_offset + last->length == new_offset &&
+		    last->diff_offset + last->length == diff_offset) {
+			last->length += length;
+			return true;
+		}
+	}
+	
+	if (undo->count == undo->capacity) {
+		size_t capacity = undo->capacity ? undo->capacity * 2 : 1024;
+		bxundo_mix_t *mixes = realloc(undo->mixes, capacity * sizeof(bxundo_mix_t));
+		if (!mixes) return false;
+		undo->mixes = mixes;
+		undo->capacity = capacity;
+	}
+	bxundo_mix_t *mix = &undo->mixes[undo->count++];
+	mix->old_offset = old_offset;
+	mix->new_offset = new_offset;
+	mix->diff_offset = diff_offset;
+	mix->length = length;
+	return true;
+}
+
+void bxundo_free(bxundo_t *undo) {
+	if (undo) {
+		free(undo->mixes);
+		free(undo->ops);
+		free(undo);
+	}
+}
+
+static int compare_mixes(const void *a, const void *b) {
+	const bxundo_mix_t *x = a, *y = b;
+	if (x->old_offset != y->old_offset) return x->old_offset < y->old_offset ? -1 : 1;
+	if (x->length != y->length) return x->length > y->length ? -1 : 1;
+	return 0;
+}
+
+static bxundo_op_t *push_op(bxundo_t *undo) {
+	if (undo->op_count == undo->op_capacity) {
+		size_t capacity = undo->op_capacity ? undo->op_capacity * 2 : 1024;
+		bxundo_op_t *ops = realloc(undo->ops, capacity * sizeof(bxundo_op_t));
+		if (!ops) return NULL;
+		undo->ops = ops;
+		undo->op_capacity = capacity;
+	}
+	bxundo_op_t *op = &undo->ops[undo->op_count++];
+	memset(op, 0, sizeof(bxundo_op_t));
+	return op;
+}
+
+/*
+ * Walks the old file in order. Each part that some mix op read becomes a
+ * mix op of the reverse patch, every part no op read (overwritten by extra
+ * data in the new file) becomes extra data.
+ */
+static bool build_ops(bxundo_t *undo, uint64_t old_size) {
+	qsort(undo->mixes, undo->count, sizeof(bxundo_mix_t), compare_mixes);
+	
+	uint64_t pos = 0, new_pos = 0;
+	bxundo_op_t *op = push_op(undo);
+	if (!op) return false;
+	
+	for (size_t i = 0; i < undo->count; i++) {
+		bxundo_mix_t mix = undo->mixes[i];
+		if (mix.old_offset >= old_size) break;
+		if (mix.old_offset + mix.length > old_size) mix.length = old_size - mix.old_offset;
+		
+		/* Bytes already covered by an earlier op are skipped */
+		if (mix.old_offset < pos) {
+			uint64_t skip = pos - mix.old_offset;
+			if (skip >= mix.length) continue;
+			mix.old_offset += skip;
+			mix.new_offset += skip;
+			mix.diff_offset += skip;
+			mix.length -= skip;
+		}
+		
+		if (mix.old_offset > pos) {
+			if (!op->copylen) op->extra_offset = pos;
+			op->copylen += mix.old_offset - pos;
+		}
+		
+		if (!op->copylen && op->mixlen && new_pos == mix.new_offset &&
+		    op->diff_offset + op->mixlen == mix.diff_offset) {
+			op->mixlen += mix.length;
+		} else {
+			op->seeklen = (int64_t)(mix.new_offset - new_pos);
+			op = push_op(undo);
+			if (!op) return false;
+			op->mixlen = mix.length;
+			op->diff_offset = mix.diff_offset;
+		}
+		new_pos = mix.new_offset + mix.length;
+		pos = mix.old_offset + mix.length;
+	}
+	
+	if (pos < old_size) {
+		if (!op->copylen) op->extra_offset = pos;
+		op->copylen += old_size - pos;
+	}
+	return true;
+}
+
+static uint64_t encode_integer(int64_t x) {
+	uint64_t y = x < 0 ? -(uint64_t)x : (uint64_t)x;
+	if (x < 0) y |= 1ULL << 63;
+	return bswapHostToLittle64(y);
+}
+
+static bool write_control(bxundo_t *undo, LZMA_FILE *xz) {
+	lzma_ret error = LZMA_OK;
+	for (size_t i = 0; i < undo->op_count && error == LZMA_OK; i++) {
+		bxundo_op_t *op = &undo->ops[i];
+		bxdiff_control_t c;
+		c.mixlen = encode_integer(op->mixlen);
+		c.copylen = encode_integer(op->copylen);
+		c.seeklen = encode_integer(op->seeklen);
+		lzma_xzWrite(&error, xz, &c, sizeof(c));
+	}
+	return error == LZMA_OK;
+}
+
+/* old = new - diff, so the reverse patch mixes with the negated diff bytes */
+static bool write_diff(bxundo_t *undo, LZMA_FILE *xz, const uint8_t *diff, uint8_t *buf) {
+	lzma_ret error = LZMA_OK;
+	for (size_t i = 0; i < undo->op_count && error == LZMA_OK; i++) {
+		const uint8_t *src = diff + undo->ops[i].diff_offset;
+		uint64_t remaining = undo->ops[i].mixlen;
+		while (remaining && error == LZMA_OK) {
+			size_t n = remaining < UNDO_BUFFER_SIZE ? remaining : UNDO_BUFFER_SIZE;
+			for (size_t j = 0; j < n; j++)
+				buf[j] = -src[j];
+			lzma_xzWrite(&error, xz, buf, n);
+			src += n;
+			remaining -= n;
+		}
+	}
+	return error == LZMA_OK;
+}
+
+static bool write_extra(bxundo_t *undo, LZMA_FILE *xz, int old_fd, uint8_t *buf) {
+	lzma_ret error = LZMA_OK;
+	for (size_t i = 0; i < undo->op_count && error == LZMA_OK; i++) {
+		uint64_t offset = undo->ops[i].extra_offset;
+		uint64_t remaining = undo->ops[i].copylen;
+		while (remaining && error == LZMA_OK) {
+			size_t n = remaining < UNDO_BUFFER_SIZE ? remaining : UNDO_BUFFER_SIZE;
+			if (pread(old_fd, buf, n, offset) != (ssize_t)n) return false;
+			lzma_xzWrite(&error, xz, buf, n);
+			offset += n;
+			remaining -= n;
+		}
+	}
+	return error == LZMA_OK;
+}
+
+/* Compresses one block as its own XZ stream, returns its size or -1 */
+static off_t write_block(bxundo_t *undo, FILE *f, int block, const uint8_t *diff, int old_fd, uint8_t *buf) {
+	off_t start = ftello(f);
+	lzma_ret error;
+	LZMA_FILE *xz = lzma_xzWriteOpen(&error, f, UNDO_BUFFER_SIZE, UNDO_XZ_LEVEL);
+	if (!xz) return -1;
+	
+	bool ok;
+	if (block == 0) ok = write_control(undo, xz);
+	else if (block == 1) ok = write_diff(undo, xz, diff, buf);
+	else ok = write_extra(undo, xz, old_fd, buf);
+	
+	lzma_xzClose(&error, xz);
+	if (!ok || error != LZMA_OK) return -1;
+	return ftello(f) - start;
+}
+
+bool bxundo_write(bxundo_t *undo, FILE *f, const uint8_t *diff, int old_fd, uint64_t old_size, const uint8_t *new_sha1) {
+	undo->op_count = 0;
+	if (!build_ops(undo, old_size)) return false;
+	
+	uint8_t *buf = malloc(UNDO_BUFFER_SIZE);
+	if (!buf) return false;
+	
+	/* The block sizes are only known afterwards, the header is written last */
+	bxdiff40_header_t header;
+	memset(&header, 0, sizeof(header));
+	bool ok = fwrite(&header, sizeof(header), 1, f) == 1 && fwrite(new_sha1, 20, 1, f) == 1;
+	
+	off_t control_size = ok ? write_block(undo, f, 0, diff, old_fd, buf) : -1;
+	off_t diff_size = control_size >= 0 ? write_block(undo, f, 1, diff, old_fd, buf) : -1;
+	off_t extra_size = diff_size >= 0 ? write_block(undo, f, 2, diff, old_fd, buf) : -1;
+	free(buf);
+	if (extra_size < 0) return false;
+	
+	memcpy(header.magic, "BXDIFF41", 8);
+	header.control_size = bswapHostToLittle64(control_size);
+	header.diff_size = bswapHostToLittle64(diff_size);
+	header.patched_file_size = bswapHostToLittle64(old_size);
+	return !fseeko(f, 0, SEEK_SET) && fwrite(&header, sizeof(header), 1, f) == 1 && !ferror(f);
+}
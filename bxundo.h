@@ -0,0 +1,49 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bxundo_h
+#define bxundo_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Reverse patch built while a patch is applied. Every mix op tells which
+ * bytes of the old file reappear, modified by known diff bytes, at which
+ * offset of the new file; the reverse patch mixes those back with the
+ * negated diff bytes and stores the rest of the old file as extra data.
+ * The result is a BXDIFF41 patch that turns the new file into the old one.
+ */
+
+typedef struct bxundo bxundo_t;
+
+bxundo_t *bxundo_new(void);
+bool bxundo_add_mix(bxundo_t *undo, uint64_t old_offset, uint64_t new_offset, uint64_t diff_offset, uint64_t length);
+bool bxundo_write(bxundo_t *undo, FILE *f, const uint8_t *diff, int old_fd, uint64_t old_size, const uint8_t *new_sha1);
+void bxundo_free(bxundo_t *undo);
+
+#endif /* bxundo_h */
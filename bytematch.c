@@ -0,0 +1,227 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bytematch.h"
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define BYTEMATCH_X86 1
+#include <immintrin.h>
+#endif
+
+#define BYTEMATCH_ALWAYS_INLINE inline __attribute__((always_inline))
+
+typedef uint64_t (*bytematch_mask_t)(const uint8_t *old, const uint8_t *new);
+
+/* Mask of the first n < 64 equal bytes, for the tails */
+static uint64_t mask_partial(const uint8_t *old, const uint8_t *new, unsigned n) {
+	uint64_t m = 0;
+	for (unsigned i = 0; i < n; i++)
+		m |= (uint64_t)(old[i] == new[i]) << i;
+	return m;
+}
+
+static BYTEMATCH_ALWAYS_INLINE uint64_t count_with(bytematch_mask_t mask, const uint8_t *old, const uint8_t *new, uint64_t length) {
+	uint64_t matches = 0, i = 0;
+	for (; i + 64 <= length; i += 64)
+		matches += __builtin_popcountll(mask(old + i, new + i));
+	if (i < length)
+		matches += __builtin_popcountll(mask_partial(old + i, new + i, (unsigned)(length - i)));
+	return matches;
+}
+
+/*
+ * The score is matches minus mismatches. Along a run of equal bytes it
+ * only rises and along a run of different ones it only falls, so a new
+ * best can only be at the end of an equal run and the score can only drop
+ * below best - slack at the end of a different one.
+ */
+static BYTEMATCH_ALWAYS_INLINE uint64_t extent_with(bytematch_mask_t mask, const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	int64_t score = 0, best = 0;
+	uint64_t extent = 0;
+	for (uint64_t i = 0; i < limit; i += 64) {
+		unsigned n = limit - i < 64 ? (unsigned)(limit - i) : 64;
+		uint64_t m = n == 64 ? mask(old + i, new + i) : mask_partial(old + i, new + i, n);
+		
+		for (unsigned pos = 0, run; pos < n; pos += run) {
+			uint64_t rest = m >> pos;
+			if (rest & 1) {
+				run = ~rest ? (unsigned)__builtin_ctzll(~rest) : 64;
+				if (run > n - pos) run = n - pos;
+				score += run;
+				if (score > best) {
+					best = score;
+					extent = i + pos + run;
+				}
+			} else {
+				run = rest ? (unsigned)__builtin_ctzll(rest) : 64 - pos;
+				if (run > n - pos) run = n - pos;
+				score -= run;
+				if (score < best - slack)
+					return extent;
+			}
+		}
+	}
+	return extent;
+}
+
+/* Portable kernel, eight bytes at a time */
+static BYTEMATCH_ALWAYS_INLINE uint64_t mask_generic(const uint8_t *old, const uint8_t *new) {
+	uint64_t m = 0;
+	for (unsigned k = 0; k < 64; k += 8) {
+		uint64_t x, y;
+		memcpy(&x, old + k, 8);
+		memcpy(&y, new + k, 8);
+		if (x == y) {
+			m |= (uint64_t)0xFF << k;
+		} else {
+			for (unsigned j = 0; j < 8; j++)
+				m |= (uint64_t)(old[k + j] == new[k + j]) << (k + j);
+		}
+	}
+	return m;
+}
+
+static uint64_t count_generic(const uint8_t *old, const uint8_t *new, uint64_t length) {
+	return count_with(mask_generic, old, new, length);
+}
+
+static uint64_t extent_generic(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	return extent_with(mask_generic, old, new, limit, slack);
+}
+
+#ifdef BYTEMATCH_X86
+
+__attribute__((target("sse4.2,popcnt"))) static BYTEMATCH_ALWAYS_INLINE uint64_t mask_sse42(const uint8_t *old, const uint8_t *new) {
+	uint64_t m = 0;
+	for (unsigned k = 0; k < 64; k += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(old + k));
+		__m128i y = _mm_loadu_si128((const __m128i *)(new + k));
+		m |= (uint64_t)(uint16_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) << k;
+	}
+	return m;
+}
+
+__attribute__((target("sse4.2,popcnt"))) static uint64_t count_sse42(const uint8_t *old, const uint8_t *new, uint64_t length) {
+	return count_with(mask_sse42, old, new, length);
+}
+
+__attribute__((target("sse4.2,popcnt"))) static uint64_t extent_sse42(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	return extent_with(mask_sse42, old, new, limit, slack);
+}
+
+__attribute__((target("avx2,popcnt,bmi"))) static BYTEMATCH_ALWAYS_INLINE uint64_t mask_avx2(const uint8_t *old, const uint8_t *new) {
+	__m256i lo = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)old), _mm256_loadu_si256((const __m256i *)new));
+	__m256i hi = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(old + 32)), _mm256_loadu_si256((const __m256i *)(new + 32)));
+	return (uint64_t)(uint32_t)_mm256_movemask_epi8(lo) | (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
+
+__attribute__((target("avx2,popcnt,bmi"))) static uint64_t count_avx2(const uint8_t *old, const uint8_t *new, uint64_t length) {
+	return count_with(mask_avx2, old, new, length);
+}
+
+__attribute__((target("avx2,popcnt,bmi"))) static uint64_t extent_avx2(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	return extent_with(mask_avx2, old, new, limit, slack);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi"))) static BYTEMATCH_ALWAYS_INLINE uint64_t mask_avx512(const uint8_t *old, const uint8_t *new) {
+	return _mm512_cmpeq_epi8_mask(_mm512_loadu_si512(old), _mm512_loadu_si512(new));
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi"))) static uint64_t count_avx512(const uint8_t *old, const uint8_t *new, uint64_t length) {
+	return count_with(mask_avx512, old, new, length);
+}
+
+__attribute__((target("avx512f,avx512bw,popcnt,bmi"))) static uint64_t extent_avx512(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	return extent_with(mask_avx512, old, new, limit, slack);
+}
+
+#endif
+
+typedef struct {
+	const char *name;
+	uint64_t (*count)(const uint8_t *, const uint8_t *, uint64_t);
+	uint64_t (*extent)(const uint8_t *, const uint8_t *, uint64_t, int64_t);
+} bytematch_kernel_t;
+
+/* Best first */
+static const bytematch_kernel_t kernels[] = {
+#ifdef BYTEMATCH_X86
+	{"avx512", count_avx512, extent_avx512},
+	{"avx2", count_avx2, extent_avx2},
+	{"sse4.2", count_sse42, extent_sse42},
+#endif
+	{"generic", count_generic, extent_generic}
+};
+
+static const bytematch_kernel_t *kernel = NULL;
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+
+static bool kernel_supported(const bytematch_kernel_t *k) {
+#ifdef BYTEMATCH_X86
+	if (k->count == count_avx512) return __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("bmi");
+	if (k->count == count_avx2) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("bmi");
+	if (k->count == count_sse42) return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
+#endif
+	return true;
+}
+
+bool bytematch_use(const char *name) {
+	for (size_t i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++) {
+		if (name && strcmp(kernels[i].name, name)) continue;
+		if (!kernel_supported(&kernels[i])) {
+			if (name) return false;
+			continue;
+		}
+		kernel = &kernels[i];
+		return true;
+	}
+	return false;
+}
+
+static void kernel_default(void) {
+	if (!kernel) bytematch_use(NULL);
+}
+
+/* The matchers run on several threads, the default is picked exactly once */
+static const bytematch_kernel_t *current_kernel(void) {
+	pthread_once(&kernel_once, kernel_default);
+	return kernel;
+}
+
+const char *bytematch_name(void) {
+	return current_kernel()->name;
+}
+
+uint64_t bytematch_count(const uint8_t *old, const uint8_t *new, uint64_t length) {
+	return current_kernel()->count(old, new, length);
+}
+
+uint64_t bytematch_extent(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack) {
+	return current_kernel()->extent(old, new, limit, slack);
+}
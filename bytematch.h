@@ -0,0 +1,50 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef bytematch_h
+#define bytematch_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Byte comparison kernels for approximate matching. Both compare old and
+ * new 64 bytes at a time into a bit mask of equal positions and work on
+ * the mask: bytematch_count() is a popcount of it, bytematch_extent()
+ * walks its runs instead of single bytes.
+ *
+ * The kernel is picked at run time from AVX-512BW, AVX2, SSE4.2 and a
+ * portable one. bytematch_use() forces one by name and fails if the CPU
+ * does not have it; NULL picks the best again. Matching is safe from any
+ * number of threads, bytematch_use() is not and belongs before them.
+ */
+
+uint64_t bytematch_count(const uint8_t *old, const uint8_t *new, uint64_t length);
+uint64_t bytematch_extent(const uint8_t *old, const uint8_t *new, uint64_t limit, int64_t slack);
+bool bytematch_use(const char *name);
+const char *bytematch_name(void);
+
+#endif /* bytematch_h */
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hashcache.h"
+#include "bxformat.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define HASHCACHE_MAGIC "BXHASH01"
+#define HASHCACHE_MAX_ENTRIES 1024
+
+#ifdef __APPLE__
+#define st_mtim st_mtimespec
+#define st_ctim st_ctimespec
+#endif
+
+typedef struct __attribute__((packed)) {
+	uint64_t dev;
+	uint64_t ino;
+	uint64_t size;
+	uint64_t mtime_ns;
+	uint64_t ctime_ns;
+	uint8_t sha1[20];
+	uint8_t reserved[4];
+} hashcache_entry_t;
+
+bool hashcache_key(int fd, hashcache_key_t *key) {
+	struct stat st;
+	if (fstat(fd, &st) || !S_ISREG(st.st_mode)) return false;
+	
+	key->dev = st.st_dev;
+	key->ino = st.st_ino;
+	key->size = st.st_size;
+	key->mtime_ns = (uint64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+	key->ctime_ns = (uint64_t)st.st_ctim.tv_sec * 1000000000 + st.st_ctim.tv_nsec;
+	return true;
+}
+
+static bool entry_matches(const hashcache_entry_t *entry, const hashcache_key_t *key) {
+	return bswapLittleToHost64(entry->dev) == key->dev &&
+	       bswapLittleToHost64(entry->ino) == key->ino &&
+	       bswapLittleToHost64(entry->size) == key->size &&
+	       bswapLittleToHost64(entry->mtime_ns) == key->mtime_ns &&
+	       bswapLittleToHost64(entry->ctime_ns) == key->ctime_ns;
+}
+
+/* Loads all entries, returns NULL with *count == 0 if there is no usable cache */
+static hashcache_entry_t *load_entries(const char *path, size_t *count) {
+	*count = 0;
+	FILE *f = fopen(path, "rb");
+	if (!f) return NULL;
+	
+	char magic[8];
+	hashcache_entry_t *entries = NULL;
+	if (fread(magic, 1, 8, f) == 8 && !memcmp(magic, HASHCACHE_MAGIC, 8)) {
+		entries = malloc(HASHCACHE_MAX_ENTRIES * sizeof(hashcache_entry_t));
+		if (entries)
+			*count = fread(entries, sizeof(hashcache_entry_t), HASHCACHE_MAX_ENTRIES, f);
+	}
+	fclose(f);
+	return entries;
+}
+
+bool hashcache_lookup(const char *path, const hashcache_key_t *key, uint8_t *sha1) {
+	size_t count;
+	hashcache_entry_t *entries = load_entries(path, &count);
+	bool found = false;
+	
+	for (size_t i = 0; i < count; i++) {
+		if (entry_matches(&entries[i], key)) {
+			memcpy(sha1, entries[i].sha1, 20);
+			found = true;
+			break;
+		}
+	}
+	
+	if (entries) free(entries);
+	return found;
+}
+
+bool hashcache_store(const char *path, const hashcache_key_t *key, const uint8_t *sha1) {
+	size_t count;
+	hashcache_entry_t *entries = load_entries(path, &count);
+	
+	/* Entries for the same file are replaced, the oldest ones fall off the front */
+	hashcache_entry_t entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.dev = bswapHostToLittle64(key->dev);
+	entry.ino = bswapHostToLittle64(key->ino);
+	entry.size = bswapHostToLittle64(key->size);
+	entry.mtime_ns = bswapHostToLittle64(key->mtime_ns);
+	entry.ctime_ns = bswapHostToLittle64(key->ctime_ns);
+	memcpy(entry.sha1, sha1, 20);
+	
+	size_t kept = 0;
+	for (size_t i = 0; i < count; i++) {
+		if (entries[i].dev != entry.dev || entries[i].ino != entry.ino)
+			entries[kept++] = entries[i];
+	}
+	size_t first = kept >= HASHCACHE_MAX_ENTRIES ? kept - HASHCACHE_MAX_ENTRIES + 1 : 0;
+	
+	size_t tmp_length = strlen(path) + 32;
+	char *tmp_path = malloc(tmp_length);
+	if (!tmp_path) {
+		if (entries) free(entries);
+		return false;
+	}
+	snprintf(tmp_path, tmp_length, "%s.%d", path, (int)getpid());
+	
+	bool ok = false;
+	FILE *f = fopen(tmp_path, "wb");
+	if (f) {
+		ok = fwrite(HASHCACHE_MAGIC, 1, 8, f) == 8 &&
+		     fwrite(entries + first, sizeof(hashcache_entry_t), kept - first, f) == kept - first &&
+		     fwrite(&entry, sizeof(hashcache_entry_t), 1, f) == 1;
+		if (fclose(f)) ok = false;
+		if (ok) ok = !rename(tmp_path, path);
+		if (!ok) unlink(tmp_path);
+	}
+	
+	free(tmp_path);
+	if (entries) free(entries);
+	return ok;
+}
@@ -0,0 +1,197 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "hashio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+
+#define HASHIO_CHUNK (1 << 20)
+#define HASHIO_ALIGN 4096
+
+static const EVP_MD *digest_by_name(const char *algorithm) {
+	return algorithm ? EVP_get_digestbyname(algorithm) : EVP_sha1();
+}
+
+static bool hash_mapped(int fd, size_t length, EVP_MD_CTX *ctx) {
+	void *map = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) return false;
+#ifdef MADV_SEQUENTIAL
+	madvise(map, length, MADV_SEQUENTIAL);
+#endif
+	int ret = EVP_DigestUpdate(ctx, map, length);
+	munmap(map, length);
+	return ret;
+}
+
+/*
+ * Regular files are read with pread() so the descriptor's offset is kept.
+ * Hashes up to *length bytes and sets *length to the number hashed. Whole
+ * chunks are requested, which keeps reads from O_DIRECT descriptors valid.
+ */
+static bool hash_read(int fd, bool seekable, uint64_t *length, EVP_MD_CTX *ctx) {
+	void *buf;
+	if (posix_memalign(&buf, HASHIO_ALIGN, HASHIO_CHUNK)) return false;
+	
+	bool ret = true;
+	uint64_t offset = 0;
+	ssize_t n = 0;
+	while (offset < *length && (n = seekable ? pread(fd, buf, HASHIO_CHUNK, offset) : read(fd, buf, HASHIO_CHUNK)) > 0) {
+		if ((uint64_t)n > *length - offset) n = *length - offset;
+		if (!EVP_DigestUpdate(ctx, buf, n)) {
+			ret = false;
+			break;
+		}
+		offset += n;
+	}
+	if (n < 0) ret = false;
+	*length = offset;
+	
+	free(buf);
+	return ret;
+}
+
+bool hash_fd(int fd, const char *algorithm, uint8_t *dst, unsigned *dst_length) {
+	const EVP_MD *md = digest_by_name(algorithm);
+	if (!md) return false;
+	
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (!ctx) return false;
+	
+	bool ret = false;
+	if (EVP_DigestInit_ex(ctx, md, NULL)) {
+		struct stat st;
+		bool regular = !fstat(fd, &st) && S_ISREG(st.st_mode);
+		bool done = false;
+		if (regular && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX)
+			done = hash_mapped(fd, st.st_size, ctx);
+		uint64_t length = UINT64_MAX;
+		if (!done)
+			done = hash_read(fd, regular, &length, ctx);
+		if (done)
+			ret = EVP_DigestFinal_ex(ctx, dst, dst_length);
+	}
+	
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+bool hash_buffer(const void *buf, size_t length, const char *algorithm, uint8_t *dst, unsigned *dst_length) {
+	const EVP_MD *md = digest_by_name(algorithm);
+	return md && EVP_Digest(buf, length, dst, dst_length, md, NULL);
+}
+
+EVP_MD_CTX *hash_new(const char *algorithm) {
+	const EVP_MD *md = digest_by_name(algorithm);
+	if (!md) return NULL;
+	
+	EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+	if (ctx && !EVP_DigestInit_ex(ctx, md, NULL)) {
+		EVP_MD_CTX_free(ctx);
+		ctx = NULL;
+	}
+	return ctx;
+}
+
+bool hash_update_fd(EVP_MD_CTX *ctx, int fd, uint64_t length) {
+	struct stat st;
+	if (!length) return true;
+	if (fstat(fd, &st) || (S_ISREG(st.st_mode) && (uint64_t)st.st_size < length)) return false;
+	
+	/* Mapping past the end of the file would fault, hence the size check */
+	if (S_ISREG(st.st_mode) && length <= SIZE_MAX && hash_mapped(fd, length, ctx))
+		return true;
+	uint64_t hashed = length;
+	return hash_read(fd, true, &hashed, ctx) && hashed == length;
+}
+
+bool hash_final(EVP_MD_CTX *ctx, uint8_t *dst, unsigned *dst_length) {
+	bool ret = EVP_DigestFinal_ex(ctx, dst, dst_length);
+	EVP_MD_CTX_free(ctx);
+	return ret;
+}
+
+typedef struct {
+	const char **paths;
+	size_t count;
+	const char *algorithm;
+	uint8_t (*digests)[HASHIO_MAX_DIGEST];
+	bool *ok;
+	size_t next;
+	pthread_mutex_t lock;
+} hash_batch_t;
+
+static void *hash_worker(void *arg) {
+	hash_batch_t *batch = arg;
+	for (;;) {
+		pthread_mutex_lock(&batch->lock);
+		size_t i = batch->next++;
+		pthread_mutex_unlock(&batch->lock);
+		if (i >= batch->count) break;
+		
+		batch->ok[i] = false;
+		int fd = open(batch->paths[i], O_RDONLY);
+		if (fd >= 0) {
+			unsigned length;
+			batch->ok[i] = hash_fd(fd, batch->algorithm, batch->digests[i], &length);
+			close(fd);
+		}
+	}
+	return NULL;
+}
+
+bool hash_files(const char **paths, size_t count, const char *algorithm, unsigned threads, uint8_t (*digests)[HASHIO_MAX_DIGEST], bool *ok) {
+	hash_batch_t batch = {paths, count, algorithm, digests, ok, 0, PTHREAD_MUTEX_INITIALIZER};
+	
+	if (threads < 1) threads = 1;
+	if (threads > count) threads = count ? (unsigned)count : 1;
+	pthread_t *workers = malloc(threads * sizeof(pthread_t));
+	if (!workers) {
+		pthread_mutex_destroy(&batch.lock);
+		return false;
+	}
+	
+	/* The calling thread is one of the workers */
+	unsigned started = 1;
+	for (; started < threads; started++) {
+		if (pthread_create(&workers[started], NULL, hash_worker, &batch))
+			break;
+	}
+	hash_worker(&batch);
+	for (unsigned i = 1; i < started; i++)
+		pthread_join(workers[i], NULL);
+	
+	free(workers);
+	pthread_mutex_destroy(&batch.lock);
+	return true;
+}
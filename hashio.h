@@ -0,0 +1,63 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef hashio_h
+#define hashio_h
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include <openssl/evp.h>
+
+#define HASHIO_MAX_DIGEST 64
+
+/*
+ * File hashing through OpenSSL EVP, so SHA-NI / ARMv8 crypto extensions
+ * are picked up when available. Regular files are mapped, anything that
+ * can not be mapped is read in large aligned chunks. algorithm is an EVP
+ * digest name ("SHA1", "BLAKE2b512", ...), NULL means SHA1.
+ */
+
+bool hash_fd(int fd, const char *algorithm, uint8_t *dst, unsigned *dst_length);
+bool hash_buffer(const void *buf, size_t length, const char *algorithm, uint8_t *dst, unsigned *dst_length);
+
+/*
+ * Incremental hashing for data that is produced piecewise. hash_update_fd
+ * adds the first length bytes of fd, which must have that many.
+ * hash_final frees the context, also when it fails.
+ */
+EVP_MD_CTX *hash_new(const char *algorithm);
+bool hash_update_fd(EVP_MD_CTX *ctx, int fd, uint64_t length);
+bool hash_final(EVP_MD_CTX *ctx, uint8_t *dst, unsigned *dst_length);
+
+/*
+ * Hashes count files on up to threads worker threads. ok[i] tells whether
+ * digests[i] is valid. Returns false only if the workers could not start.
+ */
+bool hash_files(const char **paths, size_t count, const char *algorithm, unsigned threads, uint8_t (*digests)[HASHIO_MAX_DIGEST], bool *ok);
+
+#endif /* hashio_h */
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+#
+# Test-only BXDIFF patch writer. It matches nothing, it just cuts the new
+# file into random mix and copy ops against random positions of the old
+# file, which is enough to exercise every path of the patch formats.
+#
+# mkpatch.py data <size> <seed> <oldfile> <newfile>
+#     writes a random old file and a new file that is the old one with some
+#     bytes changed, a range inserted and a range removed
+# mkpatch.py <40|41|50> <oldfile> <newfile> <patchfile>
+#     writes a patch in the given format; BXDIFF50 blocks are pbzx framed
+#     XZ chunks with every third chunk stored raw
+# mkpatch.py shift <MB> <oldfile> <newfile> <patchfile>
+#     writes a random old file of <MB> MB, a new file with every byte one
+#     larger and a BXDIFF50 patch with a 1 MB op and one op for the rest,
+#     quickly even for files large enough to reach a --resume checkpoint,
+#     which then falls inside the second op
+#
+
+import hashlib
+import lzma
+import random
+import struct
+import sys
+
+
+def integer(value):
+	data = bytearray(struct.pack('<Q', abs(value)))
+	if value < 0:
+		data[7] |= 0x80
+	return bytes(data)
+
+
+def controls(ops):
+	return b''.join(integer(mix) + integer(copy) + integer(seek) for mix, copy, seek in ops)
+
+
+def random_ops(old, new, seed=1):
+	rnd = random.Random(seed)
+	ops = []
+	diff = bytearray()
+	extra = bytearray()
+	in_offset = out_offset = 0
+	while out_offset < len(new):
+		mix = min(rnd.randint(0, 5000), len(new) - out_offset, max(0, len(old) - in_offset))
+		diff += bytes((n - o) & 0xff for n, o in zip(new[out_offset:out_offset + mix], old[in_offset:in_offset + mix]))
+		in_offset += mix
+		out_offset += mix
+		copy = min(rnd.randint(0, 300), len(new) - out_offset)
+		extra += new[out_offset:out_offset + copy]
+		out_offset += copy
+		target = rnd.randint(0, max(0, len(old) - 1))
+		ops.append((mix, copy, target - in_offset))
+		in_offset = target
+	return ops, bytes(diff), bytes(extra)
+
+
+def pbzx(data, chunk, raw):
+	out = bytearray(b'pbzx') + struct.pack('>QQ', 1 << 24, len(data))
+	if not data:
+		return bytes(out[:12])
+	for n, i in enumerate(range(0, len(data), chunk)):
+		piece = data[i:i + chunk]
+		body = piece if raw and n % 3 == 2 else lzma.compress(piece, check=lzma.CHECK_NONE)
+		if n:
+			out += struct.pack('>Q', 1 << 24)
+		out += struct.pack('>Q', len(body)) + body
+	return bytes(out)
+
+
+def write_patch(version, old, new, ops, diff, extra, path, chunk=65536, raw=True):
+	ctrl = controls(ops)
+	if version in ('40', '41'):
+		blocks = [lzma.compress(block, preset=1) for block in (ctrl, diff, extra)]
+		header = b'BXDIFF' + version.encode() + struct.pack('<QQQ', len(blocks[0]), len(blocks[1]), len(new))
+		if version == '41':
+			header += hashlib.sha1(old).digest()
+	elif version == '50':
+		blocks = [pbzx(block, chunk, raw) for block in (ctrl, diff, extra)]
+		header = b'BXDIFF50' + struct.pack('<QQQQ', 0, len(new), len(blocks[0]), len(blocks[2]))
+		header += hashlib.sha1(new).digest() + struct.pack('<Q', len(blocks[1])) + hashlib.sha1(old).digest()
+	else:
+		sys.exit('unknown format ' + version)
+	with open(path, 'wb') as f:
+		f.write(header + b''.join(blocks))
+
+
+def make_data(size, seed):
+	rnd = random.Random(seed)
+	old = rnd.randbytes(size)
+	new = bytearray(old)
+	for _ in range(200):
+		new[rnd.randrange(len(new))] = rnd.randrange(256)
+	at = rnd.randrange(len(new))
+	new[at:at] = rnd.randbytes(10000)
+	at = rnd.randrange(len(new) - 5000)
+	del new[at:at + 5000]
+	return old, bytes(new)
+
+
+def main(argv):
+	if len(argv) != (5 if argv[:1] in (['data'], ['shift']) else 4):
+		sys.exit('usage: mkpatch.py data <size> <seed> <oldfile> <newfile>\n'
+		         '       mkpatch.py <40|41|50> <oldfile> <newfile> <patchfile>\n'
+		         '       mkpatch.py shift <MB> <oldfile> <newfile> <patchfile>')
+	if argv[0] == 'data':
+		old, new = make_data(int(argv[1]), int(argv[2]))
+		open(argv[3], 'wb').write(old)
+		open(argv[4], 'wb').write(new)
+	elif argv[0] == 'shift':
+		mb = int(argv[1])
+		old = random.Random(mb).randbytes(mb << 20)
+		new = old.translate(bytes((i + 1) & 0xff for i in range(256)))
+		open(argv[2], 'wb').write(old)
+		open(argv[3], 'wb').write(new)
+		ops = [(1 << 20, 0, 0), ((mb - 1) << 20, 0, 0)]
+		write_patch('50', old, new, ops, b'\x01' * len(old), b'', argv[4], 1 << 22, False)
+	else:
+		old = open(argv[1], 'rb').read()
+		new = open(argv[2], 'rb').read()
+		write_patch(argv[0], old, new, *random_ops(old, new), argv[3])
+
+
+main(sys.argv[1:])
@@ -0,0 +1,329 @@
+#!/bin/sh
+#
+# Round-trip tests. Old and new files and patches between them are made by
+# tests/mkpatch.py, applied with the tools in <bindir> (. by default) and
+# the results compared with the new files.
+#
+# usage: tests/run.sh [<bindir>]
+#
+
+bin=$(cd "${1:-.}" && pwd) || exit 1
+tests=$(cd "$(dirname "$0")" && pwd) || exit 1
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+trap 'exit 1' HUP INT TERM
+cd "$work" || exit 1
+# A wrong old file makes bxpatch ask whether to continue; the answer is no
+exec < /dev/null
+
+failed=0
+
+check() {
+	name=$1
+	shift
+	if "$@"; then
+		echo "ok      $name"
+	else
+		echo "FAILED  $name"
+		failed=1
+	fi
+}
+
+mkpatch() {
+	python3 "$tests/mkpatch.py" "$@" || exit 1
+}
+
+# Bytes <offset> to <offset> + <length> of <file>
+slice() {
+	tail -c +$(($2 + 1)) "$1" | head -c "$3"
+}
+
+mkpatch data 3145728 1 old new
+for version in 40 41 50; do
+	mkpatch $version old new p$version
+done
+new_size=$(wc -c < new)
+
+applies() {
+	rm -f out
+	"$bin/bxpatch" "$@" > /dev/null 2>&1 && cmp -s out new
+}
+for version in 40 41 50; do
+	check "apply BXDIFF$version" applies old out p$version
+done
+
+# -d: the new file written with O_DIRECT; its size is not a multiple of the
+# block size, so the tail goes out through the page cache, and a new file
+# cut to whole blocks has no tail at all
+for version in 40 41 50; do
+	check "apply BXDIFF$version -d" applies -d old out p$version
+	check "apply BXDIFF$version -d with --no-uring" applies -d --no-uring old out p$version
+done
+head -c 3145728 new > new.aligned
+mkpatch 41 old new.aligned p41.aligned
+aligned_applies() {
+	rm -f out
+	"$bin/bxpatch" -d $1 old out p41.aligned > /dev/null 2>&1 && cmp -s out new.aligned
+}
+check "apply -d, block aligned size" aligned_applies
+check "apply -d with --no-uring, block aligned size" aligned_applies --no-uring
+
+# --trace: the trace of a local apply is Chrome trace JSON with an event
+# for hashing the old file and for decoding the patch
+traces() {
+	applies --trace trace.json "$@" && python3 -m json.tool trace.json > /dev/null 2>&1 &&
+	python3 -c '
+import json, sys
+events = json.load(open("trace.json"))["traceEvents"]
+names = {event["name"] for event in events if {"name", "ph", "ts", "pid", "tid"} <= event.keys()}
+sys.exit(not {"hash input", "control block"} <= names)'
+}
+for version in 41 50; do
+	check "trace BXDIFF$version" traces old out p$version
+	check "trace BXDIFF$version with --no-uring" traces --no-uring old out p$version
+done
+
+# Pipe mode: the patch read from a pipe, the new file written to one; for
+# BXDIFF40/41 the extra block is then read up to the end of the stream
+streams() {
+	rm -f out
+	case $1 in
+	patch) cat "$2" | "$bin/bxpatch" old out - > /dev/null 2>&1 ;;
+	output) "$bin/bxpatch" old - "$2" 2> /dev/null | cat > out ;;
+	both) cat "$2" | "$bin/bxpatch" old - - 2> /dev/null | cat > out ;;
+	esac
+	cmp -s out new
+}
+for version in 40 41 50; do
+	for stream in patch output both; do
+		check "apply BXDIFF$version, $stream through a pipe" streams $stream p$version
+	done
+done
+truncated_stream_refused() {
+	! head -c $(($(wc -c < "$1") - 100)) "$1" | "$bin/bxpatch" old out - > /dev/null 2>&1
+}
+for version in 40 41; do
+	check "truncated BXDIFF$version through a pipe" truncated_stream_refused p$version
+done
+
+# --prepare and -c: a BXPREP01 cache replaces decoding the patch it was made
+# from; a cache made from another patch is ignored and the patch decoded
+for version in 40 41 50; do
+	"$bin/bxpatch" --prepare p$version p$version.prepared > /dev/null || exit 1
+done
+prepared_applies() {
+	rm -f out
+	"$bin/bxpatch" -c "$1" --trace trace.json old out "$2" > log 2>&1 && cmp -s out new &&
+	! grep -q "does not match" log && ! grep -q '"name":"diff block"' trace.json
+}
+prepared_falls_back() {
+	rm -f out
+	"$bin/bxpatch" -c "$1" old out "$2" > log 2>&1 && cmp -s out new && grep -q "does not match the patch, decoding it instead" log
+}
+for version in 40 41 50; do
+	check "prepared BXDIFF$version" prepared_applies p$version.prepared p$version
+done
+check "prepared cache of another patch" prepared_falls_back p50.prepared p41
+
+# -H: the digest of the old file is cached; once the file is rewritten in
+# place, with another size or with the same size, it is hashed again and a
+# wrong old file is still refused
+cp old old.cached
+hash_cached() {
+	rm -f out
+	"$bin/bxpatch" -H hashcache --trace trace.json old.cached out p41 > /dev/null 2>&1 && cmp -s out new &&
+	if [ "$1" = hashed ]; then grep -q '"name":"hash input"' trace.json; else ! grep -q '"name":"hash input"' trace.json; fi
+}
+hash_cache_refuses() {
+	"$bin/bxpatch" -H hashcache --trace trace.json old.cached out p41 > log 2>&1
+	test $? -ne 0 && grep -q "wrong SHA1 hash" log && grep -q '"name":"hash input"' trace.json
+}
+check "hash cache miss" hash_cached hashed
+check "hash cache hit" hash_cached cached
+cat new > old.cached
+check "hash cache stale size" hash_cache_refuses
+cat old > old.cached
+check "hash cache restored file" hash_cached hashed
+# Same size, so only the timestamps tell; some file systems keep seconds
+sleep 1
+printf X | dd of=old.cached bs=1 seek=4096 conv=notrunc 2> /dev/null
+check "hash cache stale contents" hash_cache_refuses
+
+# bxindex -x: ranges at the start, across index checkpoints and at the end
+range_matches() {
+	"$bin/bxindex" -x "$1" "$2" old "$3" "$3.index" > range 2>/dev/null && slice new "$1" "$2" | cmp -s - range
+}
+range_refused() {
+	! "$bin/bxindex" -x "$1" "$2" "${4:-old}" "$3" "$3.index" > range 2>/dev/null
+}
+for version in 40 41 50; do
+	"$bin/bxindex" -i 1 p$version p$version.index > /dev/null || exit 1
+	check "range BXDIFF$version start" range_matches 0 4096 p$version
+	check "range BXDIFF$version checkpoints" range_matches 1000000 1200000 p$version
+	check "range BXDIFF$version end" range_matches $((new_size - 5000)) 5000 p$version
+	check "range BXDIFF$version past end" range_refused $((new_size - 10)) 11 p$version
+done
+check "range wrong old file" range_refused 0 100 p41 new
+
+# bxdiff --estimate: old and new share almost everything and are worth a
+# patch, an unrelated random file is not
+estimates() {
+	"$bin/bxdiff" --estimate old "$1" > estimate 2> /dev/null &&
+	grep -q "^old size: $(wc -c < old)\$" estimate && grep -q "^new size: $(wc -c < "$1")\$" estimate &&
+	grep -q "^patch size: [0-9]* ([0-9]* - [0-9]* " estimate && grep -q "^verdict: $2\$" estimate
+}
+mkpatch data 1048576 2 unrelated unrelated.new
+check "estimate" estimates new diff
+check "estimate unrelated file" estimates unrelated skip
+
+# BXDIFF51 branch filters: the filter is undone exactly, a patch between the
+# filtered files marked with bxfilter -m applies to the original old file
+unfilters() {
+	rm -f out
+	"$bin/bxfilter" -d $1 old.$1 out && ! cmp -s old.$1 old && cmp -s out old
+}
+for filter in x86 arm64; do
+	"$bin/bxfilter" $filter old old.$filter && "$bin/bxfilter" $filter new new.$filter || exit 1
+	mkpatch 50 old.$filter new.$filter p51.$filter
+	"$bin/bxfilter" -m $filter old new p51.$filter || exit 1
+	check "filter $filter inverse" unfilters $filter
+	check "apply BXDIFF51 $filter" applies old out p51.$filter
+	check "apply BXDIFF51 $filter with --no-uring" applies --no-uring old out p51.$filter
+done
+
+# bxinfo: every format is read and reports the size of the new file, and
+# the size of the old file when it is given
+describes() {
+	"$bin/bxinfo" "$1" old > info 2> /dev/null && grep -q "^version: BXDIFF$2\$" info &&
+	grep -q "^patched file size: $new_size\$" info && grep -q "^old file size: $(wc -c < old)\$" info &&
+	"$bin/bxinfo" -j "$1" > info 2> /dev/null && python3 -m json.tool info > /dev/null 2>&1 &&
+	grep -q "\"patched_file_size\": $new_size," info
+}
+for version in 40 41 50; do
+	check "info BXDIFF$version" describes p$version $version
+done
+check "info BXDIFF51" describes p51.x86 51
+
+# bxhash: digests match sha1sum and sha256sum on one and on several threads,
+# an unknown digest is refused
+: > empty
+hashes() {
+	"$bin/bxhash" "$@" old new p41 empty > digests 2> /dev/null &&
+	case "$*" in *sha256*) sha256sum old new p41 empty ;; *) sha1sum old new p41 empty ;; esac | cmp -s - digests
+}
+check "bxhash sha1" hashes
+check "bxhash sha1 on 2 threads" hashes -j 2
+check "bxhash sha256 on 2 threads" hashes -a sha256 -j 2
+unknown_digest_refused() {
+	! "$bin/bxhash" -a nope old > /dev/null 2>&1
+}
+check "bxhash unknown digest" unknown_digest_refused
+
+# bxrecode: BXDIFF50 and filtered BXDIFF51 patches recoded with xz, zstd
+# and a mix of both still apply; zstd is skipped in builds without it
+recodes() {
+	"$bin/bxrecode" $2 "$1" recoded > /dev/null 2>&1 || return 1
+	applies old out recoded
+}
+if "$bin/bxrecode" -c zstd -d zstd -e zstd p50 recoded > /dev/null 2>&1; then
+	codecs="xz zstd"
+else
+	codecs="xz"
+	echo "skipped zstd (not built with WITH_ZSTD)"
+fi
+for codec in $codecs; do
+	check "recode BXDIFF50 $codec" recodes p50 "-c $codec -d $codec -e $codec"
+	check "recode BXDIFF51 x86 $codec" recodes p51.x86 "-c $codec -d $codec -e $codec"
+done
+if [ "$codecs" != xz ]; then
+	check "recode BXDIFF50 xz and zstd" recodes p50 "-c xz -d zstd -e xz"
+	check "recode BXDIFF50 zstd without long distance matching" recodes p50 "-l 3 -w 0"
+fi
+
+# --emit-undo: the undo patch turns the new file back into the old one
+undoes() {
+	rm -f out undo back
+	"$bin/bxpatch" --emit-undo undo $2 old out "$1" > /dev/null 2>&1 && cmp -s out new &&
+	"$bin/bxpatch" new back undo > /dev/null 2>&1 && cmp -s back old
+}
+for version in 40 41 50; do
+	check "undo BXDIFF$version" undoes p$version
+	check "undo BXDIFF$version with --no-uring" undoes p$version --no-uring
+done
+
+# --fan-out: several patches applied to one old file in one run; a patch for
+# another old file stops the run before any new file is written
+mkpatch 41 new old reverse.p41
+fans_out() {
+	rm -f out.40 out.41 out.50
+	"$bin/bxpatch" --fan-out "$@" old out.40 p40 out.41 p41 out.50 p50 > /dev/null 2>&1 &&
+	cmp -s out.40 new && cmp -s out.41 new && cmp -s out.50 new
+}
+fan_out_refused() {
+	rm -f out.40 out.41
+	! "$bin/bxpatch" --fan-out old out.40 p40 out.41 reverse.p41 > /dev/null 2>&1 &&
+	test ! -e out.40 && test ! -e out.41
+}
+check "fan-out" fans_out
+check "fan-out on one thread" fans_out -j 1
+check "fan-out wrong old file" fan_out_refused
+
+# bxpatchd: every patch is applied through the daemon twice, the second time
+# from its caches; a patch for another old file is refused
+"$bin/bxpatchd" -w 2 "$work/daemon.sock" 2> /dev/null &
+daemon=$!
+for i in 1 2 3 4 5 6 7 8 9 10; do
+	test -S daemon.sock && break
+	sleep 1
+done
+served_cached() {
+	applies --daemon daemon.sock --trace trace.json old out "$1" &&
+	grep -q '"base_cached":true,"patch_cached":true' trace.json
+}
+for version in 40 41 50; do
+	check "daemon BXDIFF$version" applies --daemon daemon.sock old out p$version
+	check "daemon BXDIFF$version cached" served_cached p$version
+done
+daemon_refuses() {
+	! "$bin/bxpatch" --daemon daemon.sock new out p41 > /dev/null 2>&1
+}
+check "daemon wrong old file" daemon_refuses
+daemon_rejects() {
+	! "$bin/bxpatch" --daemon daemon.sock $1 old out p41 > /dev/null 2>&1 && test ! -e out
+}
+rm -f out
+for option in -d "-c cache" "-H hashcache" --resume "--emit-undo undo" --huge-pages; do
+	check "daemon rejects $option" daemon_rejects "$option"
+done
+kill $daemon
+wait $daemon 2> /dev/null
+
+# --resume: a run stopped by the file size limit after its first checkpoint
+# at 64 MB (the limit is 80 MB in 512 byte blocks), inside the 95 MB op of
+# the patch, is continued by the same command, also with the other backend
+mkpatch shift 96 shift.old shift.new shift.patch
+interrupted() {
+	rm -f out out.bxresume
+	(ulimit -f 163840; trap '' XFSZ; "$bin/bxpatch" --resume $1 shift.old out shift.patch > /dev/null 2>&1)
+	test -s out.bxresume
+}
+resumes() {
+	interrupted "$1" || return 1
+	"$bin/bxpatch" --resume $2 shift.old out shift.patch > log 2>&1 &&
+	grep -q "Resuming at 67108864 bytes" log && ! grep -q corrupt log &&
+	cmp -s out shift.new && test ! -e out.bxresume
+}
+resume_checks_output() {
+	interrupted || return 1
+	printf X | dd of=out bs=1 seek=1000 conv=notrunc 2> /dev/null
+	"$bin/bxpatch" --resume shift.old out shift.patch > log 2>&1
+	grep -q "Output file is corrupt" log
+}
+check "resume" resumes
+check "resume with --no-uring" resumes --no-uring --no-uring
+check "resume io_uring run with --no-uring" resumes "" --no-uring
+check "resume --no-uring run with io_uring" resumes --no-uring
+check "resume damaged output" resume_checks_output
+rm -f shift.old shift.new out
+
+exit $failed
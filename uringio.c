@@ -0,0 +1,250 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "uringio.h"
+#include <stdlib.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+struct uring {
+	int fd;
+	void *sq_ring, *cq_ring;
+	size_t sq_ring_size, cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_cqe *cqes;
+
+	unsigned sq_entries;
+	unsigned queued;	/* prepared but not yet submitted SQEs */
+};
+
+/*
+ * IORING_OP_READ and IORING_OP_WRITE came with Linux 5.6, as did the probe.
+ * Older kernels set up rings fine but fail every such request, so a ring
+ * is only handed out if the kernel says it supports both.
+ */
+static bool uring_probe(int fd) {
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe *probe = calloc(1, size);
+	if (!probe) return false;
+	bool ok = syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) >= 0 &&
+	          probe->last_op >= IORING_OP_WRITE &&
+	          (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED) &&
+	          (probe->ops[IORING_OP_WRITE].flags & IO_URING_OP_SUPPORTED);
+	free(probe);
+	return ok;
+}
+
+URING *uring_open(unsigned entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	int fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+	if (fd < 0) return NULL;
+	if (!uring_probe(fd)) {
+		close(fd);
+		return NULL;
+	}
+
+	URING *ring = calloc(1, sizeof(URING));
+	if (!ring) {
+		close(fd);
+		return NULL;
+	}
+	ring->fd = fd;
+	ring->sq_entries = p.sq_entries;
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) goto error;
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			goto error;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		goto error;
+	}
+
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = ring->sq_ring + p.sq_off.ring_mask;
+	ring->sq_array = ring->sq_ring + p.sq_off.array;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = ring->cq_ring + p.cq_off.ring_mask;
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return ring;
+
+error:
+	close(fd);
+	free(ring);
+	return NULL;
+}
+
+static bool uring_prep(URING *ring, int op, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+	unsigned head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	unsigned tail = *ring->sq_tail + ring->queued;
+	if (tail - head >= ring->sq_entries) return false;
+
+	unsigned index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)buf;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = tag;
+	ring->sq_array[index] = index;
+	ring->queued++;
+	return true;
+}
+
+bool uring_read(URING *ring, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+	return uring_prep(ring, IORING_OP_READ, fd, buf, len, offset, tag);
+}
+
+bool uring_write(URING *ring, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+	return uring_prep(ring, IORING_OP_WRITE, fd, buf, len, offset, tag);
+}
+
+/*
+ * Submits everything prepared so far and blocks until at least wait_nr
+ * completions are available. Returns a negative errno on failure.
+ */
+int uring_submit(URING *ring, unsigned wait_nr) {
+	unsigned to_submit = ring->queued;
+	if (to_submit) __atomic_store_n(ring->sq_tail, *ring->sq_tail + to_submit, __ATOMIC_RELEASE);
+	ring->queued = 0;
+
+	while (to_submit || wait_nr) {
+		int ret = (int)syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (ret < 0) {
+			if (errno == EINTR) continue;
+			return -errno;
+		}
+		to_submit -= (unsigned)ret;
+		wait_nr = 0;
+	}
+	return 0;
+}
+
+bool uring_complete(URING *ring, uint64_t *tag, int32_t *res) {
+	unsigned head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return false;
+
+	struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+	*tag = cqe->user_data;
+	*res = cqe->res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	return true;
+}
+
+void uring_close(URING *ring) {
+	if (ring) {
+		munmap(ring->sqes, ring->sqes_size);
+		if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		free(ring);
+	}
+}
+
+#else
+
+URING *uring_open(unsigned entries) {
+	(void)entries;
+	return NULL;
+}
+
+bool uring_read(URING *ring, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+	(void)ring;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offset;
+	(void)tag;
+	return false;
+}
+
+bool uring_write(URING *ring, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t tag) {
+	(void)ring;
+	(void)fd;
+	(void)buf;
+	(void)len;
+	(void)offset;
+	(void)tag;
+	return false;
+}
+
+int uring_submit(URING *ring, unsigned wait_nr) {
+	(void)ring;
+	(void)wait_nr;
+	return -1;
+}
+
+bool uring_complete(URING *ring, uint64_t *tag, int32_t *res) {
+	(void)ring;
+	(void)tag;
+	(void)res;
+	return false;
+}
+
+void uring_close(URING *ring) {
+	(void)ring;
+}
+
+#endif
@@ -0,0 +1,49 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef uringio_h
+#define uringio_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Minimal io_uring wrapper built on the raw syscalls, so no liburing is
+ * needed. On systems without io_uring, or whose kernel lacks the read and
+ * write opcodes (before 5.6), uring_open() returns NULL and callers are
+ * expected to fall back to stdio.
+ */
+
+typedef struct uring URING;
+
+URING *uring_open(unsigned entries);
+bool uring_read(URING *ring, int fd, void *buf, uint32_t len, uint64_t offset, uint64_t tag);
+bool uring_write(URING *ring, int fd, const void *buf, uint32_t len, uint64_t offset, uint64_t tag);
+int uring_submit(URING *ring, unsigned wait_nr);
+bool uring_complete(URING *ring, uint64_t *tag, int32_t *res);
+void uring_close(URING *ring);
+
+#endif /* uringio_h */
@@ -0,0 +1,130 @@
+/*
+ * Copyright 2014-2016, Pupyshev Nikita. <npupyshev@icloud.com>
+ * All rights reserved
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted providing that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT,
+ * STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING
+ * IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "zstdio.h"
+#include <stdlib.h>
+
+#ifdef WITH_ZSTD
+
+#include <zstd.h>
+
+struct zstd_file {
+	FILE *f;
+	ZSTD_CCtx *cctx;
+	void *buffer;
+	size_t bs;
+};
+
+ZSTD_FILE *zstd_WriteOpen(bool *error, FILE *f, int blockSize, int level, int windowLog, const void *dict, size_t dictSize) {
+	*error = true;
+	if (!f || !blockSize) return NULL;
+	
+	ZSTD_FILE *file = calloc(1, sizeof(ZSTD_FILE));
+	if (!file) return NULL;
+	file->f = f;
+	file->bs = blockSize;
+	file->buffer = malloc(blockSize);
+	file->cctx = ZSTD_createCCtx();
+	if (!file->buffer || !file->cctx) goto error;
+	
+	if (ZSTD_isError(ZSTD_CCtx_setParameter(file->cctx, ZSTD_c_compressionLevel, level)) ||
+	    ZSTD_isError(ZSTD_CCtx_setParameter(file->cctx, ZSTD_c_checksumFlag, 1)))
+		goto error;
+	if (windowLog) {
+		if (ZSTD_isError(ZSTD_CCtx_setParameter(file->cctx, ZSTD_c_enableLongDistanceMatching, 1)) ||
+		    ZSTD_isError(ZSTD_CCtx_setParameter(file->cctx, ZSTD_c_windowLog, windowLog)))
+			goto error;
+	}
+	if (dict && ZSTD_isError(ZSTD_CCtx_loadDictionary(file->cctx, dict, dictSize)))
+		goto error;
+	
+	*error = false;
+	return file;
+	
+error:
+	ZSTD_freeCCtx(file->cctx);
+	free(file->buffer);
+	free(file);
+	return NULL;
+}
+
+static void zstd_Code(bool *error, ZSTD_FILE *file, const void *buf, size_t len, ZSTD_EndDirective mode) {
+	ZSTD_inBuffer in = {buf, len, 0};
+	size_t remaining;
+	do {
+		ZSTD_outBuffer out = {file->buffer, file->bs, 0};
+		remaining = ZSTD_compressStream2(file->cctx, &out, &in, mode);
+		if (ZSTD_isError(remaining)) {
+			*error = true;
+			return;
+		}
+		if (out.pos && fwrite(file->buffer, 1, out.pos, file->f) != out.pos) {
+			*error = true;
+			return;
+		}
+	} while (mode == ZSTD_e_end ? remaining != 0 : in.pos < in.size);
+}
+
+void zstd_Write(bool *error, ZSTD_FILE *file, const void *buf, size_t len) {
+	if (file) zstd_Code(error, file, buf, len, ZSTD_e_continue);
+	else *error = true;
+}
+
+void zstd_Close(bool *error, ZSTD_FILE *file) {
+	if (file) {
+		zstd_Code(error, file, NULL, 0, ZSTD_e_end);
+		ZSTD_freeCCtx(file->cctx);
+		free(file->buffer);
+		free(file);
+	}
+}
+
+#else
+
+ZSTD_FILE *zstd_WriteOpen(bool *error, FILE *f, int blockSize, int level, int windowLog, const void *dict, size_t dictSize) {
+	(void)f;
+	(void)blockSize;
+	(void)level;
+	(void)windowLog;
+	(void)dict;
+	(void)dictSize;
+	*error = true;
+	return NULL;
+}
+
+void zstd_Write(bool *error, ZSTD_FILE *file, const void *buf, size_t len) {
+	(void)file;
+	(void)buf;
+	(void)len;
+	*error = true;
+}
+
+void zstd_Close(bool *error, ZSTD_FILE *file) {
+	(void)error;
+	(void)file;
+}
+
+#endif